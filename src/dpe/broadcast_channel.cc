@@ -0,0 +1,93 @@
+#include "dpe/broadcast_channel.h"
+
+namespace dpe {
+// The number of ports tried by Publish.
+static const int kPublishTries = 16;
+
+BroadcastChannel::BroadcastChannel()
+    : publisher_(base::INVALID_CHANNEL_ID), closed_(false) {
+  base::zmq_message_center()->AddMessageHandler(this);
+}
+
+BroadcastChannel::~BroadcastChannel() { Close(); }
+
+bool BroadcastChannel::Publish(const std::string& ip) {
+  if (closed_) {
+    return false;
+  }
+  if (publisher_ != base::INVALID_CHANNEL_ID) {
+    return true;
+  }
+  auto* center = base::zmq_message_center();
+  for (int i = 0; i < kPublishTries; ++i) {
+    const std::string address = base::AddressHelper::MakeZMQTCPAddress(
+        ip, base::AddressHelper::GetNextAvailablePort());
+    void* channel =
+        center->RegisterChannel(base::CHANNEL_TYPE_PUB, address, true);
+    if (channel != base::INVALID_CHANNEL_ID) {
+      publisher_ = channel;
+      address_ = address;
+      LOG(INFO) << "Broadcast channel: " << address_;
+      return true;
+    }
+  }
+  LOG(ERROR) << "Cannot bind broadcast channel on " << ip;
+  return false;
+}
+
+void BroadcastChannel::Send(const Broadcast& message) {
+  if (publisher_ == base::INVALID_CHANNEL_ID) {
+    return;
+  }
+  std::string data;
+  message.SerializeToString(&data);
+  base::zmq_message_center()->SendMessage(publisher_, data.c_str(),
+                                          static_cast<int32_t>(data.size()));
+}
+
+void BroadcastChannel::Subscribe(const std::string& address) {
+  if (closed_ || address.empty() || subscribers_.count(address)) {
+    return;
+  }
+  void* channel = base::zmq_message_center()->RegisterChannel(
+      base::CHANNEL_TYPE_SUB, address, false);
+  if (channel == base::INVALID_CHANNEL_ID) {
+    LOG(WARNING) << "Cannot subscribe to broadcast channel " << address;
+    return;
+  }
+  subscribers_[address] = channel;
+  LOG(INFO) << "Subscribed to broadcast channel " << address;
+}
+
+void BroadcastChannel::Close() {
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+  auto* center = base::zmq_message_center();
+  if (publisher_ != base::INVALID_CHANNEL_ID) {
+    center->RemoveChannel(publisher_);
+    publisher_ = base::INVALID_CHANNEL_ID;
+  }
+  for (auto& iter : subscribers_) {
+    center->RemoveChannel(iter.second);
+  }
+  subscribers_.clear();
+  center->RemoveMessageHandler(this);
+}
+
+int32_t BroadcastChannel::handle_message(void* handle,
+                                         const std::string& data) {
+  for (auto& iter : subscribers_) {
+    if (iter.second != handle) {
+      continue;
+    }
+    Broadcast message;
+    if (message.ParseFromString(data) && !callback_.is_null()) {
+      callback_.Run(message);
+    }
+    return 1;
+  }
+  return 0;
+}
+}  // namespace dpe
@@ -0,0 +1,60 @@
+#ifndef DPE_BROADCAST_CHANNEL_H_
+#define DPE_BROADCAST_CHANNEL_H_
+
+#include <map>
+#include <string>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe_base/zmq_adapter.h"
+#include "dpe/proto/dpe.pb.h"
+
+namespace dpe {
+// The messages from the master to all the workers, over a PUB socket of the
+// MessageCenter.
+//
+// The master binds the channel on a free port and puts its address in the
+// replies, a worker subscribes to every address it sees. A message may be
+// lost, e.g. one sent before the worker subscribes, so the master sends its
+// latest state again periodically. All the methods are called on the UI
+// thread.
+class BroadcastChannel : public base::MessageHandler,
+                         public base::RefCounted<BroadcastChannel> {
+ public:
+  typedef base::Callback<void(const Broadcast& message)> MessageCallback;
+
+  BroadcastChannel();
+
+  // The master side. Binds the channel on |ip|, it is bound once.
+  // Returns false if no port is available.
+  bool Publish(const std::string& ip);
+  void Send(const Broadcast& message);
+  // Empty if the channel is not bound.
+  const std::string& address() const { return address_; }
+
+  // The worker side. |callback| receives the messages of the subscribed
+  // channels.
+  void set_message_callback(const MessageCallback& callback) {
+    callback_ = callback;
+  }
+  void Subscribe(const std::string& address);
+
+  // Removes the sockets, the channel is not used after it.
+  void Close();
+
+  int32_t handle_message(void* handle, const std::string& data) override;
+
+ private:
+  friend class base::RefCounted<BroadcastChannel>;
+  ~BroadcastChannel();
+
+  void* publisher_;
+  std::string address_;
+  // Address -> the SUB socket.
+  std::map<std::string, void*> subscribers_;
+  MessageCallback callback_;
+  bool closed_;
+
+  DISALLOW_COPY_AND_ASSIGN(BroadcastChannel);
+};
+}  // namespace dpe
+#endif
@@ -0,0 +1,20 @@
+#include "dpe/cancel_flag.h"
+
+namespace dpe {
+CancelFlagValue::CancelFlagValue(bool cancellable)
+    : cancellable_(cancellable), cancelled_(false) {}
+
+bool CancelFlagValue::IsCancelled() const {
+  return cancelled_.load(std::memory_order_relaxed);
+}
+
+void CancelFlagValue::Cancel() {
+  if (cancellable_) {
+    Set();
+  }
+}
+
+void CancelFlagValue::Set() {
+  cancelled_.store(true, std::memory_order_relaxed);
+}
+}  // namespace dpe
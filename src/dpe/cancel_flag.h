@@ -0,0 +1,34 @@
+#ifndef DPE_CANCEL_FLAG_H_
+#define DPE_CANCEL_FLAG_H_
+
+#include <atomic>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe/dpe.h"
+
+namespace dpe {
+// The cancel flag of a job on the master or a worker, the computing threads
+// poll it without a lock.
+class CancelFlagValue : public CancelFlag,
+                        public base::RefCountedThreadSafe<CancelFlagValue> {
+ public:
+  // Cancel is ignored unless |cancellable| is true, the job of a worker is
+  // cancelled by the master.
+  explicit CancelFlagValue(bool cancellable);
+
+  bool IsCancelled() const override;
+  void Cancel() override;
+  // Cancels the job even if it is not cancellable.
+  void Set();
+
+ private:
+  friend class base::RefCountedThreadSafe<CancelFlagValue>;
+  ~CancelFlagValue() override {}
+
+  const bool cancellable_;
+  std::atomic<bool> cancelled_;
+
+  DISALLOW_COPY_AND_ASSIGN(CancelFlagValue);
+};
+}  // namespace dpe
+#endif
@@ -0,0 +1,87 @@
+#include "dpe/checkpoint_store.h"
+
+#include "third_party/chromium/base/files/file_enumerator.h"
+#include "third_party/chromium/base/files/important_file_writer.h"
+
+namespace dpe {
+static void WriteCheckpointFile(const base::FilePath& path,
+                                const std::string& data) {
+  if (!base::ImportantFileWriter::WriteFileAtomically(path, data)) {
+    LOG(ERROR) << "Cannot write checkpoint: " << path.AsUTF8Unsafe();
+  }
+}
+
+static void DeleteCheckpointFile(const base::FilePath& path) {
+  base::DeleteFile(path, false);
+}
+
+CheckpointStore::CheckpointStore(const std::string& path)
+    : path_(base::UTF8ToNative(path)) {}
+
+CheckpointStore::~CheckpointStore() {}
+
+int64 CheckpointStore::Load(const std::function<bool(int64 task_id)>& keep) {
+  checkpoint_.clear();
+  if (!base::CreateDirectory(path_)) {
+    LOG(ERROR) << "Cannot create checkpoint directory: "
+               << path_.AsUTF8Unsafe();
+    return 0;
+  }
+
+  int64 dropped_count = 0;
+  base::FileEnumerator files(path_, false, base::FileEnumerator::FILES,
+                             FILE_PATH_LITERAL("*.ckpt"));
+  for (base::FilePath name = files.Next(); !name.empty();
+       name = files.Next()) {
+    int64 task_id = 0;
+    std::string data;
+    if (base::StringToInt64(name.BaseName().RemoveExtension().AsUTF8Unsafe(),
+                            &task_id) &&
+        keep(task_id) && base::ReadFileToString(name, &data)) {
+      checkpoint_[task_id].swap(data);
+    } else {
+      base::DeleteFile(name, false);
+      ++dropped_count;
+    }
+  }
+  if (dropped_count > 0) {
+    LOG(INFO) << "Deleted " << dropped_count << " stale checkpoints.";
+  }
+  return size();
+}
+
+void CheckpointStore::Clear() {
+  checkpoint_.clear();
+  base::DeleteFile(path_, true);
+  if (!base::CreateDirectory(path_)) {
+    LOG(ERROR) << "Cannot create checkpoint directory: "
+               << path_.AsUTF8Unsafe();
+  }
+}
+
+void CheckpointStore::Put(int64 task_id, const std::string& data) {
+  checkpoint_[task_id] = data;
+  // The FILE thread runs the writes and the deletions in order.
+  base::ThreadPool::PostTask(
+      base::ThreadPool::FILE, FROM_HERE,
+      base::Bind(WriteCheckpointFile, FilePathOf(task_id), data));
+}
+
+void CheckpointStore::Erase(int64 task_id) {
+  if (checkpoint_.erase(task_id) == 0) {
+    return;
+  }
+  base::ThreadPool::PostTask(
+      base::ThreadPool::FILE, FROM_HERE,
+      base::Bind(DeleteCheckpointFile, FilePathOf(task_id)));
+}
+
+const std::string* CheckpointStore::Find(int64 task_id) const {
+  auto where = checkpoint_.find(task_id);
+  return where != checkpoint_.end() ? &where->second : NULL;
+}
+
+base::FilePath CheckpointStore::FilePathOf(int64 task_id) const {
+  return path_.Append(base::UTF8ToNative(std::to_string(task_id) + ".ckpt"));
+}
+}  // namespace dpe
@@ -0,0 +1,47 @@
+#ifndef DPE_CHECKPOINT_STORE_H_
+#define DPE_CHECKPOINT_STORE_H_
+
+#include <functional>
+#include <map>
+#include <string>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe/dpe.h"
+
+namespace dpe {
+// The checkpoints of the unfinished tasks on the master.
+//
+// A checkpoint is an opaque blob saved by a running task, the latest one of a
+// task is kept in memory and in the file <task id>.ckpt of a directory. The
+// files are replaced atomically on the FILE thread, so a crash leaves either
+// the old or the new checkpoint. The checkpoint of a task is removed when the
+// task is done.
+class CheckpointStore {
+ public:
+  // |path| is the full path of the directory.
+  explicit CheckpointStore(const std::string& path);
+  ~CheckpointStore();
+
+  // Loads the checkpoints of the tasks accepted by |keep| and deletes the
+  // other files. Returns the number of loaded checkpoints.
+  int64 Load(const std::function<bool(int64 task_id)>& keep);
+  // Deletes all the checkpoints.
+  void Clear();
+
+  void Put(int64 task_id, const std::string& data);
+  void Erase(int64 task_id);
+  // Returns NULL if |task_id| has no checkpoint.
+  const std::string* Find(int64 task_id) const;
+
+  int64 size() const { return static_cast<int64>(checkpoint_.size()); }
+
+ private:
+  base::FilePath FilePathOf(int64 task_id) const;
+
+  base::FilePath path_;
+  std::map<int64, std::string> checkpoint_;
+
+  DISALLOW_COPY_AND_ASSIGN(CheckpointStore);
+};
+}  // namespace dpe
+#endif
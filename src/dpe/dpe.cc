@@ -7,7 +7,10 @@
 #include <Shlobj.h>
 #pragma comment(lib, "ws2_32")
 
+#include "dpe/dpe_aggregator_node.h"
+#include "dpe/dpe_coordinator_node.h"
 #include "dpe/dpe_internal.h"
+#include "dpe/dpe_job_host_node.h"
 #include "dpe/dpe_master_node.h"
 #include "dpe/dpe_worker_node.h"
 #include "dpe/http_server.h"
@@ -80,14 +83,85 @@ static inline std::string ParseCmd(const std::string& s, int& idx,
   return StringToLowerASCII(s.substr(i, j - i));
 }
 
+// Parses "ip:port,ip:port,...", returns false if it is malformed.
+static bool ParseServerList(const std::string& s,
+                            std::vector<ServerAddress>* servers) {
+  servers->clear();
+  size_t begin = 0;
+  while (begin < s.length()) {
+    size_t end = s.find(',', begin);
+    if (end == std::string::npos) {
+      end = s.length();
+    }
+    const std::string item = s.substr(begin, end - begin);
+    const size_t colon = item.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+      return false;
+    }
+    ServerAddress server;
+    server.ip = item.substr(0, colon);
+    server.port = atoi(item.substr(colon + 1).c_str());
+    if (server.port <= 0) {
+      return false;
+    }
+    servers->push_back(server);
+    begin = end + 1;
+  }
+  return true;
+}
+
+// Parses "name:weight,name,...", the weight is 1 if it is omitted. Returns
+// false if it is malformed.
+static bool ParseJobList(const std::string& s, std::vector<JobSpec>* jobs) {
+  jobs->clear();
+  size_t begin = 0;
+  while (begin < s.length()) {
+    size_t end = s.find(',', begin);
+    if (end == std::string::npos) {
+      end = s.length();
+    }
+    const std::string item = s.substr(begin, end - begin);
+    const size_t colon = item.rfind(':');
+    JobSpec job;
+    job.name = item.substr(0, colon);
+    if (colon != std::string::npos) {
+      job.weight = atoi(item.substr(colon + 1).c_str());
+    }
+    if (job.name.empty() || job.weight <= 0) {
+      return false;
+    }
+    jobs->push_back(job);
+    begin = end + 1;
+  }
+  return true;
+}
+
 static Flags flags;
 const Flags& GetFlags() { return flags; }
 
 Solver* solver;
 Solver* GetSolver() { return solver; }
 
+// The jobs registered by RunDpeJobs.
+static std::vector<std::pair<std::string, Solver*>> registered_jobs;
+
+Solver* GetJobSolver(const std::string& job) {
+  if (job.empty()) {
+    return solver;
+  }
+  for (auto& iter : registered_jobs) {
+    if (iter.first == job) {
+      return iter.second;
+    }
+  }
+  return NULL;
+}
+
 scoped_refptr<DPEMasterNode> master_node;
 scoped_refptr<DPEWorkerNode> worker_node;
+scoped_refptr<DPEAggregatorNode> aggregator_node;
+scoped_refptr<DPECoordinatorNode> coordinator_node;
+scoped_refptr<DPEJobHostNode> job_host_node;
 http::HttpServer http_server;
 
 static void ExitDpeImpl() {
@@ -96,14 +170,48 @@ static void ExitDpeImpl() {
     master_node->Stop();
   }
   master_node = NULL;
+  if (job_host_node) {
+    job_host_node->Stop();
+  }
+  job_host_node = NULL;
   http_server.Stop();
   if (worker_node) {
     worker_node->Stop();
   }
   worker_node = NULL;
+  if (aggregator_node) {
+    aggregator_node->Stop();
+  }
+  aggregator_node = NULL;
+  if (coordinator_node) {
+    coordinator_node->Stop();
+  }
+  coordinator_node = NULL;
   base::will_quit_main_loop();
 }
 
+static void ShutdownWorkerImpl() {
+  if (worker_node) {
+    worker_node->Shutdown();
+  }
+}
+
+// The first Ctrl+C shuts down the worker gracefully, the second one
+// terminates the process.
+static BOOL WINAPI ConsoleCtrlHandler(DWORD ctrl_type) {
+  static bool shutting_down = false;
+  if (ctrl_type != CTRL_C_EVENT && ctrl_type != CTRL_BREAK_EVENT) {
+    return FALSE;
+  }
+  if (shutting_down) {
+    return FALSE;
+  }
+  shutting_down = true;
+  base::ThreadPool::PostTask(base::ThreadPool::UI, FROM_HERE,
+                             base::Bind(ShutdownWorkerImpl));
+  return TRUE;
+}
+
 void WillExitDpe() {
   LOG(INFO) << "WillExitDpe";
   http_server.SetHandler(NULL);
@@ -121,26 +229,87 @@ static inline void run() {
       flags.server_port == 0 ? dpe::kServerPort : flags.server_port;
   LOG(INFO) << "server_port = " << flags.server_port;
   LOG(INFO) << "logging_level = " << flags.logging_level;
+  for (size_t i = 0; i < flags.shard_servers.size(); ++i) {
+    LOG(INFO) << "shard " << i << " = " << flags.shard_servers[i].ip << ":"
+              << flags.shard_servers[i].port;
+  }
+  for (size_t i = 0; i < flags.jobs.size(); ++i) {
+    LOG(INFO) << "job " << i << " = " << flags.jobs[i].name << ":"
+              << flags.jobs[i].weight;
+  }
+  for (size_t i = 0; i < flags.master_servers.size(); ++i) {
+    LOG(INFO) << "master " << i << " = " << flags.master_servers[i].ip << ":"
+              << flags.master_servers[i].port;
+  }
 
-  if (flags.type == "server") {
+  if (flags.type == "standby") {
+    LOG(INFO) << "primary_server = " << flags.primary_server.ip << ":"
+              << flags.primary_server.port;
+  }
+  if (flags.type == "server" || flags.type == "standby") {
     LOG(INFO) << "read_state = " << std::boolalpha << flags.read_state;
     LOG(INFO) << "http_port = " << flags.http_port;
+    LOG(INFO) << "lease_timeout = " << flags.lease_timeout;
+    LOG(INFO) << "speculation_factor = " << flags.speculation_factor;
+    LOG(INFO) << "task_order = " << flags.task_order;
+    if (!registered_jobs.empty()) {
+      LOG(INFO) << "job_policy = " << flags.job_policy;
+    }
+    LOG(INFO) << "reducer_number = " << flags.reducer_number;
+    LOG(INFO) << "memo_size = " << flags.memo_size;
+    if (flags.shard_servers.size() > 1) {
+      LOG(INFO) << "shard_index = " << flags.shard_index;
+      if (flags.shard_index < 0 ||
+          flags.shard_index >= static_cast<int>(flags.shard_servers.size())) {
+        LOG(ERROR) << "shard_index should be in [0, "
+                   << flags.shard_servers.size() << ").";
+        WillExitDpe();
+        return;
+      }
+    }
+  }
+  if (flags.type == "coordinator") {
+    LOG(INFO) << "reducer_number = " << flags.reducer_number;
+  }
+  if (flags.type == "aggregator") {
+    LOG(INFO) << "aggregator_port = " << flags.aggregator_port;
+    LOG(INFO) << "lease_timeout = " << flags.lease_timeout;
+    LOG(INFO) << "memo_size = " << flags.memo_size;
   }
   if (flags.type == "worker") {
     LOG(INFO) << "thread_number = " << flags.thread_number;
     LOG(INFO) << "batch_size = " << flags.batch_size;
     LOG(INFO) << "parallel_info = " << flags.parallel_info;
+    LOG(INFO) << "prefetch = " << flags.prefetch;
+    LOG(INFO) << "memo_cache_size = " << flags.memo_cache_size;
     if (flags.thread_number <= 0) {
       LOG(WARNING) << "thread_number should be greater than 0.";
       WillExitDpe();
     }
-    if (flags.batch_size == 0) {
-      LOG(WARNING) << "batch_size cannot be 0.";
-      WillExitDpe();
-    }
   }
 
-  if (flags.type == "server") {
+  if (!registered_jobs.empty() && flags.type != "server" &&
+      flags.type != "worker") {
+    LOG(ERROR) << "Only server and worker nodes support jobs.";
+    WillExitDpe();
+  } else if (flags.type == "server" && !registered_jobs.empty()) {
+    // All the registered jobs share the workers equally by default.
+    std::vector<JobSpec> jobs = flags.jobs;
+    if (jobs.empty()) {
+      for (auto& iter : registered_jobs) {
+        JobSpec job;
+        job.name = iter.first;
+        jobs.push_back(job);
+      }
+    }
+    job_host_node = new DPEJobHostNode(flags.my_ip, flags.server_port, jobs);
+    http_server.SetHandler(job_host_node);
+    http_server.Start(flags.http_port);
+    if (!job_host_node->Start()) {
+      LOG(ERROR) << "Failed to start job host";
+      WillExitDpe();
+    }
+  } else if (flags.type == "server" || flags.type == "standby") {
     master_node = new DPEMasterNode(flags.my_ip, flags.server_port);
     http_server.SetHandler(master_node);
     http_server.Start(flags.http_port);
@@ -149,11 +318,38 @@ static inline void run() {
       WillExitDpe();
     }
   } else if (flags.type == "worker") {
+    std::vector<ServerAddress> servers = flags.shard_servers;
+    if (servers.empty() && !flags.master_servers.empty()) {
+      servers.push_back(flags.master_servers[0]);
+    }
+    if (servers.empty()) {
+      ServerAddress server;
+      server.ip = flags.server_ip;
+      server.port = flags.server_port;
+      servers.push_back(server);
+    }
     worker_node =
-        new DPEWorkerNode(flags.my_ip, flags.server_ip, flags.server_port);
+        new DPEWorkerNode(flags.my_ip, servers, flags.master_servers);
     if (!worker_node->Start()) {
       LOG(ERROR) << "Failed to start worker node";
       WillExitDpe();
+    } else {
+      SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+    }
+  } else if (flags.type == "aggregator") {
+    aggregator_node =
+        new DPEAggregatorNode(flags.my_ip, flags.aggregator_port,
+                              flags.server_ip, flags.server_port);
+    if (!aggregator_node->Start()) {
+      LOG(ERROR) << "Failed to start aggregator node";
+      WillExitDpe();
+    }
+  } else if (flags.type == "coordinator") {
+    coordinator_node =
+        new DPECoordinatorNode(flags.my_ip, flags.shard_servers);
+    if (!coordinator_node->Start()) {
+      LOG(ERROR) << "Failed to start coordinator node";
+      WillExitDpe();
     }
   } else {
     LOG(ERROR) << "Unknown type";
@@ -233,6 +429,140 @@ void RunDpe(Solver* solver, int argc, char* argv[]) {
         flags.parallel_info = atoi(value.c_str());
         ++i;
       }
+    } else if (str == "lt" || str == "lease_timeout") {
+      if (idx == -1) {
+        flags.lease_timeout = atoi(argv[i + 1]);
+        i += 2;
+      } else {
+        flags.lease_timeout = atoi(value.c_str());
+        ++i;
+      }
+    } else if (str == "sf" || str == "speculation_factor") {
+      if (idx == -1) {
+        flags.speculation_factor = atof(argv[i + 1]);
+        i += 2;
+      } else {
+        flags.speculation_factor = atof(value.c_str());
+        ++i;
+      }
+    } else if (str == "to" || str == "task_order") {
+      if (idx == -1) {
+        flags.task_order = argv[i + 1];
+        i += 2;
+      } else {
+        flags.task_order = value;
+        ++i;
+      }
+    } else if (str == "rn" || str == "reducer_number") {
+      if (idx == -1) {
+        flags.reducer_number = atoi(argv[i + 1]);
+        i += 2;
+      } else {
+        flags.reducer_number = atoi(value.c_str());
+        ++i;
+      }
+    } else if (str == "ap" || str == "aggregator_port") {
+      if (idx == -1) {
+        flags.aggregator_port = atoi(argv[i + 1]);
+        i += 2;
+      } else {
+        flags.aggregator_port = atoi(value.c_str());
+        ++i;
+      }
+    } else if (str == "ss" || str == "shard_servers") {
+      std::string data;
+      if (idx == -1) {
+        data = argv[i + 1];
+        i += 2;
+      } else {
+        data = value;
+        ++i;
+      }
+      if (!ParseServerList(data, &flags.shard_servers)) {
+        fprintf(stderr, "Invalid shard_servers: %s\n", data.c_str());
+        flags.shard_servers.clear();
+      }
+    } else if (str == "ps" || str == "primary_server") {
+      std::string data;
+      if (idx == -1) {
+        data = argv[i + 1];
+        i += 2;
+      } else {
+        data = value;
+        ++i;
+      }
+      std::vector<ServerAddress> servers;
+      if (!ParseServerList(data, &servers) || servers.size() != 1) {
+        fprintf(stderr, "Invalid primary_server: %s\n", data.c_str());
+      } else {
+        flags.primary_server = servers[0];
+      }
+    } else if (str == "ms" || str == "master_servers") {
+      std::string data;
+      if (idx == -1) {
+        data = argv[i + 1];
+        i += 2;
+      } else {
+        data = value;
+        ++i;
+      }
+      if (!ParseServerList(data, &flags.master_servers)) {
+        fprintf(stderr, "Invalid master_servers: %s\n", data.c_str());
+        flags.master_servers.clear();
+      }
+    } else if (str == "jobs") {
+      std::string data;
+      if (idx == -1) {
+        data = argv[i + 1];
+        i += 2;
+      } else {
+        data = value;
+        ++i;
+      }
+      if (!ParseJobList(data, &flags.jobs)) {
+        fprintf(stderr, "Invalid jobs: %s\n", data.c_str());
+        flags.jobs.clear();
+      }
+    } else if (str == "jp" || str == "job_policy") {
+      if (idx == -1) {
+        flags.job_policy = argv[i + 1];
+        i += 2;
+      } else {
+        flags.job_policy = value;
+        ++i;
+      }
+    } else if (str == "si" || str == "shard_index") {
+      if (idx == -1) {
+        flags.shard_index = atoi(argv[i + 1]);
+        i += 2;
+      } else {
+        flags.shard_index = atoi(value.c_str());
+        ++i;
+      }
+    } else if (str == "pf" || str == "prefetch") {
+      if (idx == -1) {
+        flags.prefetch = atoi(argv[i + 1]);
+        i += 2;
+      } else {
+        flags.prefetch = atoi(value.c_str());
+        ++i;
+      }
+    } else if (str == "mm" || str == "memo_size") {
+      if (idx == -1) {
+        flags.memo_size = atoi(argv[i + 1]);
+        i += 2;
+      } else {
+        flags.memo_size = atoi(value.c_str());
+        ++i;
+      }
+    } else if (str == "mc" || str == "memo_cache_size") {
+      if (idx == -1) {
+        flags.memo_cache_size = atoi(argv[i + 1]);
+        i += 2;
+      } else {
+        flags.memo_cache_size = atoi(value.c_str());
+        ++i;
+      }
     } else if (str == "l" || str == "log") {
       if (idx == -1) {
         flags.logging_level = atoi(argv[i + 1]);
@@ -282,7 +612,15 @@ void RunDpe(Solver* solver, int argc, char* argv[]) {
   StopNetwork();
 }
 
-static DpeStub __stub_impl = {&dpe::RunDpe};
+void RunDpeJobs(const DpeJob* jobs, int count, int argc, char* argv[]) {
+  for (int i = 0; i < count; ++i) {
+    registered_jobs.push_back(std::make_pair(jobs[i].name, jobs[i].solver));
+  }
+  // The nodes take the solver of a job by its name.
+  RunDpe(NULL, argc, argv);
+}
+
+static DpeStub __stub_impl = {&dpe::RunDpe, &dpe::RunDpeJobs};
 
 DPE_EXPORT DpeStub* get_stub() { return &__stub_impl; }
 }  // namespace dpe
\ No newline at end of file
@@ -66,6 +66,46 @@
           'dpe_master_node.cc',
           'dpe_worker_node.h',
           'dpe_worker_node.cc',
+          'dpe_aggregator_node.h',
+          'dpe_aggregator_node.cc',
+          'dpe_coordinator_node.h',
+          'dpe_coordinator_node.cc',
+          'dpe_job_host_node.h',
+          'dpe_job_host_node.cc',
+          'scheduler_util.h',
+          'scheduler_util.cc',
+          'task_table.h',
+          'task_table.cc',
+          'task_lease.h',
+          'task_lease.cc',
+          'task_executor.h',
+          'task_executor.cc',
+          'task_log.h',
+          'task_log.cc',
+          'task_state_file.h',
+          'task_state_file.cc',
+          'reduction_pipeline.h',
+          'reduction_pipeline.cc',
+          'result_combiner.h',
+          'result_combiner.cc',
+          'result_store.h',
+          'result_store.cc',
+          'result_cache.h',
+          'result_cache.cc',
+          'global_bound.h',
+          'global_bound.cc',
+          'broadcast_channel.h',
+          'broadcast_channel.cc',
+          'cancel_flag.h',
+          'cancel_flag.cc',
+          'memo_cache.h',
+          'memo_cache.cc',
+          'memo_client.h',
+          'memo_client.cc',
+          'checkpoint_store.h',
+          'checkpoint_store.cc',
+          'replication_log.h',
+          'replication_log.cc',
           'dpe_export.def',
 
           'proto/dpe.pb.h',
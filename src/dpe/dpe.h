@@ -27,27 +27,312 @@
 #define DPE_EXPORT_PRIVATE
 #endif
 
+#include <cstddef>
 #include <cstdint>
 typedef std::int64_t int64;
 
 class Solver;
+
+// Receives the variable-length result of a task on the worker.
+class PayloadWriter {
+ public:
+  // Appends |size| bytes to the result.
+  virtual void Write(const void* data, int64 size) = 0;
+
+ protected:
+  virtual ~PayloadWriter() {}
+};
+
+// The variable-length results of all the tasks, in the order of the tasks.
+// The data points into the memory mapped result store of the master, it is
+// valid until Solver::Finish returns.
+class PayloadView {
+ public:
+  virtual int64 size() const = 0;
+  virtual int64 task_id(int64 i) const = 0;
+  virtual const char* data(int64 i) const = 0;
+  virtual int64 length(int64 i) const = 0;
+
+ protected:
+  virtual ~PayloadView() {}
+};
+
+// The progress of a running task on the worker.
+class TaskCheckpoint {
+ public:
+  // The latest checkpoint of the task, size() is 0 if the task starts from
+  // scratch.
+  virtual const char* data() const = 0;
+  virtual int64 size() const = 0;
+  // Replaces the checkpoint, it is sent to the master in the background and
+  // passed back to the worker resuming the task.
+  virtual void Save(const void* data, int64 size) = 0;
+
+ protected:
+  virtual ~TaskCheckpoint() {}
+};
+
+// Adds tasks to a running job on the master.
+class TaskInjector {
+ public:
+  // Appends the tasks to the job, the known ids are skipped. The tasks of a
+  // positive |priority| are handed out before the other pending tasks, the
+  // higher priority first.
+  virtual void AddTasks(int size, const int64* task_id, int priority) = 0;
+
+ protected:
+  virtual ~TaskInjector() {}
+};
+
+// The global bound of a branch-and-bound job, e.g. the best value found so
+// far. The master broadcasts its bound to all the workers.
+class GlobalBound {
+ public:
+  // The best bound known by this node. It is an atomic load, cheap enough to
+  // be read in the inner loop of Compute.
+  virtual int64 value() const = 0;
+  // Replaces the bound if |value| is better, it may be called on any
+  // thread. The bound improved on the master reaches all the workers, the
+  // bound improved on a worker is only used by the tasks of the worker.
+  virtual void Improve(int64 value) = 0;
+
+ protected:
+  virtual ~GlobalBound() {}
+};
+
+// The cooperative cancellation of a job, e.g. a search whose answer is found.
+class CancelFlag {
+ public:
+  // Returns true if the job is cancelled. It is an atomic load, cheap enough
+  // to be polled in the inner loop of Compute, which returns as soon as it
+  // sees it.
+  virtual bool IsCancelled() const = 0;
+  // Completes the job on the master, e.g. from SetResult. No more task is
+  // handed out, the workers abandon the tasks of the job and Finish is
+  // called with the results received so far. It is ignored on the workers.
+  virtual void Cancel() = 0;
+
+ protected:
+  virtual ~CancelFlag() {}
+};
+
+// A key-value store shared by the workers of a job, e.g. to memoize the
+// subproblems of a dynamic programming solver. The values are kept by the
+// master (or the aggregator of the worker) and cached by the workers, the
+// least recently used ones are evicted, so a lookup may miss a value put
+// before. The methods may be called on the computing threads.
+class MemoStore {
+ public:
+  // Looks up |size| keys, |found[i]| is false if keys[i] is not found. The
+  // keys not cached by the worker are fetched from the master in a single
+  // request.
+  virtual void Get(int size, const int64* keys, int64* values,
+                   bool* found) = 0;
+  // Puts |size| values, they are sent to the master in the background.
+  virtual void Put(int size, const int64* keys, const int64* values) = 0;
+  // The same as Get and Put with variable-length values. An int64 value is
+  // stored as 8 bytes, the two kinds share the keys.
+  virtual bool GetBytes(int64 key, PayloadWriter* value) = 0;
+  virtual void PutBytes(int64 key, const void* data, int64 size) = 0;
+
+ protected:
+  virtual ~MemoStore() {}
+};
+
+// A job of a master running several jobs. The master and the workers
+// register the same jobs, the tasks of a job are computed by the solver of
+// the same name.
+struct DpeJob {
+  const char* name;
+  Solver* solver;
+};
+
 struct DpeStub {
   void (*RunDpe)(Solver* solver, int argc, char* argv[]);
+  // Runs |count| jobs in one master, the workers share their threads among
+  // the jobs.
+  void (*RunDpeJobs)(const DpeJob* jobs, int count, int argc, char* argv[]);
 };
 
 DPE_EXPORT DpeStub* get_stub();
 
 class Solver {
  public:
+  enum {
+    kNoTaskRanges = -1,
+    kPullTaskRanges = -2,
+  };
+
   virtual void InitMaster() = 0;
-  virtual int GetTaskCount() = 0;
-  virtual void GenerateTasks(int64* task) = 0;
+  // Not used if GetTaskRangeCount() != kNoTaskRanges.
+  virtual int GetTaskCount() { return 0; }
+  virtual void GenerateTasks(int64* task) {}
   virtual void InitWorker() = 0;
   virtual void SetResult(int size, int64* taskId, int64* result,
                          int64* time_usage, int64 total_time_usage) = 0;
+  // Computes a batch of tasks on one computing thread of the worker, the
+  // batches run on --thread_number threads at the same time. If
+  // SplitBatches returns true, the tasks of a batch may run on different
+  // threads and Compute is called for every task with size 1.
   virtual void Compute(int size, const int64* taskId, int64* result,
                        int64* time_usage, int parallel_info) = 0;
   virtual void Finish() = 0;
+
+  // Optional. Declares the tasks as [first, last] ranges, so that the master
+  // hands out the ids without materializing them.
+  // Returns the number of ranges generated by GenerateTaskRanges,
+  // kPullTaskRanges if the ranges are pulled by NextTaskRange on demand, or
+  // kNoTaskRanges to use GetTaskCount and GenerateTasks.
+  virtual int GetTaskRangeCount() { return kNoTaskRanges; }
+  virtual void GenerateTaskRanges(int64* first, int64* last) {}
+  // Returns false if there is no more range.
+  virtual bool NextTaskRange(int64* first, int64* last) { return false; }
+
+  // Optional. Estimates the relative cost of the tasks, the expensive tasks
+  // are handed out first if the master runs with --task_order=cost.
+  // Returns false if it is not supported.
+  virtual bool EstimateTaskCost(int size, const int64* task_id, double* cost) {
+    return false;
+  }
+
+  // Optional. Returns true if the tasks of a batch may be computed one by
+  // one on different threads, so that the idle computing threads take the
+  // tasks of a batch with skewed costs. It applies to Compute,
+  // ComputePayload and ComputeResumable.
+  virtual bool SplitBatches() { return false; }
+
+  // Optional. An associative reduction of the results, it replaces SetResult
+  // if the master runs with --reducer_number=N (N > 0).
+  // Every reducer thread owns a partial result returned by NewPartial and
+  // folds the results into it by Combine. Before Finish, the partials are
+  // merged by Merge and the merged one is passed to SetReducedResult.
+  // Combine and Merge are called on the reducer threads, a partial is never
+  // used by two threads at the same time.
+  // Returns NULL if it is not supported.
+  virtual void* NewPartial() { return NULL; }
+  virtual void Combine(void* partial, int size, const int64* task_id,
+                       const int64* result, const int64* time_usage) {}
+  // Merges |other| into |partial|, |other| is not used after it.
+  virtual void Merge(void* partial, void* other) {}
+  // Takes the ownership of the merged partial.
+  virtual void SetReducedResult(void* partial) {}
+  // Frees a partial which is not merged, e.g. the master stops before all
+  // the tasks are done or a later NewPartial returns NULL.
+  virtual void DeletePartial(void* partial) {}
+
+  enum {
+    kNoCombiner = 0,
+    // (a + b) mod |modulus|, 0 < modulus < 2^63.
+    kCombineSumMod = 1,
+    kCombineXor = 2,
+    kCombineMin = 3,
+    kCombineMax = 4,
+    // The 128-bit sum, value[0] is the low 64 bits and value[1] is the high
+    // 64 bits.
+    kCombineSum128 = 5,
+    // InitCombinedValue, CombineValue and MergeCombinedValue.
+    kCombineUser = 6,
+  };
+
+  // Optional. Declares an associative and commutative combiner of the
+  // results. The workers fold the results of a batch into a combined value
+  // and the master keeps the combined value of all the results, SetResult is
+  // not called. A combined value is int64[2], the built-in combiners except
+  // kCombineSum128 only use value[0].
+  // It is also called by the aggregators, which call neither InitMaster nor
+  // InitWorker.
+  virtual int GetCombiner(int64* modulus) { return kNoCombiner; }
+  // kCombineUser only. Sets |value| to the identity.
+  virtual void InitCombinedValue(int64* value) {}
+  virtual void CombineValue(int64* value, int64 result) {}
+  virtual void MergeCombinedValue(int64* value, const int64* other) {}
+  // Receives the combined value of all the results before Finish.
+  virtual void SetCombinedResult(const int64* value) {}
+
+  // Optional. Variable-length results. Returns true if a task produces
+  // bytes instead of an int64, |size_hint| is the expected size of a result
+  // in bytes (0 if unknown). The workers call ComputePayload instead of
+  // Compute, and the master passes all the results to SetPayloadResult
+  // before Finish instead of calling SetResult. It is ignored if the solver
+  // has a combiner.
+  virtual bool HasPayload(int64* size_hint) { return false; }
+  virtual void ComputePayload(int64 task_id, PayloadWriter* writer,
+                              int parallel_info) {}
+  virtual void SetPayloadResult(const PayloadView* view) {}
+
+  // Optional. A job of several stages, the tasks of stage s + 1 are
+  // generated from the results of stage s. The tasks declared by
+  // GetTaskCount or the ranges are stage 0.
+  virtual int GetStageCount() { return 1; }
+  // Called on the master after SetResult. Writes at most |max_count| tasks
+  // of |stage| whose inputs are passed to SetResult and returns their
+  // number, the master calls it until it returns 0. A task id is unique in
+  // the job. The stage is complete when all the tasks of the previous
+  // stages are done and it returns 0, so a stage starts while the tail of
+  // the previous stage is running.
+  // The stages are not supported with a combiner, payloads, a reduction or
+  // shards.
+  virtual int NextStageTasks(int stage, int64* task_id, int max_count) {
+    return 0;
+  }
+
+  // Optional. Returns true if a task saves its progress while it runs, the
+  // workers call ComputeResumable instead of Compute and a task handed out
+  // again resumes from its latest checkpoint. It is ignored if the solver
+  // has payloads.
+  virtual bool HasCheckpoint() { return false; }
+  // Returns the result of |task_id|.
+  virtual int64 ComputeResumable(int64 task_id, TaskCheckpoint* checkpoint,
+                                 int parallel_info) {
+    return 0;
+  }
+
+  // Optional. Keeps the results in a cache shared by the runs, a task whose
+  // result is cached is not computed again. |version| identifies the
+  // compute function and |params| is the hash of the parameters the results
+  // depend on, the results of another key are not used.
+  // The cache is not supported with a combiner, payloads or shards.
+  // Returns false if the results are not cached.
+  virtual bool GetResultCacheKey(int64* version, int64* params) {
+    return false;
+  }
+
+  // Optional. Returns true if SetResult adds tasks to the running job by
+  // |injector|, e.g. to split a task whose result is interesting into finer
+  // tasks. It is called on the master after InitMaster and |injector| is
+  // valid until Finish. The added tasks are kept in the master state, the
+  // results loaded on restart are passed to SetResult again and the tasks
+  // it adds again are skipped.
+  // The injection is not supported with a combiner, payloads, a reduction
+  // or shards.
+  virtual bool AcceptTaskInjector(TaskInjector* injector) { return false; }
+
+  enum {
+    kNoBound = 0,
+    // A smaller bound is better.
+    kMinBound = 1,
+    // A larger bound is better.
+    kMaxBound = 2,
+  };
+
+  // Optional. A branch-and-bound job, the tasks prune by the best bound
+  // found by the whole job. Returns kMinBound or kMaxBound and sets
+  // |initial| to the initial bound, or returns kNoBound.
+  virtual int GetBoundType(int64* initial) { return kNoBound; }
+  // Called after InitMaster and InitWorker if the job has a bound. SetResult
+  // (or Combine) improves |bound| on the master and Compute reads it on the
+  // workers. |bound| is valid until Finish.
+  virtual void SetGlobalBound(GlobalBound* bound) {}
+
+  // Optional. Returns true if the job may complete before all the tasks are
+  // done. It is called after InitMaster and InitWorker, |cancel| is valid
+  // until Finish. The results loaded on restart are passed to SetResult
+  // again, so a completed job completes again.
+  virtual bool AcceptCancelFlag(CancelFlag* cancel) { return false; }
+
+  // Optional. Returns true if Compute uses |memo|. It is called after
+  // InitWorker, |memo| is valid until the worker exits.
+  virtual bool AcceptMemoStore(MemoStore* memo) { return false; }
 };
 
 #endif
@@ -0,0 +1,596 @@
+#include "dpe/dpe_aggregator_node.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "dpe_base/zmq_adapter.h"
+#include "dpe/dpe.h"
+#include "dpe/dpe_internal.h"
+#include "dpe/scheduler_util.h"
+
+namespace dpe {
+// The leases, the result buffer and the upstream node are checked every
+// kTimerInterval microseconds.
+static const int64 kTimerInterval = 1000000;
+// A child without a task asks again after kRetryDelay milliseconds.
+static const int kRetryDelay = 1000;
+// The results are sent upstream every kFlushInterval microseconds or when
+// kFlushSize results are buffered.
+static const int64 kFlushInterval = 1000000;
+static const int kFlushSize = 10000;
+// A fetch keeps the subtree busy for kFetchTime microseconds, it has at most
+// kMaxFetchSize tasks.
+static const int64 kFetchTime = 10 * 1000000LL;
+static const int64 kMaxFetchSize = 1 << 20;
+// The aggregator exits after kMaxUpstreamFailures failed upstream requests
+// in a row.
+static const int kMaxUpstreamFailures = 30;
+static const int64 kExitDelay = 5 * 1000000LL;
+// The leases renewed by the children are renewed upstream every
+// kHeartbeatInterval microseconds.
+static const int64 kHeartbeatInterval = 5 * 1000000LL;
+
+DPEAggregatorNode::DPEAggregatorNode(const std::string& my_ip, int port,
+                                     const std::string& server_ip,
+                                     int server_port)
+    : my_ip_(my_ip),
+      port_(port),
+      worker_id_(my_ip + ":" + std::to_string(port)),
+      server_address_(
+          base::AddressHelper::MakeZMQTCPAddress(server_ip, server_port)),
+      zmq_client_(base::zmq_client()),
+      lease_table_(kTimerInterval),
+      compute_time_(0),
+      task_time_(0),
+      last_flush_time_(0),
+      last_heartbeat_time_(0),
+      fetching_(false),
+      flushing_(false),
+      upstream_done_(false),
+      upstream_failures_(0),
+      done_time_(0),
+      exiting_(false),
+      weakptr_factory_(this) {}
+
+DPEAggregatorNode::~DPEAggregatorNode() { Stop(); }
+
+bool DPEAggregatorNode::Start() {
+  zserver_ = new ZServer(this);
+  if (!zserver_->Start(my_ip_, port_)) {
+    zserver_ = NULL;
+    LOG(WARNING) << "Cannot start aggregator node.";
+    LOG(WARNING) << "ip = " << my_ip_;
+    LOG(WARNING) << "port = " << port_;
+    return false;
+  }
+  LOG(INFO) << "Aggregator starts at: " << zserver_->GetServerAddress();
+
+  combiner_.reset(new ResultCombiner(GetSolver()));
+  int64 size_hint = 0;
+  if (!combiner_->enabled() && GetSolver()->HasPayload(&size_hint)) {
+    // The payloads are uploaded to the master directly.
+    LOG(ERROR) << "The payloads are not supported by aggregators.";
+    zserver_->Stop();
+    zserver_ = NULL;
+    return false;
+  }
+  if (GetSolver()->HasCheckpoint()) {
+    // The checkpoint requests of the children are acknowledged and dropped.
+    LOG(WARNING) << "The checkpoints are not forwarded by aggregators, the "
+                 << "tasks of the subtree restart from scratch.";
+  }
+  ResetBuffer();
+  last_flush_time_ = base::Time::Now().ToInternalValue();
+  broadcast_ = new BroadcastChannel();
+  broadcast_->set_message_callback(base::Bind(
+      &DPEAggregatorNode::HandleBroadcast, weakptr_factory_.GetWeakPtr()));
+
+  timer_ = new base::RepeatedAction(NULL);
+  timer_->Start(
+      base::Bind(&DPEAggregatorNode::OnTimer, weakptr_factory_.GetWeakPtr()),
+      base::TimeDelta::FromMicroseconds(kTimerInterval),
+      base::TimeDelta::FromMicroseconds(kTimerInterval), -1);
+  FetchTasks();
+  return true;
+}
+
+void DPEAggregatorNode::Stop() {
+  if (timer_) {
+    timer_->Stop();
+    timer_ = NULL;
+  }
+  if (zserver_) {
+    zserver_->Stop();
+    zserver_ = NULL;
+  }
+  if (broadcast_) {
+    broadcast_->Close();
+    broadcast_ = NULL;
+  }
+  if (buffered_count() > 0 || in_flight_.task_item_size() > 0 ||
+      in_flight_.task_id_size() > 0) {
+    LOG(WARNING) << "Results are not sent upstream, the tasks will be "
+                 << "handed out again when their leases expire.";
+  }
+}
+
+int DPEAggregatorNode::HandleRequest(const Request& req, Response& reply) {
+  const int64 current_time = base::Time::Now().ToInternalValue();
+  WorkerStatus& worker = GetWorkerStatus(&worker_map_, req.worker_id());
+  UpdateRequestStats(&worker, req, current_time);
+
+  if (req.has_finish_compute()) {
+    HandleFinishCompute(&worker, req.finish_compute(), current_time);
+  }
+  if (req.has_get_task()) {
+    auto* task = new GetTaskResponse();
+    HandleGetTask(&worker, req.get_task(), current_time, task);
+    reply.set_allocated_get_task(task);
+  }
+  if (req.has_return_task()) {
+    std::set<int64> returned_task_id;
+    for (auto task_id : req.return_task().task_id()) {
+      ReturnTask(worker.worker_id(), task_id);
+      returned_task_id.insert(task_id);
+    }
+    RemoveRunningTask(&worker, returned_task_id);
+  }
+  if (req.has_heartbeat()) {
+    RenewLeases(&worker, req.heartbeat(), current_time);
+  }
+  if (req.has_memo()) {
+    if (!memo_) {
+      memo_.reset(new MemoCache(static_cast<int64>(GetFlags().memo_size) *
+                                1024 * 1024));
+    }
+    HandleMemoRequest(memo_.get(), req.memo(), reply.mutable_memo());
+  }
+  reply.set_error_code(0);
+  if (!broadcast_address_.empty()) {
+    reply.set_broadcast_address(broadcast_address_);
+  }
+
+  MaybeFlushResults();
+  FetchTasks();
+  return 0;
+}
+
+void DPEAggregatorNode::HandleFinishCompute(WorkerStatus* worker,
+                                            const FinishComputeRequest& data,
+                                            int64 current_time) {
+  const bool combined = data.task_id_size() > 0;
+  const int size = combined ? data.task_id_size() : data.task_item_size();
+  if (size == 0) {
+    return;
+  }
+  UpdateComputeTime(worker, size, data.total_time_usage());
+  if (data.total_time_usage() > 0) {
+    compute_time_ =
+        UpdateAverageTime(compute_time_, data.total_time_usage() / size);
+  }
+
+  // Same as the master, a combined batch overlapping a done task is dropped.
+  bool accepted = !combined || (combiner_->enabled() &&
+                                data.combiner() == combiner_->type());
+  for (int i = 0; combined && accepted && i < size; ++i) {
+    accepted = owned_task_.count(data.task_id(i)) > 0;
+  }
+
+  int64 value[2];
+  combiner_->Init(value);
+  int accepted_count = 0;
+  std::set<int64> removed_task_id;
+  std::map<std::string, std::set<int64>> reassigned_task_id;
+  for (int i = 0; i < size; ++i) {
+    const int64 task_id =
+        combined ? data.task_id(i) : data.task_item(i).task_id();
+    removed_task_id.insert(task_id);
+    if (!accepted) {
+      ReturnTask(worker->worker_id(), task_id);
+      continue;
+    }
+    // The first result wins.
+    if (!owned_task_.erase(task_id)) {
+      continue;
+    }
+    TaskLeaseTable::Lease lease;
+    if (lease_table_.Release(task_id, &lease)) {
+      if (lease.worker_id == worker->worker_id()) {
+        const int64 time = current_time - lease.start_time;
+        if (time > 0) {
+          worker->set_task_time(UpdateAverageTime(worker->task_time(), time));
+          task_time_ = UpdateAverageTime(task_time_, time);
+        }
+      } else {
+        reassigned_task_id[lease.worker_id].insert(task_id);
+      }
+    }
+    expired_count_.erase(task_id);
+    ++accepted_count;
+
+    if (combiner_->enabled()) {
+      buffer_.add_task_id(task_id);
+      if (!combined) {
+        combiner_->Add(value, data.task_item(i).result());
+      }
+    } else {
+      buffer_.add_task_item()->CopyFrom(data.task_item(i));
+    }
+  }
+
+  RemoveRunningTask(worker, removed_task_id);
+  for (auto& iter : reassigned_task_id) {
+    RemoveRunningTask(&GetWorkerStatus(&worker_map_, iter.first),
+                      iter.second);
+  }
+  if (accepted_count == 0) {
+    return;
+  }
+
+  if (combiner_->enabled()) {
+    if (combined) {
+      value[0] = data.combined_low();
+      value[1] = data.combined_high();
+    }
+    int64 buffered[2] = {buffer_.combined_low(), buffer_.combined_high()};
+    combiner_->Merge(buffered, value);
+    buffer_.set_combined_low(buffered[0]);
+    buffer_.set_combined_high(buffered[1]);
+  }
+  buffer_.set_total_time_usage(buffer_.total_time_usage() +
+                               data.total_time_usage() * accepted_count /
+                                   size);
+}
+
+void DPEAggregatorNode::HandleGetTask(WorkerStatus* worker,
+                                      const GetTaskRequest& get_task,
+                                      int64 current_time,
+                                      GetTaskResponse* task) {
+  if (get_task.has_thread_number()) {
+    worker->set_thread_number(get_task.thread_number());
+  }
+  const int max_task_count =
+      get_task.auto_batch_size()
+          ? ComputeAutoBatchSize(*worker, pending_count(),
+                                 ActiveThreadCount(worker_map_, current_time))
+          : std::max(get_task.max_task_count(), 1);
+  const int64 expected_time =
+      worker->task_time() > 0 ? worker->task_time() : task_time_;
+
+  int added = 0;
+  int64 task_id = 0;
+  while (added < max_task_count && PopPending(&task_id)) {
+    auto where = expired_count_.find(task_id);
+    lease_table_.Grant(
+        task_id, worker->worker_id(), current_time,
+        ComputeLeaseDeadline(current_time, expected_time,
+                             where != expired_count_.end() ? where->second
+                                                           : 0));
+    worker->add_running_task(task_id);
+    task->add_task_id(task_id);
+    ++added;
+  }
+  // More tasks may come from upstream or from the expired leases.
+  if (added == 0 && !(upstream_done_ && owned_task_.empty())) {
+    task->set_retry_delay(kRetryDelay);
+  }
+}
+
+void DPEAggregatorNode::ReturnTask(const std::string& worker_id,
+                                   int64 task_id) {
+  const TaskLeaseTable::Lease* lease = lease_table_.Find(task_id);
+  if (lease && lease->worker_id == worker_id) {
+    lease_table_.Release(task_id, NULL);
+    pending_.push_back(task_id);
+  }
+}
+
+bool DPEAggregatorNode::PopPending(int64* task_id) {
+  while (!pending_.empty()) {
+    const int64 id = pending_.front();
+    pending_.pop_front();
+    if (owned_task_.count(id) && !lease_table_.Find(id)) {
+      *task_id = id;
+      return true;
+    }
+  }
+  return false;
+}
+
+int64 DPEAggregatorNode::pending_count() const {
+  return static_cast<int64>(owned_task_.size()) -
+         static_cast<int64>(lease_table_.size());
+}
+
+void DPEAggregatorNode::RenewLeases(WorkerStatus* worker,
+                                    const HeartbeatRequest& heartbeat,
+                                    int64 current_time) {
+  const int64 expected_time =
+      worker->task_time() > 0 ? worker->task_time() : task_time_;
+  for (auto task_id : heartbeat.task_id()) {
+    auto where = expired_count_.find(task_id);
+    if (lease_table_.Renew(
+            task_id, worker->worker_id(),
+            ComputeLeaseDeadline(current_time, expected_time,
+                                 where != expired_count_.end() ? where->second
+                                                               : 0))) {
+      renewed_.insert(task_id);
+    }
+  }
+}
+
+void DPEAggregatorNode::SendHeartbeat() {
+  const int64 current_time = base::Time::Now().ToInternalValue();
+  if (renewed_.empty() ||
+      current_time - last_heartbeat_time_ < kHeartbeatInterval) {
+    return;
+  }
+  last_heartbeat_time_ = current_time;
+  Request request;
+  request.set_name("heartbeat");
+  HeartbeatRequest* heartbeat = request.mutable_heartbeat();
+  for (auto task_id : renewed_) {
+    if (owned_task_.count(task_id)) {
+      heartbeat->add_task_id(task_id);
+    }
+  }
+  renewed_.clear();
+  SendRequest(request,
+              base::Bind(&DPEAggregatorNode::HandleHeartbeat,
+                         weakptr_factory_.GetWeakPtr()),
+              5000);
+}
+
+void DPEAggregatorNode::HandleHeartbeat(
+    scoped_refptr<base::ZMQResponse> response) {
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    LOG(WARNING) << "Handle heartbeat, error: " << response->error_code_;
+  }
+}
+
+void DPEAggregatorNode::CheckLeases() {
+  std::vector<TaskLeaseTable::Lease> expired;
+  lease_table_.Expire(base::Time::Now().ToInternalValue(), &expired);
+
+  std::map<std::string, std::set<int64>> expired_task_id;
+  for (auto& lease : expired) {
+    if (!owned_task_.count(lease.index)) {
+      continue;
+    }
+    pending_.push_back(lease.index);
+    ++expired_count_[lease.index];
+    expired_task_id[lease.worker_id].insert(lease.index);
+  }
+  for (auto& iter : expired_task_id) {
+    RemoveRunningTask(&GetWorkerStatus(&worker_map_, iter.first),
+                      iter.second);
+  }
+  if (!expired.empty()) {
+    LOG(WARNING) << expired.size()
+                 << " task leases expired, the tasks are requeued.";
+  }
+}
+
+int DPEAggregatorNode::FetchSize(int64 current_time) {
+  const int64 thread_count =
+      std::max<int64>(ActiveThreadCount(worker_map_, current_time), 1);
+  if (compute_time_ <= 0) {
+    return static_cast<int>(thread_count);
+  }
+  const int64 size = thread_count * kFetchTime / compute_time_;
+  return static_cast<int>(
+      std::min(std::max(size, thread_count), kMaxFetchSize));
+}
+
+void DPEAggregatorNode::FetchTasks() {
+  if (fetching_ || upstream_done_ || exiting_) {
+    return;
+  }
+  const int64 current_time = base::Time::Now().ToInternalValue();
+  const int fetch_size = FetchSize(current_time);
+  if (pending_count() * 2 > fetch_size) {
+    return;
+  }
+
+  GetTaskRequest* get_task = new GetTaskRequest();
+  get_task->set_max_task_count(fetch_size);
+  get_task->set_thread_number(static_cast<int>(
+      std::max<int64>(ActiveThreadCount(worker_map_, current_time), 1)));
+
+  Request request;
+  request.set_name("get_task");
+  request.set_allocated_get_task(get_task);
+  fetching_ = true;
+  SendRequest(request,
+              base::Bind(&DPEAggregatorNode::HandleFetchTasks, this), 10000);
+}
+
+void DPEAggregatorNode::HandleFetchTasks(
+    scoped_refptr<base::ZMQResponse> response) {
+  fetching_ = false;
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    LOG(WARNING) << "Handle fetch tasks, error: " << response->error_code_;
+    OnUpstreamFailure();
+    return;
+  }
+  upstream_failures_ = 0;
+
+  Response body;
+  body.ParseFromString(response->data_);
+  if (body.has_broadcast_address()) {
+    broadcast_address_ = body.broadcast_address();
+    if (broadcast_) {
+      broadcast_->Subscribe(broadcast_address_);
+    }
+  }
+  auto& get_task = body.get_task();
+  if (get_task.task_id_size() == 0) {
+    if (get_task.retry_delay() <= 0) {
+      LOG(INFO) << "Upstream node has no more task.";
+      upstream_done_ = true;
+    }
+    return;
+  }
+  for (auto task_id : get_task.task_id()) {
+    if (owned_task_.insert(task_id).second) {
+      pending_.push_back(task_id);
+    }
+  }
+  VLOG(1) << "Fetched " << get_task.task_id_size() << " tasks.";
+}
+
+void DPEAggregatorNode::MaybeFlushResults() {
+  if (flushing_ || buffered_count() == 0) {
+    return;
+  }
+  const int64 current_time = base::Time::Now().ToInternalValue();
+  if (buffered_count() < kFlushSize && !owned_task_.empty() &&
+      current_time - last_flush_time_ < kFlushInterval) {
+    return;
+  }
+  last_flush_time_ = current_time;
+
+  in_flight_.Swap(&buffer_);
+  ResetBuffer();
+  Request request;
+  request.set_name("finish_compute");
+  request.mutable_finish_compute()->CopyFrom(in_flight_);
+  flushing_ = true;
+  SendRequest(request,
+              base::Bind(&DPEAggregatorNode::HandleFlushResults, this),
+              10000);
+}
+
+void DPEAggregatorNode::HandleFlushResults(
+    scoped_refptr<base::ZMQResponse> response) {
+  flushing_ = false;
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    LOG(WARNING) << "Handle flush results, error: " << response->error_code_;
+    RestoreInFlightResults();
+    OnUpstreamFailure();
+    return;
+  }
+  upstream_failures_ = 0;
+  in_flight_.Clear();
+}
+
+void DPEAggregatorNode::ResetBuffer() {
+  buffer_.Clear();
+  if (combiner_->enabled()) {
+    int64 value[2];
+    combiner_->Init(value);
+    buffer_.set_combined_low(value[0]);
+    buffer_.set_combined_high(value[1]);
+    buffer_.set_combiner(combiner_->type());
+  }
+}
+
+void DPEAggregatorNode::RestoreInFlightResults() {
+  for (auto& item : in_flight_.task_item()) {
+    buffer_.add_task_item()->CopyFrom(item);
+  }
+  for (auto task_id : in_flight_.task_id()) {
+    buffer_.add_task_id(task_id);
+  }
+  if (combiner_->enabled()) {
+    int64 value[2] = {buffer_.combined_low(), buffer_.combined_high()};
+    const int64 other[2] = {in_flight_.combined_low(),
+                            in_flight_.combined_high()};
+    combiner_->Merge(value, other);
+    buffer_.set_combined_low(value[0]);
+    buffer_.set_combined_high(value[1]);
+  }
+  buffer_.set_total_time_usage(buffer_.total_time_usage() +
+                               in_flight_.total_time_usage());
+  in_flight_.Clear();
+}
+
+int DPEAggregatorNode::buffered_count() const {
+  return buffer_.task_item_size() + buffer_.task_id_size();
+}
+
+void DPEAggregatorNode::OnUpstreamFailure() {
+  if (++upstream_failures_ < kMaxUpstreamFailures || exiting_) {
+    return;
+  }
+  // The upstream node hands out the tasks again when the leases expire.
+  LOG(ERROR) << "Upstream node is lost.";
+  exiting_ = true;
+  WillExitDpe();
+}
+
+void DPEAggregatorNode::HandleBroadcast(const Broadcast& message) {
+  if (!message.cancelled() || (upstream_done_ && owned_task_.empty())) {
+    return;
+  }
+  // The children get the broadcast too, their late results are dropped as
+  // the results of unknown tasks. The upstream node drops the results of a
+  // cancelled job anyway.
+  LOG(INFO) << "The job is cancelled, " << owned_task_.size()
+            << " tasks are dropped.";
+  upstream_done_ = true;
+  owned_task_.clear();
+  pending_.clear();
+  lease_table_.Clear();
+  expired_count_.clear();
+  renewed_.clear();
+  for (auto& iter : worker_map_) {
+    iter.second.clear_running_task();
+  }
+  ResetBuffer();
+  MaybeExit();
+}
+
+void DPEAggregatorNode::OnTimer() {
+  CheckLeases();
+  SendHeartbeat();
+  MaybeFlushResults();
+  FetchTasks();
+  MaybeExit();
+}
+
+void DPEAggregatorNode::MaybeExit() {
+  if (exiting_) {
+    return;
+  }
+  if (!upstream_done_ || !owned_task_.empty() || buffered_count() > 0 ||
+      flushing_) {
+    done_time_ = 0;
+    return;
+  }
+  const int64 current_time = base::Time::Now().ToInternalValue();
+  if (done_time_ == 0) {
+    done_time_ = current_time;
+  } else if (current_time - done_time_ >= kExitDelay) {
+    LOG(INFO) << "All the tasks are done.";
+    exiting_ = true;
+    WillExitDpe();
+  }
+}
+
+int DPEAggregatorNode::SendRequest(Request& req, base::ZMQCallBack callback,
+                                   int timeout) {
+  req.set_worker_id(worker_id_);
+  req.set_request_timestamp(base::Time::Now().ToInternalValue());
+
+  std::string val;
+  req.SerializeToString(&val);
+
+  VLOG(1) << "Send request:\n" << req.DebugString();
+
+  zmq_client_->SendRequest(server_address_, val.c_str(),
+                           static_cast<int>(val.size()),
+                           base::Bind(&DPEAggregatorNode::HandleResponse,
+                                      weakptr_factory_.GetWeakPtr(), callback),
+                           timeout);
+  return 0;
+}
+
+void DPEAggregatorNode::HandleResponse(base::WeakPtr<DPEAggregatorNode> self,
+                                       base::ZMQCallBack callback,
+                                       scoped_refptr<base::ZMQResponse> rep) {
+  if (self.get()) {
+    callback.Run(rep);
+  }
+}
+}  // namespace dpe
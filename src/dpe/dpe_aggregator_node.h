@@ -0,0 +1,140 @@
+#ifndef DPE_AGGREGATOR_NODE_H_
+#define DPE_AGGREGATOR_NODE_H_
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe/broadcast_channel.h"
+#include "dpe/memo_cache.h"
+#include "dpe/proto/dpe.pb.h"
+#include "dpe/result_combiner.h"
+#include "dpe/task_lease.h"
+#include "dpe/zserver.h"
+
+namespace dpe {
+// A node between the master and a subtree of workers.
+//
+// An aggregator is a worker of its upstream node (the master or another
+// aggregator): it leases large batches of tasks with get_task and reports
+// the results with finish_compute. It serves the same requests as the
+// master to its children (workers or aggregators), so trees of any depth can
+// be built. The tasks of a lost child are handed out again when their
+// leases expire, and the results are sent upstream in batches. The memo
+// requests of the subtree are served by the aggregator. The aggregator
+// follows the broadcast channel of the master and drops its tasks when the
+// job is cancelled.
+class DPEAggregatorNode : public ZServerHandler,
+                          public base::RefCounted<DPEAggregatorNode> {
+ public:
+  DPEAggregatorNode(const std::string& my_ip, int port,
+                    const std::string& server_ip, int server_port);
+  ~DPEAggregatorNode();
+
+  bool Start();
+  void Stop();
+
+  int HandleRequest(const Request& req, Response& reply) override;
+
+ private:
+  // Downstream.
+  void HandleFinishCompute(WorkerStatus* worker,
+                           const FinishComputeRequest& data,
+                           int64 current_time);
+  void HandleGetTask(WorkerStatus* worker, const GetTaskRequest& get_task,
+                     int64 current_time, GetTaskResponse* task);
+  // Hands out a task of |worker_id| again if it owns the task.
+  void ReturnTask(const std::string& worker_id, int64 task_id);
+  // Returns false if there is no pending task.
+  bool PopPending(int64* task_id);
+  int64 pending_count() const;
+  // Renews the leases of the tasks the child is still computing.
+  void RenewLeases(WorkerStatus* worker, const HeartbeatRequest& heartbeat,
+                   int64 current_time);
+  void CheckLeases();
+
+  // Upstream.
+  // Leases more tasks if the pending tasks are fewer than half a fetch.
+  void FetchTasks();
+  void HandleFetchTasks(scoped_refptr<base::ZMQResponse> response);
+  // The number of tasks keeping the subtree busy for kFetchTime.
+  int FetchSize(int64 current_time);
+  // Sends the buffered results if there are enough of them, the last flush
+  // is old or all the leased tasks are done.
+  void MaybeFlushResults();
+  void HandleFlushResults(scoped_refptr<base::ZMQResponse> response);
+  // Renews upstream the leases the children renewed, so the upstream node
+  // does not hand out the long tasks of the subtree again.
+  void SendHeartbeat();
+  void HandleHeartbeat(scoped_refptr<base::ZMQResponse> response);
+  // Clears the result buffer.
+  void ResetBuffer();
+  // Moves the results of a failed flush back to the buffer.
+  void RestoreInFlightResults();
+  int buffered_count() const;
+  void OnUpstreamFailure();
+  // Drops the tasks and the results of a cancelled job.
+  void HandleBroadcast(const Broadcast& message);
+
+  void OnTimer();
+  void MaybeExit();
+
+  int SendRequest(Request& req, base::ZMQCallBack callback, int timeout);
+  static void HandleResponse(base::WeakPtr<DPEAggregatorNode> self,
+                             base::ZMQCallBack callback,
+                             scoped_refptr<base::ZMQResponse> rep);
+
+  scoped_refptr<ZServer> zserver_;
+  std::string my_ip_;
+  int port_;
+  // The id of this node at its upstream node.
+  std::string worker_id_;
+  std::string server_address_;
+  // The broadcast channel of the master, the children subscribe to it.
+  std::string broadcast_address_;
+  scoped_refptr<BroadcastChannel> broadcast_;
+  base::ZMQClient* zmq_client_;
+  scoped_ptr<ResultCombiner> combiner_;
+  // The memo store of the subtree, created by the first memo request.
+  scoped_ptr<MemoCache> memo_;
+
+  // The tasks leased from upstream and not done.
+  std::set<int64> owned_task_;
+  // The owned tasks to hand out, an entry which is done or leased is
+  // skipped.
+  std::deque<int64> pending_;
+  // Keyed by task id.
+  TaskLeaseTable lease_table_;
+  // Task id -> the number of expired leases.
+  std::map<int64, int> expired_count_;
+  std::map<std::string, WorkerStatus> worker_map_;
+  // The average compute time and the expected time of a task of the
+  // subtree.
+  int64 compute_time_;
+  int64 task_time_;
+
+  // The results not sent upstream and the results being sent.
+  FinishComputeRequest buffer_;
+  FinishComputeRequest in_flight_;
+  int64 last_flush_time_;
+  // The tasks renewed by the children since the last upstream heartbeat.
+  std::set<int64> renewed_;
+  int64 last_heartbeat_time_;
+
+  bool fetching_;
+  bool flushing_;
+  // The upstream node has no more task.
+  bool upstream_done_;
+  int upstream_failures_;
+  // The time when all the work is done, the aggregator exits a little later
+  // so that the children learn there is no more task.
+  int64 done_time_;
+  bool exiting_;
+  scoped_refptr<base::RepeatedAction> timer_;
+
+  base::WeakPtrFactory<DPEAggregatorNode> weakptr_factory_;
+};
+}  // namespace dpe
+#endif
@@ -0,0 +1,259 @@
+#include "dpe/dpe_coordinator_node.h"
+
+#include "dpe_base/zmq_adapter.h"
+#include "dpe/dpe.h"
+
+namespace dpe {
+// The shards are polled every kPollInterval microseconds.
+static const int64 kPollInterval = 5 * 1000000LL;
+// A page of a shard has at most kPageSize results.
+static const int kPageSize = 100000;
+// The coordinator exits after kMaxShardFailures failed requests in a row to
+// a shard.
+static const int kMaxShardFailures = 60;
+// No page is fetched while the reduction queue has kMaxQueuedResults results.
+static const int64 kMaxQueuedResults = 1 << 20;
+
+DPECoordinatorNode::DPECoordinatorNode(
+    const std::string& my_ip, const std::vector<ServerAddress>& servers)
+    : worker_id_(my_ip + ":coordinator"),
+      zmq_client_(base::zmq_client()),
+      finishing_(false),
+      weakptr_factory_(this) {
+  for (auto& server : servers) {
+    ShardState shard;
+    shard.address =
+        base::AddressHelper::MakeZMQTCPAddress(server.ip, server.port);
+    shard.next_index = 0;
+    shard.failures = 0;
+    shard.requesting = false;
+    shard.merged = false;
+    shards_.push_back(shard);
+  }
+}
+
+DPECoordinatorNode::~DPECoordinatorNode() { Stop(); }
+
+bool DPECoordinatorNode::Start() {
+  if (shards_.empty()) {
+    LOG(ERROR) << "The coordinator needs shard_servers.";
+    return false;
+  }
+
+  Solver* solver = GetSolver();
+  solver->InitMaster();
+  combiner_.reset(new ResultCombiner(solver));
+  combiner_->Init(combined_value_);
+  if (combiner_->enabled()) {
+    LOG(INFO) << "Results are combined by combiner " << combiner_->type();
+  } else if (GetFlags().reducer_number > 0) {
+    reduction_pipeline_ = new ReductionPipeline(
+        solver, GetFlags().reducer_number, kMaxQueuedResults);
+    if (!reduction_pipeline_->Start()) {
+      LOG(WARNING) << "Solver::NewPartial is not supported, "
+                   << "Solver::SetResult is used.";
+      reduction_pipeline_ = NULL;
+    }
+  }
+
+  LOG(INFO) << "Coordinator of " << shards_.size() << " shards.";
+  timer_ = new base::RepeatedAction(NULL);
+  timer_->Start(
+      base::Bind(&DPECoordinatorNode::OnTimer, weakptr_factory_.GetWeakPtr()),
+      base::TimeDelta(), base::TimeDelta::FromMicroseconds(kPollInterval), -1);
+  return true;
+}
+
+void DPECoordinatorNode::Stop() {
+  if (timer_) {
+    timer_->Stop();
+    timer_ = NULL;
+  }
+}
+
+void DPECoordinatorNode::OnTimer() {
+  // The pages wait while the reducers are behind.
+  if (reduction_pipeline_ && reduction_pipeline_->IsFull()) {
+    return;
+  }
+  for (int i = 0; i < static_cast<int>(shards_.size()); ++i) {
+    if (!shards_[i].merged && !shards_[i].requesting) {
+      RequestShardResult(i, false);
+    }
+  }
+}
+
+void DPECoordinatorNode::RequestShardResult(int shard, bool release) {
+  GetShardResultRequest* get_shard_result = new GetShardResultRequest();
+  get_shard_result->set_start_index(shards_[shard].next_index);
+  get_shard_result->set_max_count(kPageSize);
+  get_shard_result->set_release(release);
+
+  Request request;
+  request.set_name("get_shard_result");
+  request.set_allocated_get_shard_result(get_shard_result);
+  shards_[shard].requesting = true;
+  if (release) {
+    SendRequest(shard, request,
+                base::Bind(&DPECoordinatorNode::HandleRelease, this, shard),
+                5000);
+  } else {
+    SendRequest(
+        shard, request,
+        base::Bind(&DPECoordinatorNode::HandleShardResult, this, shard),
+        10000);
+  }
+}
+
+void DPECoordinatorNode::HandleShardResult(
+    int shard, scoped_refptr<base::ZMQResponse> response) {
+  ShardState& state = shards_[shard];
+  state.requesting = false;
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    LOG(WARNING) << "Handle shard result of shard " << shard
+                 << ", error: " << response->error_code_;
+    if (++state.failures >= kMaxShardFailures) {
+      LOG(ERROR) << "Shard " << shard << " is lost, the coordinator exits "
+                 << "without the results.";
+      Stop();
+      WillExitDpe();
+    }
+    return;
+  }
+  state.failures = 0;
+
+  Response body;
+  body.ParseFromString(response->data_);
+  const GetShardResultResponse& shard_result = body.get_shard_result();
+  if (!shard_result.all_done()) {
+    LOG(INFO) << "Shard " << shard << ": " << shard_result.done_count()
+              << " of " << shard_result.task_count() << " tasks are done.";
+    return;
+  }
+
+  if (!MergeShardResult(shard_result)) {
+    LOG(ERROR) << "The results of shard " << shard
+               << " do not match the combiner, the coordinator exits.";
+    Stop();
+    WillExitDpe();
+    return;
+  }
+  state.next_index = shard_result.next_index();
+  // Fetches the next page at once unless the reducers are behind, OnTimer
+  // fetches it then. The shard is released after the last page.
+  const bool release = state.next_index >= shard_result.task_count();
+  if (!release && reduction_pipeline_ && reduction_pipeline_->IsFull()) {
+    return;
+  }
+  RequestShardResult(shard, release);
+}
+
+void DPECoordinatorNode::HandleRelease(
+    int shard, scoped_refptr<base::ZMQResponse> response) {
+  // The results are merged, the shard may exit before it replies.
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    LOG(WARNING) << "Handle release of shard " << shard
+                 << ", error: " << response->error_code_;
+  }
+  shards_[shard].requesting = false;
+  shards_[shard].merged = true;
+  LOG(INFO) << "The results of shard " << shard << " are merged.";
+  MaybeFinish();
+}
+
+bool DPECoordinatorNode::MergeShardResult(
+    const GetShardResultResponse& shard_result) {
+  if (combiner_->enabled()) {
+    if (!shard_result.has_combiner()) {
+      // A page after the combined value.
+      return shard_result.task_item_size() == 0;
+    }
+    if (shard_result.combiner() != combiner_->type()) {
+      return false;
+    }
+    const int64 value[2] = {shard_result.combined_low(),
+                            shard_result.combined_high()};
+    combiner_->Merge(combined_value_, value);
+    return true;
+  }
+  if (shard_result.has_combiner()) {
+    return false;
+  }
+
+  const int size = shard_result.task_item_size();
+  if (size == 0) {
+    return true;
+  }
+  std::vector<int64> task_id(size), result(size), time_usage(size);
+  int64 total_time_usage = 0;
+  for (int i = 0; i < size; ++i) {
+    const TaskItem& item = shard_result.task_item(i);
+    task_id[i] = item.task_id();
+    result[i] = item.result();
+    time_usage[i] = item.time_usage();
+    total_time_usage += item.time_usage();
+  }
+  if (reduction_pipeline_) {
+    reduction_pipeline_->Push(size, task_id.data(), result.data(),
+                              time_usage.data());
+  } else {
+    GetSolver()->SetResult(size, task_id.data(), result.data(),
+                           time_usage.data(), total_time_usage);
+  }
+  return true;
+}
+
+void DPECoordinatorNode::MaybeFinish() {
+  if (finishing_) {
+    return;
+  }
+  for (auto& shard : shards_) {
+    if (!shard.merged) {
+      return;
+    }
+  }
+  finishing_ = true;
+  Stop();
+  LOG(INFO) << "The results of all the shards are merged.";
+  if (reduction_pipeline_) {
+    reduction_pipeline_->Finish(base::Bind(
+        &DPECoordinatorNode::DidReduceResults, weakptr_factory_.GetWeakPtr()));
+  } else {
+    DidReduceResults();
+  }
+}
+
+void DPECoordinatorNode::DidReduceResults() {
+  if (combiner_->enabled()) {
+    GetSolver()->SetCombinedResult(combined_value_);
+  }
+  GetSolver()->Finish();
+  WillExitDpe();
+}
+
+int DPECoordinatorNode::SendRequest(int shard, Request& req,
+                                    base::ZMQCallBack callback, int timeout) {
+  req.set_worker_id(worker_id_);
+  req.set_request_timestamp(base::Time::Now().ToInternalValue());
+
+  std::string val;
+  req.SerializeToString(&val);
+
+  VLOG(1) << "Send request:\n" << req.DebugString();
+
+  zmq_client_->SendRequest(shards_[shard].address, val.c_str(),
+                           static_cast<int>(val.size()),
+                           base::Bind(&DPECoordinatorNode::HandleResponse,
+                                      weakptr_factory_.GetWeakPtr(), callback),
+                           timeout);
+  return 0;
+}
+
+void DPECoordinatorNode::HandleResponse(base::WeakPtr<DPECoordinatorNode> self,
+                                        base::ZMQCallBack callback,
+                                        scoped_refptr<base::ZMQResponse> rep) {
+  if (self.get()) {
+    callback.Run(rep);
+  }
+}
+}  // namespace dpe
@@ -0,0 +1,68 @@
+#ifndef DPE_COORDINATOR_NODE_H_
+#define DPE_COORDINATOR_NODE_H_
+
+#include <string>
+#include <vector>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe/dpe_internal.h"
+#include "dpe/proto/dpe.pb.h"
+#include "dpe/reduction_pipeline.h"
+#include "dpe/result_combiner.h"
+
+namespace dpe {
+// Merges the results of the shard masters.
+//
+// Every shard master owns a part of the tasks and keeps its results after
+// they are done. The coordinator polls the shards with get_shard_result,
+// passes the results of a done shard to the solver page by page (or merges
+// its combined value) and releases the shard. Solver::Finish is called when
+// all the shards are merged.
+class DPECoordinatorNode : public base::RefCounted<DPECoordinatorNode> {
+ public:
+  DPECoordinatorNode(const std::string& my_ip,
+                     const std::vector<ServerAddress>& servers);
+  ~DPECoordinatorNode();
+
+  bool Start();
+  void Stop();
+
+ private:
+  struct ShardState {
+    std::string address;
+    // The index of the next result to fetch.
+    int64 next_index;
+    int failures;
+    bool requesting;
+    // The results are merged and the shard is released.
+    bool merged;
+  };
+
+  void OnTimer();
+  void RequestShardResult(int shard, bool release);
+  void HandleShardResult(int shard, scoped_refptr<base::ZMQResponse> response);
+  void HandleRelease(int shard, scoped_refptr<base::ZMQResponse> response);
+  // Returns false if the results do not match the combiner.
+  bool MergeShardResult(const GetShardResultResponse& shard_result);
+  void MaybeFinish();
+  void DidReduceResults();
+
+  int SendRequest(int shard, Request& req, base::ZMQCallBack callback,
+                  int timeout);
+  static void HandleResponse(base::WeakPtr<DPECoordinatorNode> self,
+                             base::ZMQCallBack callback,
+                             scoped_refptr<base::ZMQResponse> rep);
+
+  std::string worker_id_;
+  std::vector<ShardState> shards_;
+  base::ZMQClient* zmq_client_;
+  scoped_ptr<ResultCombiner> combiner_;
+  int64 combined_value_[2];
+  scoped_refptr<ReductionPipeline> reduction_pipeline_;
+  bool finishing_;
+  scoped_refptr<base::RepeatedAction> timer_;
+
+  base::WeakPtrFactory<DPECoordinatorNode> weakptr_factory_;
+};
+}  // namespace dpe
+#endif
@@ -4,8 +4,27 @@
 #include "dpe/dpe.h"
 
 #include <string>
+#include <vector>
 
 namespace dpe {
+// The error code of the responses of a standby master which has not taken
+// over.
+static const int kErrorNotPrimary = 2;
+// The error code of a request the master does not support, e.g. the
+// replication of a job with stages.
+static const int kErrorNotSupported = 3;
+
+struct ServerAddress {
+  std::string ip;
+  int port = 0;
+};
+
+// A job run by the master and its share of the workers.
+struct JobSpec {
+  std::string name;
+  int weight = 1;
+};
+
 struct Flags {
   int http_port = 80;
   std::string type = "server";
@@ -20,17 +39,62 @@ struct Flags {
   // that size <= batch_size
   // If batch_size < 0, |batch_size| is the expected executing time of
   // Solver::Compute in seconds.
+  // If batch_size == 0, the master decides the size.
   int batch_size = 1;
   // The argument forwarded to Solver::Compute
   int parallel_info = 0;
+  // The number of batches a worker fetches in advance.
+  int prefetch = 1;
+  // The lease of a task in seconds before the expected task time of the
+  // worker is known. The tasks are never reassigned if it is 0.
+  int lease_timeout = 600;
+  // If it is greater than 0, a running task is duplicated to an idle worker
+  // when there is no pending task and it runs longer than speculation_factor
+  // times the median task time usage.
+  double speculation_factor = 0;
+  // "fifo": the tasks are handed out in the order of the solver.
+  // "cost": the expensive tasks are handed out first.
+  std::string task_order = "fifo";
+  // The number of threads reducing the results by Solver::Combine. The
+  // results are passed to Solver::SetResult if it is 0.
+  int reducer_number = 0;
+  // The port an aggregator listens on, its children use it as server_port.
+  int aggregator_port = 3311;
+  // The shard masters, parsed from "ip:port,ip:port,...". The i-th master
+  // owns the i-th part of the task indexes. A single master is used if it is
+  // empty.
+  std::vector<ServerAddress> shard_servers;
+  // The shard owned by a master.
+  int shard_index = 0;
+  // The master followed by a standby master, parsed from "ip:port".
+  ServerAddress primary_server;
+  // The primary master and its standby masters, a worker moves to the next
+  // one when a master is lost. A single master (server_ip, server_port) is
+  // used if it is empty.
+  std::vector<ServerAddress> master_servers;
+  // The jobs run by the master, parsed from "name:weight,name,...". All the
+  // registered jobs with weight 1 are run if it is empty.
+  std::vector<JobSpec> jobs;
+  // "fair": a job gets the workers in proportion to its weight.
+  // "priority": a job gets the workers before the jobs after it.
+  std::string job_policy = "fair";
+  // The memory of the memo store kept by the master or an aggregator, in
+  // megabytes.
+  int memo_size = 256;
+  // The memory of the memo values cached by a worker, in megabytes.
+  int memo_cache_size = 64;
 };
 
 Solver* GetSolver();
+// Returns the solver of a job registered by RunDpeJobs, or NULL. The empty
+// name is the solver of RunDpe.
+Solver* GetJobSolver(const std::string& job);
 std::string GetDpeModuleDir();
 std::string GetExecutableDir();
 const Flags& GetFlags();
 void WillExitDpe();
 void RunDpe(Solver* solver, int argc, char* argv[]);
+void RunDpeJobs(const DpeJob* jobs, int count, int argc, char* argv[]);
 }  // namespace dpe
 
 #endif
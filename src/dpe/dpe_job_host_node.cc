@@ -0,0 +1,234 @@
+#include "dpe/dpe_job_host_node.h"
+
+#include <algorithm>
+
+#include "dpe/dpe.h"
+#include "dpe/scheduler_util.h"
+
+namespace dpe {
+DPEJobHostNode::DPEJobHostNode(const std::string& my_ip, int port,
+                               const std::vector<JobSpec>& jobs)
+    : my_ip_(my_ip), port_(port), weakptr_factory_(this) {
+  for (auto& spec : jobs) {
+    Job job;
+    job.spec = spec;
+    jobs_.push_back(job);
+  }
+}
+
+DPEJobHostNode::~DPEJobHostNode() { Stop(); }
+
+bool DPEJobHostNode::Start() {
+  if (jobs_.empty()) {
+    LOG(ERROR) << "No job to run.";
+    return false;
+  }
+  zserver_ = new ZServer(this);
+  if (!zserver_->Start(my_ip_, port_)) {
+    zserver_ = NULL;
+    LOG(WARNING) << "Cannot start job host.";
+    LOG(WARNING) << "ip = " << my_ip_;
+    LOG(WARNING) << "port = " << port_;
+    return false;
+  }
+  LOG(INFO) << "ZServer starts at: " << zserver_->GetServerAddress()
+            << std::endl;
+
+  broadcast_ = new BroadcastChannel();
+  for (int i = 0; i < static_cast<int>(jobs_.size()); ++i) {
+    Job& job = jobs_[i];
+    Solver* solver = GetJobSolver(job.spec.name);
+    if (!solver) {
+      LOG(ERROR) << "Unknown job: " << job.spec.name;
+      return false;
+    }
+    job.master = new DPEMasterNode(
+        my_ip_, job.spec.name, solver, broadcast_.get(),
+        base::Bind(&DPEJobHostNode::OnJobExit, weakptr_factory_.GetWeakPtr(),
+                   i));
+    if (!job.master->Start()) {
+      LOG(ERROR) << "Failed to start job " << job.spec.name;
+      return false;
+    }
+    LOG(INFO) << "Job " << job.spec.name << ", weight = " << job.spec.weight;
+  }
+  return true;
+}
+
+void DPEJobHostNode::Stop() {
+  for (auto& job : jobs_) {
+    if (job.master) {
+      job.master->Stop();
+      job.master = NULL;
+    }
+  }
+  if (broadcast_) {
+    broadcast_->Close();
+    broadcast_ = NULL;
+  }
+  if (zserver_) {
+    zserver_->Stop();
+    zserver_ = NULL;
+  }
+}
+
+int DPEJobHostNode::HandleRequest(const Request& req, Response& reply) {
+  if (req.has_replicate() || req.has_get_shard_result() ||
+      req.has_claim_task()) {
+    LOG(WARNING) << "Standbys and shards are not supported with jobs.";
+    return 0;
+  }
+
+  if (!req.job().empty()) {
+    const int index = FindJob(req.job());
+    if (index < 0) {
+      LOG(WARNING) << "Unknown job: " << req.job();
+      return 0;
+    }
+    if (jobs_[index].master) {
+      // The get_task is not bound to the job.
+      Request job_req(req);
+      job_req.clear_get_task();
+      jobs_[index].master->HandleRequest(job_req, reply);
+    }
+    // The late results of a finished job are dropped.
+    reply.set_error_code(0);
+  }
+  if (req.has_get_task()) {
+    HandleGetTask(req, reply);
+  }
+  if (req.name() == "heartbeat") {
+    reply.set_error_code(0);
+  }
+  if (broadcast_ && !broadcast_->address().empty()) {
+    reply.set_broadcast_address(broadcast_->address());
+  }
+  return 0;
+}
+
+void DPEJobHostNode::HandleGetTask(const Request& req, Response& reply) {
+  Request get_task_req;
+  get_task_req.set_name("get_task");
+  get_task_req.set_worker_id(req.worker_id());
+  get_task_req.set_request_timestamp(req.request_timestamp());
+  *get_task_req.mutable_get_task() = req.get_task();
+
+  int retry_delay = 0;
+  for (auto index : OrderJobsToAsk()) {
+    Response job_reply;
+    jobs_[index].master->HandleRequest(get_task_req, job_reply);
+    const GetTaskResponse& task = job_reply.get_task();
+    if (task.task_id_size() > 0) {
+      GetTaskResponse* job_task = reply.mutable_get_task();
+      *job_task = task;
+      job_task->set_job(jobs_[index].spec.name);
+      reply.set_error_code(0);
+      return;
+    }
+    retry_delay = std::max(retry_delay, task.retry_delay());
+  }
+  // The worker waits while a job may have more tasks.
+  GetTaskResponse* task = reply.mutable_get_task();
+  if (retry_delay > 0) {
+    task->set_retry_delay(retry_delay);
+  }
+  reply.set_error_code(0);
+}
+
+std::vector<int> DPEJobHostNode::OrderJobsToAsk() {
+  std::vector<int> active;
+  std::vector<JobShare> shares;
+  for (int i = 0; i < static_cast<int>(jobs_.size()); ++i) {
+    if (jobs_[i].master) {
+      JobShare share;
+      share.weight = jobs_[i].spec.weight;
+      share.running_count = jobs_[i].master->running_task_count();
+      active.push_back(i);
+      shares.push_back(share);
+    }
+  }
+
+  // A job without pending tasks may hand out copies of its running tasks,
+  // so it is asked after the jobs with pending tasks.
+  std::vector<int> pending;
+  std::vector<int> others;
+  for (auto i : OrderJobs(shares, GetFlags().job_policy != "priority")) {
+    const int index = active[i];
+    if (jobs_[index].master->pending_task_count() > 0) {
+      pending.push_back(index);
+    } else {
+      others.push_back(index);
+    }
+  }
+  pending.insert(pending.end(), others.begin(), others.end());
+  return pending;
+}
+
+void DPEJobHostNode::OnJobExit(int index) {
+  Job& job = jobs_[index];
+  if (!job.master) {
+    return;
+  }
+  LOG(INFO) << "Job " << job.spec.name << " is finished.";
+  job.master->Stop();
+  job.master = NULL;
+  for (auto& other : jobs_) {
+    if (other.master) {
+      return;
+    }
+  }
+  LOG(INFO) << "All the jobs are finished.";
+  WillExitDpe();
+}
+
+int DPEJobHostNode::FindJob(const std::string& name) const {
+  for (int i = 0; i < static_cast<int>(jobs_.size()); ++i) {
+    if (jobs_[i].spec.name == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool DPEJobHostNode::HandleRequest(const http::HttpRequest& req,
+                                   http::HttpResponse* rep) {
+  if (req.method == "GET" && req.path == "/jobs") {
+    auto* lv = new base::ListValue();
+    for (auto& job : jobs_) {
+      auto* v = new base::DictionaryValue();
+      v->SetString("name", job.spec.name);
+      v->SetString("weight", std::to_string(job.spec.weight));
+      v->SetString("finished", job.master ? "false" : "true");
+      if (job.master) {
+        v->SetString("pendingTask",
+                     std::to_string(job.master->pending_task_count()));
+        v->SetString("runningTask",
+                     std::to_string(job.master->running_task_count()));
+      }
+      lv->Append(v);
+    }
+    base::DictionaryValue dv;
+    dv.Set("jobs", lv);
+    std::string ret;
+    base::JSONWriter::Write(&dv, &ret);
+    rep->SetBody(ret);
+    return true;
+  }
+
+  int index = -1;
+  auto where = req.parameters.find("job");
+  if (where != req.parameters.end()) {
+    index = FindJob(where->second);
+  } else {
+    for (int i = 0; i < static_cast<int>(jobs_.size()) && index < 0; ++i) {
+      if (jobs_[i].master) {
+        index = i;
+      }
+    }
+  }
+  if (index < 0 || !jobs_[index].master) {
+    return true;
+  }
+  return jobs_[index].master->HandleRequest(req, rep);
+}
+}  // namespace dpe
@@ -0,0 +1,67 @@
+#ifndef DPE_JOB_HOST_NODE_H_
+#define DPE_JOB_HOST_NODE_H_
+
+#include <string>
+#include <vector>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe/broadcast_channel.h"
+#include "dpe/dpe_internal.h"
+#include "dpe/dpe_master_node.h"
+#include "dpe/http_server.h"
+#include "dpe/proto/dpe.pb.h"
+#include "dpe/zserver.h"
+
+namespace dpe {
+// Runs several jobs in one master.
+//
+// Every job has its own DPEMasterNode (solver, task table and state files
+// state-<job>.*) without a server. The host serves the workers: a request
+// bound to a job is passed to the master of the job, and a get_task is
+// passed to the jobs in the order of the job policy until one of them has
+// tasks, so the threads of the workers are shared by the jobs. The jobs
+// share the broadcast channel of the host. The host exits when all the jobs
+// are finished.
+class DPEJobHostNode : public ZServerHandler,
+                       public http::HttpReqestHandler,
+                       public base::RefCounted<DPEJobHostNode> {
+ public:
+  DPEJobHostNode(const std::string& my_ip, int port,
+                 const std::vector<JobSpec>& jobs);
+  ~DPEJobHostNode();
+
+  bool Start();
+  void Stop();
+
+  int HandleRequest(const Request& req, Response& reply);
+
+  // /jobs lists the jobs, the other pages are the pages of the master of
+  // the job parameter (the first unfinished job by default).
+  bool HandleRequest(const http::HttpRequest& req, http::HttpResponse* rep);
+
+ private:
+  struct Job {
+    JobSpec spec;
+    // NULL if the job is finished.
+    scoped_refptr<DPEMasterNode> master;
+  };
+
+  // Hands out the tasks of the first job in the policy order which has
+  // tasks.
+  void HandleGetTask(const Request& req, Response& reply);
+  // Returns the unfinished jobs in the policy order, the jobs with pending
+  // tasks come first.
+  std::vector<int> OrderJobsToAsk();
+  void OnJobExit(int index);
+  // Returns -1 if |name| is not a job.
+  int FindJob(const std::string& name) const;
+
+  scoped_refptr<ZServer> zserver_;
+  std::string my_ip_;
+  int port_;
+  std::vector<Job> jobs_;
+  scoped_refptr<BroadcastChannel> broadcast_;
+  base::WeakPtrFactory<DPEJobHostNode> weakptr_factory_;
+};
+}  // namespace dpe
+#endif
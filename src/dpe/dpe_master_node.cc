@@ -1,15 +1,173 @@
 #include "dpe/dpe_master_node.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
 #include <google/protobuf/text_format.h>
 
+#include "dpe_base/zmq_adapter.h"
 #include "dpe/dpe.h"
 #include "dpe/dpe_internal.h"
+#include "dpe/scheduler_util.h"
 
 namespace dpe {
+// The task log is compacted if it is larger than this size.
+static const int64 kCompactLogSize = 64 * 1024 * 1024;
+
+// The leases are checked every kLeaseTick microseconds.
+static const int64 kLeaseTick = 1000000;
+
+// The median time usage for the speculative execution is computed from the
+// last kTimeSampleCount finished tasks, it requires kMinTimeSampleCount.
+static const size_t kTimeSampleCount = 1024;
+static const size_t kMinTimeSampleCount = 16;
+
+// --task_order=cost orders the pending tasks one by one if there are at most
+// kMaxOrderedTaskCount of them, otherwise only a fitted cost model is used.
+static const int64 kMaxOrderedTaskCount = 1 << 24;
+static const size_t kEstimateBatchSize = 65536;
+// The cost model needs kMinCostSamples samples, at most kMaxCostSamples of
+// the finished tasks are used.
+static const size_t kMinCostSamples = 32;
+static const int64 kMaxCostSamples = 65536;
+
+// Solver::SetResult is not called during the reduction, so the pushed
+// results wait in a queue. No task is handed out while it has
+// kMaxQueuedResults results, the workers ask again after
+// kReductionRetryDelay milliseconds.
+static const int64 kMaxQueuedResults = 1 << 20;
+static const int kReductionRetryDelay = 1000;
+
+// The tasks of a stage are pulled from the solver kStageBatchSize at a time,
+// a worker without a task asks again after kStageRetryDelay milliseconds if
+// more stages may come or tasks are running.
+static const int kStageBatchSize = 65536;
+static const int kStageRetryDelay = 1000;
+
+// A snapshot page has at most kSnapshotPageSize tasks, and a response of
+// the records has about kMaxReplicationBytes bytes.
+static const int64 kSnapshotPageSize = 1 << 16;
+static const int64 kMaxReplicationBytes = 4 * 1024 * 1024;
+// The standby asks for the records every kReplicationInterval microseconds.
+// It takes over if the primary doesn't respond in kPromoteTimeout, and the
+// primary drops a standby which doesn't ask in kStandbyTimeout.
+static const int64 kReplicationInterval = 200 * 1000;
+static const int64 kPromoteTimeout = 10 * 1000000LL;
+static const int64 kStandbyTimeout = 30 * 1000000LL;
+// The reserve has at least kMinReservedTasks tasks and twice the tasks
+// handed out between two replications. A worker waiting for the reserve
+// asks again after kReserveRetryDelay milliseconds.
+static const int64 kMinReservedTasks = 256;
+static const int kReserveRetryDelay = 200;
+// The tasks reserved by the lost primary wait kFailoverGracePeriod
+// microseconds for the workers running them.
+static const int64 kFailoverGracePeriod = 30 * 1000000LL;
+
+// The result store reserves the expected size of at most
+// kMaxPayloadReservation bytes when it is created.
+static const int64 kMaxPayloadReservation = 256 * 1024 * 1024;
+
+// A master whose job is completed by the solver exits kCancelExitDelay
+// microseconds after Finish, so the workers get the cancel.
+static const int64 kCancelExitDelay = 2 * 1000000LL;
+
+// Narrows [first, last] to the |shard_index|-th of |shard_count| even parts,
+// a shard owns its part of every range. Returns false if the part is empty.
+static bool SliceTaskRange(int shard_index, int shard_count, int64* first,
+                           int64* last) {
+  if (*first > *last) {
+    return false;
+  }
+  const int64 size = *last - *first + 1;
+  const int64 part = size / shard_count;
+  const int64 extra = size % shard_count;
+  const int64 begin =
+      *first + part * shard_index + std::min<int64>(shard_index, extra);
+  const int64 length = part + (shard_index < extra ? 1 : 0);
+  if (length == 0) {
+    return false;
+  }
+  *first = begin;
+  *last = begin + length - 1;
+  return true;
+}
 
 DPEMasterNode::DPEMasterNode(const std::string& my_ip, int port)
-    : my_ip_(my_ip), port_(port), weakptr_factory_(this), last_save_time_(0) {
+    : my_ip_(my_ip),
+      port_(port),
+      solver_(GetSolver()),
+      weakptr_factory_(this),
+      finishing_(false),
+      payload_size_hint_(0),
+      stage_count_(1),
+      stage_done_cursor_(0),
+      task_injection_(false),
+      published_bound_(0),
+      published_cancelled_(false),
+      lease_table_(kLeaseTick),
+      task_time_(0),
+      time_sample_pos_(0),
+      cost_model_pending_(false),
+      last_save_time_(0),
+      standby_in_sync_(false),
+      last_standby_time_(0),
+      dispatched_count_(0),
+      exit_pending_(false),
+      standby_(false),
+      zmq_client_(base::zmq_client()),
+      replicating_(false),
+      last_primary_time_(0),
+      primary_epoch_(0),
+      primary_term_(0),
+      term_(1),
+      fenced_(false),
+      replication_seq_(0),
+      snapshot_index_(-1),
+      snapshot_end_seq_(-1),
+      snapshot_value_logged_(false) {
+  executable_dir_ = GetExecutableDir();
+  dpe_module_dir_ = GetDpeModuleDir();
+}
+
+DPEMasterNode::DPEMasterNode(const std::string& my_ip, const std::string& job,
+                             Solver* solver, BroadcastChannel* broadcast,
+                             const base::Closure& exit_callback)
+    : my_ip_(my_ip),
+      port_(0),
+      job_(job),
+      solver_(solver),
+      exit_callback_(exit_callback),
+      weakptr_factory_(this),
+      finishing_(false),
+      payload_size_hint_(0),
+      stage_count_(1),
+      stage_done_cursor_(0),
+      task_injection_(false),
+      published_bound_(0),
+      published_cancelled_(false),
+      broadcast_(broadcast),
+      lease_table_(kLeaseTick),
+      task_time_(0),
+      time_sample_pos_(0),
+      cost_model_pending_(false),
+      last_save_time_(0),
+      standby_in_sync_(false),
+      last_standby_time_(0),
+      dispatched_count_(0),
+      exit_pending_(false),
+      standby_(false),
+      zmq_client_(base::zmq_client()),
+      replicating_(false),
+      last_primary_time_(0),
+      primary_epoch_(0),
+      primary_term_(0),
+      term_(1),
+      fenced_(false),
+      replication_seq_(0),
+      snapshot_index_(-1),
+      snapshot_end_seq_(-1),
+      snapshot_value_logged_(false) {
   executable_dir_ = GetExecutableDir();
   dpe_module_dir_ = GetDpeModuleDir();
 }
@@ -17,130 +175,601 @@ DPEMasterNode::DPEMasterNode(const std::string& my_ip, int port)
 DPEMasterNode::~DPEMasterNode() { Stop(); }
 
 bool DPEMasterNode::Start() {
-  zserver_ = new ZServer(this);
-  if (!zserver_->Start(my_ip_, port_)) {
-    zserver_ = NULL;
-    LOG(WARNING) << "Cannot start master node.";
-    LOG(WARNING) << "ip = " << my_ip_;
-    LOG(WARNING) << "port = " << port_;
-    return false;
+  // The job host serves the requests of a job.
+  if (!job_.empty()) {
+    LOG(INFO) << "Start job " << job_;
+  } else {
+    zserver_ = new ZServer(this);
+    if (!zserver_->Start(my_ip_, port_)) {
+      zserver_ = NULL;
+      LOG(WARNING) << "Cannot start master node.";
+      LOG(WARNING) << "ip = " << my_ip_;
+      LOG(WARNING) << "port = " << port_;
+      return false;
+    } else {
+      LOG(INFO) << "ZServer starts at: " << zserver_->GetServerAddress()
+                << std::endl;
+    }
+  }
+
+  Solver* solver = solver_;
+  solver->InitMaster();
+  combiner_.reset(new ResultCombiner(solver));
+  combiner_->Init(combined_value_);
+  if (combiner_->enabled()) {
+    LOG(INFO) << "Results are combined by combiner " << combiner_->type();
+  } else if (solver->HasPayload(&payload_size_hint_)) {
+    if (IsShard()) {
+      LOG(ERROR) << "The payloads are not supported by shards.";
+      return false;
+    }
+    LOG(INFO) << "Results are payloads, size hint = " << payload_size_hint_;
+  }
+  // A shard only declares its part of the tasks: its part of every range,
+  // or its contiguous part of the task list.
+  const int shard_count =
+      IsShard() ? static_cast<int>(GetFlags().shard_servers.size()) : 1;
+  const int shard_index = IsShard() ? GetFlags().shard_index : 0;
+  const int range_count = solver->GetTaskRangeCount();
+  if (range_count == Solver::kPullTaskRanges) {
+    task_table_.ResetGenerator(
+        [solver, shard_index, shard_count](int64* first, int64* last) {
+          while (solver->NextTaskRange(first, last)) {
+            if (SliceTaskRange(shard_index, shard_count, first, last)) {
+              return true;
+            }
+          }
+          return false;
+        });
+    LOG(INFO) << "Task ranges are pulled from solver.";
+  } else if (range_count >= 0) {
+    std::vector<int64> first(range_count);
+    std::vector<int64> last(range_count);
+    if (range_count > 0) {
+      solver->GenerateTaskRanges(&first[0], &last[0]);
+    }
+    int size = 0;
+    for (int i = 0; i < range_count; ++i) {
+      if (SliceTaskRange(shard_index, shard_count, &first[i], &last[i])) {
+        first[size] = first[i];
+        last[size] = last[i];
+        ++size;
+      }
+    }
+    task_table_.ResetRanges(size, first.data(), last.data());
+    LOG(INFO) << "Found " << task_table_.size() << " tasks in " << size
+              << " ranges.";
   } else {
-    LOG(INFO) << "ZServer starts at: " << zserver_->GetServerAddress()
-              << std::endl;
+    int task_count = solver->GetTaskCount();
+    std::vector<int64> task_queue(task_count);
+    if (task_count > 0) {
+      solver->GenerateTasks(&task_queue[0]);
+    }
+    if (shard_count > 1) {
+      const int64 begin =
+          static_cast<int64>(task_count) * shard_index / shard_count;
+      const int64 end =
+          static_cast<int64>(task_count) * (shard_index + 1) / shard_count;
+      task_queue.erase(task_queue.begin() + end, task_queue.end());
+      task_queue.erase(task_queue.begin(), task_queue.begin() + begin);
+    }
+    task_table_.Reset(std::move(task_queue));
+    LOG(INFO) << "Found " << task_table_.size() << " tasks.";
+  }
+  stage_count_ = std::max(solver->GetStageCount(), 1);
+  if (stage_count_ > 1) {
+    if (combiner_->enabled() || solver->HasPayload(&payload_size_hint_) ||
+        IsShard()) {
+      LOG(ERROR) << "The stages are not supported with a combiner, payloads "
+                 << "or shards.";
+      return false;
+    }
+    LOG(INFO) << "The job has " << stage_count_ << " stages.";
+  }
+  task_injection_ = solver->AcceptTaskInjector(this);
+  if (task_injection_) {
+    if (combiner_->enabled() || solver->HasPayload(&payload_size_hint_) ||
+        IsShard()) {
+      LOG(ERROR) << "The task injection is not supported with a combiner, "
+                 << "payloads or shards.";
+      return false;
+    }
+    LOG(INFO) << "The solver adds tasks while the job runs.";
+  }
+  int64 initial_bound = 0;
+  const int bound_type = solver->GetBoundType(&initial_bound);
+  if (bound_type != Solver::kNoBound) {
+    bound_ = new GlobalBoundValue(bound_type, initial_bound);
+    published_bound_ = initial_bound;
+    solver->SetGlobalBound(bound_.get());
+    LOG(INFO) << "The job has a global bound, initial bound = "
+              << initial_bound;
+  }
+  cancel_ = new CancelFlagValue(true);
+  if (solver->AcceptCancelFlag(cancel_.get())) {
+    // A shard sees only its part of the results, and the other shards would
+    // run on.
+    if (IsShard()) {
+      LOG(ERROR) << "The cancellation is not supported with shards.";
+      return false;
+    }
+    LOG(INFO) << "The solver may complete the job early.";
+  } else {
+    cancel_ = NULL;
+  }
+  // The ranges of a pull generator are declared on demand. The stages, the
+  // injected tasks, the payloads, the standby and the cost order need the
+  // whole task set up front, so it is pulled at once for them.
+  if (HasDynamicTasks() ||
+      (!combiner_->enabled() && solver->HasPayload(&payload_size_hint_)) ||
+      GetFlags().type == "standby" || GetFlags().task_order == "cost") {
+    task_table_.PullAllRanges();
+  }
+  // Stage 0 is complete.
+  stage_begin_.push_back(0);
+  stage_begin_.push_back(task_table_.size());
+
+  state_path_ = executable_dir_ + "\\state";
+  if (!job_.empty()) {
+    state_path_ += "-" + job_;
+  }
+  if (IsShard()) {
+    state_path_ += "-" + std::to_string(shard_index);
+    LOG(INFO) << "Shard " << shard_index << " of " << shard_count << " owns "
+              << task_table_.size() << " known tasks.";
   }
 
-  GetSolver()->InitMaster();
-  int task_count = GetSolver()->GetTaskCount();
-  task_queue_.resize(task_count);
-  GetSolver()->GenerateTasks(&task_queue_[0]);
-  LOG(INFO) << "Found " << task_queue_.size() << " tasks.";
+  standby_ = GetFlags().type == "standby";
+  if (standby_) {
+    // The standby needs the same task table and log records as the primary.
+    if (IsShard() || HasDynamicTasks() ||
+        (!combiner_->enabled() && solver->HasPayload(&payload_size_hint_))) {
+      LOG(ERROR) << "The standby is not supported with shards, stages, "
+                 << "injected tasks or payloads.";
+      return false;
+    }
+    if (GetFlags().primary_server.port <= 0) {
+      LOG(ERROR) << "The standby needs primary_server.";
+      return false;
+    }
+    primary_address_ = base::AddressHelper::MakeZMQTCPAddress(
+        GetFlags().primary_server.ip, GetFlags().primary_server.port);
+  }
 
-  for (auto& iter : task_queue_) {
-    TaskItem item;
-    item.set_task_id(iter);
-    item.set_status(TaskItem::TaskStatus::TaskItem_TaskStatus_PENDING);
-    task_map_[iter].CopyFrom(item);
-    task_pending_queue_.push_back(iter);
+  task_state_file_ = new TaskStateFile(state_path_ + ".tasks");
+  task_log_ = new TaskLog(state_path_);
+  task_log_->set_append_callback(base::Bind(
+      &ReplicationLog::Append, base::Unretained(&replication_log_)));
+  if (!combiner_->enabled() && solver_->HasPayload(&payload_size_hint_)) {
+    result_store_.reset(new ResultStore(state_path_ + ".results"));
+  }
+  if (!result_store_ && solver->HasCheckpoint()) {
+    checkpoint_store_.reset(
+        new CheckpointStore(state_path_ + ".checkpoints"));
+    LOG(INFO) << "Tasks resume from their checkpoints.";
+  }
+  int64 cache_version = 0;
+  int64 cache_params = 0;
+  if (solver_->GetResultCacheKey(&cache_version, &cache_params)) {
+    if (combiner_->enabled() || result_store_ || IsShard() || standby_) {
+      LOG(WARNING) << "The result cache is not supported with combiners, "
+                   << "payloads, shards or standbys.";
+    } else {
+      result_cache_.reset(new ResultCache(executable_dir_ + "\\result_cache",
+                                          cache_version, cache_params));
+      if (result_cache_->Open()) {
+        LOG(INFO) << result_cache_->size() << " results are cached.";
+      } else {
+        result_cache_.reset();
+      }
+    }
+  }
+  if (GetFlags().reducer_number > 0 && HasDynamicTasks()) {
+    LOG(WARNING) << "reducer_number is ignored, the tasks are generated "
+                 << "from Solver::SetResult.";
+  } else if (GetFlags().reducer_number > 0 && result_store_) {
+    LOG(WARNING) << "reducer_number is ignored, the results are payloads.";
+  } else if (GetFlags().reducer_number > 0 && IsShard()) {
+    LOG(WARNING) << "reducer_number is ignored, the coordinator reduces "
+                 << "the results.";
+  } else if (GetFlags().reducer_number > 0 && combiner_->enabled()) {
+    LOG(WARNING) << "reducer_number is ignored, the results are combined.";
+  } else if (GetFlags().reducer_number > 0) {
+    reduction_pipeline_ = new ReductionPipeline(
+        solver, GetFlags().reducer_number, kMaxQueuedResults);
+    if (reduction_pipeline_->Start()) {
+      LOG(INFO) << "Results are reduced on " << GetFlags().reducer_number
+                << " threads.";
+    } else {
+      LOG(WARNING) << "Solver::NewPartial is not supported, "
+                   << "Solver::SetResult is used.";
+      reduction_pipeline_ = NULL;
+    }
   }
-  if (GetFlags().read_state) {
+  if (standby_) {
+    // The state is copied from the primary.
+    SkipLoadState();
+    LoadCheckpoints(false);
+    LOG(INFO) << "Standby of the primary at " << primary_address_;
+    last_primary_time_ = base::Time::Now().ToInternalValue();
+    replication_timer_ = new base::RepeatedAction(NULL);
+    replication_timer_->Start(
+        base::Bind(&DPEMasterNode::RequestReplication,
+                   weakptr_factory_.GetWeakPtr()),
+        base::TimeDelta(),
+        base::TimeDelta::FromMicroseconds(kReplicationInterval), -1);
+  } else if (GetFlags().read_state) {
     LoadState();
-    if (task_pending_queue_.empty() && task_running_queue_.empty()) {
-      GetSolver()->Finish();
-      WillExitDpe();
+    LoadCheckpoints(true);
+    if (IsAllDone()) {
+      FinishAllTasks();
     }
   } else {
     SkipLoadState();
+    LoadCheckpoints(false);
+    PullStageTasks();
+  }
+  if (GetFlags().task_order == "cost") {
+    cost_model_pending_ = !OrderTasksByCost();
   }
+
+  // The standby broadcasts the bound after it takes over.
+  if (!standby_) {
+    StartBroadcast();
+  }
+
+  lease_timer_ = new base::RepeatedAction(NULL);
+  lease_timer_->Start(
+      base::Bind(&DPEMasterNode::OnTimer, weakptr_factory_.GetWeakPtr()),
+      base::TimeDelta::FromMicroseconds(kLeaseTick),
+      base::TimeDelta::FromMicroseconds(kLeaseTick), -1);
   return true;
 }
 
 void DPEMasterNode::Stop() {
+  if (lease_timer_) {
+    lease_timer_->Stop();
+    lease_timer_ = NULL;
+  }
+  if (replication_timer_) {
+    replication_timer_->Stop();
+    replication_timer_ = NULL;
+  }
   if (zserver_) {
     zserver_->Stop();
     zserver_ = NULL;
   }
+  if (task_log_) {
+    task_log_->Close();
+    task_log_ = NULL;
+  }
+  if (result_store_) {
+    result_store_->Sync();
+    result_store_->Close();
+  }
+  reduction_pipeline_ = NULL;
+  // The channel of a job is closed by the host.
+  if (broadcast_ && job_.empty()) {
+    broadcast_->Close();
+  }
+  broadcast_ = NULL;
 }
 
 int DPEMasterNode::HandleRequest(const Request& req, Response& reply) {
+  // The coordinator is not a worker.
+  if (req.has_get_shard_result()) {
+    auto* shard = new GetShardResultResponse();
+    GetShardResult(req.get_shard_result(), shard);
+    reply.set_allocated_get_shard_result(shard);
+    reply.set_error_code(0);
+    return 0;
+  }
+  // A primary replaced by its standby refuses the requests, so the workers
+  // move to the new primary.
+  if (req.term() > term_ && !standby_ && !fenced_) {
+    LOG(ERROR) << "The standby took over with term " << req.term()
+               << ", the master stops.";
+    fenced_ = true;
+    StopReplication();
+    Exit();
+  }
+  reply.set_term(term_);
+  // A standby serves the requests after it takes over.
+  if (standby_ || fenced_) {
+    reply.set_error_code(kErrorNotPrimary);
+    return 0;
+  }
+  if (req.name() == "fence") {
+    reply.set_error_code(0);
+    return 0;
+  }
+  if (req.has_replicate()) {
+    // The standby needs the same task table and log records.
+    if (IsShard() || HasDynamicTasks() || result_store_) {
+      LOG(WARNING) << "The standby is not supported with shards, stages, "
+                   << "injected tasks or payloads.";
+      reply.set_error_code(kErrorNotSupported);
+      return 0;
+    }
+    // The standby pulls the whole task set, so the indexes are the same.
+    task_table_.PullAllRanges();
+    auto* replicate = new ReplicateResponse();
+    HandleReplicate(req.replicate(), replicate);
+    reply.set_allocated_replicate(replicate);
+    reply.set_error_code(0);
+    return 0;
+  }
+
   const auto current_time = base::Time::Now().ToInternalValue();
   auto& worker = GetWorker(req.worker_id());
-  worker.set_request_count(worker.request_count() + 1);
-  worker.set_latency_sum(worker.latency_sum() + current_time -
-                         req.request_timestamp());
-  worker.set_updated_time(current_time);
-
-  if (req.has_get_task()) {
-    auto& get_task = req.get_task();
-    const int max_task_count = std::max(get_task.max_task_count(), 1);
-    int added = 0;
-    auto* task = new GetTaskResponse();
+  UpdateRequestStats(&worker, req, current_time);
 
-    while (!task_pending_queue_.empty() && added < max_task_count) {
-      const int64 task_id = task_pending_queue_.front();
-      task_pending_queue_.pop_front();
-      task_running_queue_.insert(task_id);
-      worker.add_running_task(task_id);
-      task_map_[task_id].set_status(
-          TaskItem::TaskStatus::TaskItem_TaskStatus_RUNNING);
-      task->add_task_id(task_id);
-      ++added;
+  if (req.has_put_payload()) {
+    HandlePutPayload(worker.worker_id(), req.put_payload());
+    reply.set_error_code(0);
+  }
+  if (req.has_checkpoint()) {
+    HandleCheckpoint(&worker, req.checkpoint(), current_time);
+    reply.set_error_code(0);
+  }
+  // The tasks the worker is still computing keep their leases, so a long
+  // task is not handed out again.
+  if (req.has_heartbeat()) {
+    for (auto task_id : req.heartbeat().task_id()) {
+      const int64 index = task_table_.IndexOf(task_id);
+      if (index >= 0) {
+        RenewLease(worker, index, current_time);
+      }
+    }
+    reply.set_error_code(0);
+  }
+  if (req.has_memo()) {
+    if (!memo_) {
+      memo_.reset(new MemoCache(static_cast<int64>(GetFlags().memo_size) *
+                                1024 * 1024));
     }
+    HandleMemoRequest(memo_.get(), req.memo(), reply.mutable_memo());
+    reply.set_error_code(0);
+  }
+  // The claims come before the results, so that the results of the claimed
+  // tasks release their leases.
+  if (req.has_claim_task()) {
+    HandleClaimTask(&worker, req.claim_task(), current_time);
+    reply.set_error_code(0);
+  }
 
-    reply.set_allocated_get_task(task);
+  // A request may carry both finish_compute and get_task, the results are
+  // handled before handing out new tasks.
+  if (req.has_finish_compute() && IsCancelled()) {
+    // The results after the solver completed the job are dropped.
     reply.set_error_code(0);
   } else if (req.has_finish_compute()) {
     auto& data = req.finish_compute();
-    const int size = data.task_item_size();
+    // A combined batch carries task_id and the combined value of the results.
+    const bool combined = data.task_id_size() > 0;
+    const int size = combined ? data.task_id_size() : data.task_item_size();
+    UpdateComputeTime(&worker, size, data.total_time_usage());
 
     std::set<int64> removed_task_id;
+    // The tasks reassigned to other workers.
+    std::map<std::string, std::set<int64>> reassigned_task_id;
     std::vector<int64> task_id;
     std::vector<int64> result;
     std::vector<int64> time_usage;
+    // A result cannot be removed from a combined value, so a combined batch
+    // is dropped if any of its tasks is done.
+    bool accepted = !combined || (combiner_->enabled() &&
+                                  data.combiner() == combiner_->type());
+    for (int i = 0; combined && accepted && i < size; ++i) {
+      const int64 index = task_table_.IndexOf(data.task_id(i));
+      accepted =
+          index >= 0 && task_table_.status(index) != TaskTable::TASK_DONE;
+    }
     for (int i = 0; i < size; ++i) {
-      auto& item = data.task_item(i);
-      removed_task_id.insert(item.task_id());
-      if (task_running_queue_.count(item.task_id())) {
-        auto& my_item = task_map_[item.task_id()];
-        my_item.set_result(item.result());
-        my_item.set_time_usage(item.time_usage());
-        my_item.set_status(TaskItem::TaskStatus::TaskItem_TaskStatus_DONE);
+      const int64 item_task_id =
+          combined ? data.task_id(i) : data.task_item(i).task_id();
+      int64 item_result = combined ? 0 : data.task_item(i).result();
+      const int64 item_time_usage = combined
+                                        ? data.total_time_usage() / size
+                                        : data.task_item(i).time_usage();
+      removed_task_id.insert(item_task_id);
+      const int64 index = task_table_.IndexOf(item_task_id);
+      if (index < 0) {
+        continue;
+      }
+      if (!accepted) {
+        // The unfinished tasks are handed out again.
+        ReturnTask(worker.worker_id(), index);
+        continue;
+      }
+      if (result_store_ &&
+          !TakePayload(worker.worker_id(), item_task_id, &item_result)) {
+        LOG(WARNING) << "The payload of task " << item_task_id
+                     << " is not complete.";
+        ReturnTask(worker.worker_id(), index);
+        continue;
+      }
 
-        task_running_queue_.erase(item.task_id());
+      TaskLeaseTable::Lease lease;
+      if (lease_table_.Release(index, &lease)) {
+        if (lease.worker_id == worker.worker_id()) {
+          UpdateTaskTime(&worker, current_time - lease.start_time);
+        } else if (!lease.worker_id.empty()) {
+          // An empty worker_id holds a task after the failover.
+          reassigned_task_id[lease.worker_id].insert(item_task_id);
+        }
+      }
 
-        task_id.push_back(item.task_id());
-        result.push_back(item.result());
-        time_usage.push_back(item.time_usage());
+      // The first result wins, the late result of a reassigned task is
+      // dropped.
+      if (task_table_.MarkDone(index, item_result, item_time_usage)) {
+        expired_count_.erase(index);
+        if (checkpoint_store_) {
+          checkpoint_store_->Erase(item_task_id);
+        }
+        auto copy = speculative_task_.find(index);
+        if (copy != speculative_task_.end()) {
+          if (copy->second.worker_id != worker.worker_id()) {
+            reassigned_task_id[copy->second.worker_id].insert(item_task_id);
+          }
+          speculative_task_.erase(copy);
+        }
+        AddTimeSample(item_time_usage);
+        if (cost_model_pending_ && item_time_usage > 0) {
+          cost_samples_.push_back(
+              std::make_pair(item_task_id, item_time_usage));
+        }
+        task_id.push_back(item_task_id);
+        result.push_back(item_result);
+        time_usage.push_back(item_time_usage);
+      } else if (result_store_) {
+        // The payload of a late result is not referenced.
+        result_store_->Free(item_result);
       }
     }
 
-    std::vector<int64> new_running_task;
-    for (auto& id : worker.running_task()) {
-      if (!removed_task_id.count(id)) {
-        new_running_task.push_back(id);
-      }
+    RemoveRunningTask(&worker, removed_task_id);
+    for (auto& iter : reassigned_task_id) {
+      RemoveRunningTask(&GetWorker(iter.first), iter.second);
     }
-    worker.clear_running_task();
-    for (auto& id : new_running_task) {
-      worker.add_running_task(id);
+
+    if (accepted) {
+      for (auto& id : removed_task_id) {
+        worker.add_finished_task(id);
+      }
     }
 
-    for (auto& id : removed_task_id) {
-      worker.add_finished_task(id);
+    if (cost_model_pending_ && cost_samples_.size() >= kMinCostSamples) {
+      cost_model_pending_ = false;
+      OrderTasksByCost();
     }
 
     if (size > 0) {
-      GetSolver()->SetResult(task_id.size(), &task_id[0], &result[0],
-                             &time_usage[0], data.total_time_usage());
-      if (task_pending_queue_.empty() && task_running_queue_.empty()) {
+      if (combiner_->enabled()) {
+        // Only the combined value of the batch is kept.
+        int64 value[2] = {data.combined_low(), data.combined_high()};
+        if (!combined) {
+          combiner_->Init(value);
+          for (auto item_result : result) {
+            combiner_->Add(value, item_result);
+          }
+        }
+        int64 total_time_usage = 0;
+        for (auto item_time_usage : time_usage) {
+          total_time_usage += item_time_usage;
+        }
+        if (!task_id.empty()) {
+          combiner_->Merge(combined_value_, value);
+          task_log_->AppendCombinedResult(value, total_time_usage,
+                                          task_id.size(), task_id.data());
+        }
+      } else {
+        task_log_->AppendTaskResults(task_id.size(), task_id.data(),
+                                     result.data(), time_usage.data());
+        if (result_cache_) {
+          result_cache_->Add(task_id.size(), task_id.data(), result.data(),
+                             time_usage.data());
+        }
+        ReportResults(task_id.size(), task_id.data(), result.data(),
+                      time_usage.data(), data.total_time_usage());
+      }
+      if (IsAllDone()) {
         SaveState(true);
-        GetSolver()->Finish();
-        WillExitDpe();
+        FinishAllTasks();
       } else {
         SaveState(false);
       }
     }
     reply.set_error_code(0);
   }
+  if (req.has_get_task()) {
+    auto& get_task = req.get_task();
+    if (get_task.has_thread_number()) {
+      worker.set_thread_number(get_task.thread_number());
+    }
+    const int max_task_count = get_task.auto_batch_size()
+                                   ? AutoBatchSize(worker, current_time)
+                                   : std::max(get_task.max_task_count(), 1);
+    int added = 0;
+    auto* task = new GetTaskResponse();
+    // The reducers are behind, the results of new tasks would pile up.
+    const bool reduction_full =
+        reduction_pipeline_ && reduction_pipeline_->IsFull();
+
+    int64 index = 0;
+    std::vector<TaskLog::TaskResultRecord> cached;
+    // No task is handed out after the job is finished, e.g. completed by the
+    // solver.
+    while (!finishing_ && !reduction_full && added < max_task_count &&
+           PopDispatchable(&index)) {
+      if (FindCachedResult(index, &cached)) {
+        continue;
+      }
+      const int64 task_id = task_table_.TaskId(index);
+      lease_table_.Grant(index, worker.worker_id(), current_time,
+                         LeaseDeadline(worker, index, current_time));
+      worker.add_running_task(task_id);
+      task->add_task_id(task_id);
+      AttachCheckpoint(task_id, task);
+      ++added;
+    }
+    if (!cached.empty()) {
+      ApplyCachedResults(cached);
+    }
+    // A prefetching worker is busy, the copies go to the idle threads. The
+    // aggregators do not report their idle threads.
+    const bool idle = get_task.has_idle_thread_number()
+                          ? get_task.idle_thread_number() > 0
+                          : worker.running_task_size() == 0;
+    if (added == 0 && !finishing_ && !reduction_full && idle) {
+      added = AddSpeculativeTasks(&worker, max_task_count, current_time, task);
+    }
+    // The worker waits for the reducers, the next stage, the tasks the
+    // running tasks may add or requeue when their leases expire, or the
+    // reserve.
+    if (added == 0 && !finishing_ && reduction_full) {
+      task->set_retry_delay(kReductionRetryDelay);
+    } else if (added == 0 && !finishing_ &&
+               (stage_begin_.size() <= static_cast<size_t>(stage_count_) ||
+                task_table_.running_count() > 0)) {
+      task->set_retry_delay(kStageRetryDelay);
+    } else if (added == 0 && !finishing_ && standby_in_sync_ &&
+               (!reserved_.empty() || task_table_.pending_count() > 0)) {
+      task->set_retry_delay(kReserveRetryDelay);
+    }
+
+    reply.set_allocated_get_task(task);
+    reply.set_error_code(0);
+  }
+  if (req.has_return_task()) {
+    // The unstarted tasks of a worker, they are handed out again.
+    auto& data = req.return_task();
+    std::set<int64> returned_task_id;
+    for (auto task_id : data.task_id()) {
+      const int64 index = task_table_.IndexOf(task_id);
+      if (index < 0) {
+        continue;
+      }
+      returned_task_id.insert(task_id);
+      ReturnTask(worker.worker_id(), index);
+    }
+    RemoveRunningTask(&worker, returned_task_id);
+    LOG(INFO) << worker.worker_id() << " returned "
+              << returned_task_id.size() << " tasks.";
+    reply.set_error_code(0);
+  }
+  if (req.name() == "heartbeat") {
+    reply.set_error_code(0);
+  }
+  if ((bound_ || cancel_) && broadcast_ && !broadcast_->address().empty()) {
+    reply.set_broadcast_address(broadcast_->address());
+  }
+  // The workers keep the results until the standby has them.
+  if (standby_in_sync_) {
+    ReplicationStatus* status = reply.mutable_replication();
+    status->set_seq(replication_log_.next_seq());
+    status->set_acked_seq(replication_log_.acked_seq());
+  }
   return 0;
 }
 
@@ -175,26 +804,25 @@ bool DPEMasterNode::HandleRequest(const http::HttpRequest& req,
 
       base::DictionaryValue dv;
       dv.Set("nodeStatus", lv);
-      dv.SetString("taskCount", std::to_string(task_map_.size()));
+      dv.SetString("taskCount", std::to_string(task_table_.size()));
 
       if (start_task_id != -1) {
-        int idx = 0;
-        const int size = task_queue_.size();
-        while (idx < size && task_queue_[idx] != start_task_id) {
-          ++idx;
+        int64 idx = task_table_.IndexOf(start_task_id);
+        const int64 size = task_table_.size();
+        if (idx < 0) {
+          idx = size;
         }
 
         auto* lv = new base::ListValue();
         while (idx < size) {
-          auto where = task_map_.find(task_queue_[idx]);
-          if (where->second.status() !=
-              TaskItem::TaskStatus::TaskItem_TaskStatus_DONE) {
+          if (task_table_.status(idx) != TaskTable::TASK_DONE) {
             break;
           }
           auto* v = new base::DictionaryValue();
-          v->SetString("taskId", std::to_string(task_queue_[idx]));
+          v->SetString("taskId", std::to_string(task_table_.TaskId(idx)));
           v->SetString("node", std::to_string(0));
-          v->SetString("timeUsage", std::to_string(where->second.time_usage()));
+          v->SetString("timeUsage",
+                       std::to_string(task_table_.time_usage(idx)));
           lv->Append(v);
           ++idx;
         }
@@ -235,15 +863,29 @@ bool DPEMasterNode::HandleRequest(const http::HttpRequest& req,
 
 void DPEMasterNode::SaveState(bool force_save) {
   int64 current_time = base::Time::Now().ToInternalValue();
+  if (force_save) {
+    // The payloads are flushed before the log records indexing them.
+    if (result_store_) {
+      result_store_->Sync();
+    }
+    task_log_->Sync();
+    if (result_cache_) {
+      result_cache_->Sync();
+    }
+  }
   if (force_save || last_save_time_ == 0 ||
       (base::Time::FromInternalValue(current_time) -
        base::Time::FromInternalValue(last_save_time_))
               .InMinutes() > 3) {
-    MasterState master_state;
-    for (auto& iter : task_map_) {
-      TaskItem* item = master_state.add_task_item();
-      item->CopyFrom(iter.second);
+    if (!force_save && result_store_) {
+      result_store_->Sync();
     }
+    if (!force_save && result_cache_) {
+      result_cache_->Sync();
+    }
+    // The task results are in the task log, only the workers are saved here.
+    MasterState master_state;
+    master_state.set_term(term_);
     for (auto& iter : worker_map_) {
       WorkerStatus* worker_status = master_state.add_worker_status();
       worker_status->CopyFrom(iter.second);
@@ -254,104 +896,1627 @@ void DPEMasterNode::SaveState(bool force_save) {
     printer.PrintToString(master_state, &data);
 
     base::FilePath file_path(
-        base::UTF8ToNative(executable_dir_ + "\\state.txtproto"));
+        base::UTF8ToNative(state_path_ + ".txtproto"));
     base::WriteFile(file_path, data.c_str(), data.size());
 
     LOG(INFO) << "Server state saved, file size = " << data.size();
     last_save_time_ = current_time;
+
+    // The log is compacted when it is larger than the snapshot, so the
+    // snapshot is written at most once per its size of logged records.
+    if (!force_save &&
+        (task_log_->log_size() >
+             std::max(kCompactLogSize, task_log_->snapshot_size()) ||
+         task_log_->has_sealed_logs())) {
+      CompactTaskLog();
+    }
   }
 }
 
-void DPEMasterNode::LoadState() {
-  base::FilePath file_path(
-      base::UTF8ToNative(executable_dir_ + "\\state.txtproto"));
-  if (!base::PathExists(file_path)) {
-    LOG(INFO) << "Cannot find master state file: " << file_path.AsUTF8Unsafe();
+void DPEMasterNode::CompactTaskLog() {
+  // The combined value of a standby is complete when the value of the
+  // snapshot is logged.
+  if (task_log_->compacting() ||
+      (combiner_->enabled() && standby_ && !snapshot_value_logged_)) {
     return;
   }
+  scoped_ptr<TaskLog::FoldedState> state(new TaskLog::FoldedState);
+  if (combiner_->enabled()) {
+    task_table_.ForEachDone([&](int64 index) {
+      TaskLog::DoneTaskRecord record = {task_table_.TaskId(index),
+                                        task_table_.time_usage(index)};
+      state->done_tasks.push_back(record);
+    });
+    state->has_combined_value = true;
+    state->combined_value[0] = combined_value_[0];
+    state->combined_value[1] = combined_value_[1];
+  } else if (!task_log_->has_external_results()) {
+    task_table_.ForEachDone([&](int64 index) {
+      TaskLog::TaskResultRecord record = {task_table_.TaskId(index),
+                                          task_table_.result(index),
+                                          task_table_.time_usage(index)};
+      state->results.push_back(record);
+    });
+  }
+  task_log_->Compact(state.Pass());
+}
 
-  std::string data;
-  if (!base::ReadFileToString(file_path, &data)) {
-    LOG(ERROR) << "Canno read state file: " << file_path.AsUTF8Unsafe();
-    return;
+bool DPEMasterNode::AttachStateFile(
+    bool reuse, std::vector<TaskLog::TaskResultRecord>* migrated) {
+  const uint64_t fingerprint = task_table_.fingerprint();
+  const int64 task_count = task_table_.size();
+  std::vector<TaskLog::TaskResultRecord> stale;
+  // The time usage of the previous run is used to order the tasks.
+  if (!reuse && GetFlags().task_order == "cost" && task_state_file_->Open()) {
+    task_state_file_->ReadDoneRecords(
+        [this](int64 task_id, int64 result, int64 time_usage) {
+          const int64 index = task_table_.IndexOf(task_id);
+          if (index >= 0 && time_usage > 0) {
+            previous_cost_.push_back(std::make_pair(index, time_usage));
+          }
+        });
+    LOG(INFO) << "Found the time usage of " << previous_cost_.size()
+              << " tasks in the previous run.";
+  }
+  if (reuse && task_state_file_->Open()) {
+    if (task_state_file_->fingerprint() == fingerprint &&
+        task_state_file_->task_count() == task_count) {
+      task_table_.AttachStorage(task_state_file_.get(), true);
+      task_log_->set_sync_results(
+          base::Bind(&TaskStateFile::Sync, task_state_file_));
+      LOG(INFO) << "Task state file loaded, done count = "
+                << task_table_.done_count();
+      return true;
+    }
+    LOG(WARNING) << "Task set is changed, rebuild task state file.";
+    // The payloads of another task set are in another result store.
+    if (!result_store_) {
+      task_state_file_->ReadDoneRecords(
+          [&stale](int64 task_id, int64 result, int64 time_usage) {
+            TaskLog::TaskResultRecord record = {task_id, result, time_usage};
+            stale.push_back(record);
+          });
+    }
   }
 
-  MasterState master_state;
-  if (!google::protobuf::TextFormat::ParseFromString(data, &master_state)) {
-    LOG(ERROR) << "Failed to parse state file: " << file_path.AsUTF8Unsafe();
-    return;
+  if (!task_state_file_->Create(fingerprint, task_count)) {
+    LOG(ERROR) << "Task state is kept in memory.";
+    return false;
   }
+  task_table_.AttachStorage(task_state_file_.get(), false);
+  task_log_->set_sync_results(
+      base::Bind(&TaskStateFile::Sync, task_state_file_));
 
-  std::map<int64, TaskItem> cached_status_;
-  int done_count = 0;
-  const int size = master_state.task_item_size();
-  for (int i = 0; i < size; ++i) {
-    auto& item = master_state.task_item(i);
-    cached_status_[item.task_id()].CopyFrom(item);
-    if (item.status() == TaskItem::TaskStatus::TaskItem_TaskStatus_DONE) {
-      ++done_count;
+  // The results of the tasks which are still in the task set.
+  for (auto& record : stale) {
+    const int64 index = task_table_.IndexOf(record.task_id);
+    if (index >= 0 &&
+        task_table_.MarkDone(index, record.result, record.time_usage)) {
+      migrated->push_back(record);
     }
   }
+  return true;
+}
+
+bool DPEMasterNode::OpenResultStore(bool reuse) {
+  if (!result_store_) {
+    return false;
+  }
+  const uint64_t fingerprint = task_table_.fingerprint();
+  if (reuse && result_store_->Open(fingerprint)) {
+    LOG(INFO) << "Result store loaded.";
+    return true;
+  }
+  const int64 capacity =
+      payload_size_hint_ > 0 &&
+              task_table_.size() < kMaxPayloadReservation / payload_size_hint_
+          ? payload_size_hint_ * task_table_.size()
+          : kMaxPayloadReservation;
+  if (!result_store_->Create(fingerprint, capacity)) {
+    LOG(ERROR) << "The payloads cannot be stored.";
+    Exit();
+    return false;
+  }
+  return true;
+}
 
-  LOG(INFO) << "Load " << cached_status_.size() << " results from saved state.";
-  LOG(INFO) << "Done count =  " << done_count;
+bool DPEMasterNode::HasPayloadRecord(int64 task_id, int64 result) const {
+  return !result_store_ || result_store_->Verify(result, task_id);
+}
 
-  int loaded_done_count = 0;
+void DPEMasterNode::DropLostPayloads() {
+  std::vector<int64> lost;
+  task_table_.ForEachDone([this, &lost](int64 index) {
+    if (!HasPayloadRecord(task_table_.TaskId(index),
+                          task_table_.result(index))) {
+      lost.push_back(index);
+    }
+  });
+  for (auto index : lost) {
+    task_table_.ResetDone(index);
+  }
+  if (!lost.empty()) {
+    LOG(WARNING) << "The payloads of " << lost.size()
+                 << " tasks are lost, they are computed again.";
+  }
+}
 
-  std::vector<int64> task_id;
-  std::vector<int64> result;
-  std::vector<int64> time_usage;
-  std::deque<int64> new_task_pending_queue;
-  for (auto& iter : task_queue_) {
-    auto where = cached_status_.find(iter);
-    if (where != cached_status_.end() &&
-        where->second.status() ==
-            TaskItem::TaskStatus::TaskItem_TaskStatus_DONE) {
-      task_id.push_back(iter);
-      result.push_back(where->second.result());
-      time_usage.push_back(where->second.time_usage());
-      task_map_[iter].CopyFrom(where->second);
-      ++loaded_done_count;
-    } else {
-      new_task_pending_queue.push_back(iter);
+void DPEMasterNode::LoadCheckpoints(bool reuse) {
+  if (!checkpoint_store_) {
+    return;
+  }
+  if (!reuse) {
+    checkpoint_store_->Clear();
+    return;
+  }
+  const int64 count = checkpoint_store_->Load([this](int64 task_id) {
+    const int64 index = task_table_.FindOrPull(task_id);
+    return index >= 0 && task_table_.status(index) != TaskTable::TASK_DONE;
+  });
+  LOG(INFO) << "Loaded " << count << " task checkpoints.";
+}
+
+void DPEMasterNode::LoadState() {
+  // The records moved from the old state files, they are appended to the log.
+  std::vector<TaskLog::TaskResultRecord> migrated;
+  // The combined results and the generated tasks are only in the task log,
+  // so the task state file is not used. The state file is bound to the
+  // fingerprint of the whole task set, so it is not used with a pull
+  // generator either, whose results are replayed from the task log.
+  if (!combiner_->enabled() && !HasDynamicTasks() &&
+      task_table_.IsComplete()) {
+    AttachStateFile(true, &migrated);
+  }
+  if (OpenResultStore(true)) {
+    DropLostPayloads();
+  }
+
+  base::FilePath file_path(
+      base::UTF8ToNative(state_path_ + ".txtproto"));
+  MasterState master_state;
+  std::string data;
+  if (!base::PathExists(file_path)) {
+    LOG(INFO) << "Cannot find master state file: " << file_path.AsUTF8Unsafe();
+  } else if (!base::ReadFileToString(file_path, &data)) {
+    LOG(ERROR) << "Canno read state file: " << file_path.AsUTF8Unsafe();
+  } else if (!google::protobuf::TextFormat::ParseFromString(data,
+                                                            &master_state)) {
+    LOG(ERROR) << "Failed to parse state file: " << file_path.AsUTF8Unsafe();
+  } else {
+    // Only the state saved by old versions has task items, they are moved
+    // to the task log.
+    const int size = master_state.task_item_size();
+    for (int i = 0; i < size; ++i) {
+      auto& item = master_state.task_item(i);
+      if (item.status() != TaskItem::TaskStatus::TaskItem_TaskStatus_DONE) {
+        continue;
+      }
+      const int64 index = task_table_.IndexOf(item.task_id());
+      if (index >= 0 && HasPayloadRecord(item.task_id(), item.result()) &&
+          task_table_.MarkDone(index, item.result(), item.time_usage())) {
+        TaskLog::TaskResultRecord record = {item.task_id(), item.result(),
+                                            item.time_usage()};
+        migrated.push_back(record);
+      }
     }
+
+    term_ = std::max(term_, master_state.term());
+    for (auto& iter : master_state.worker_status()) {
+      auto& item = worker_map_[iter.worker_id()];
+      item.CopyFrom(iter);
+      item.clear_running_task();
+    }
+  }
+
+  int64 dropped_combined_count = 0;
+  const int64 record_count = task_log_->Replay(
+      [this, &dropped_combined_count](int type, const char* data, int size) {
+        if (type == TaskLog::RECORD_DONE_TASKS) {
+          // The value of the tasks follows them in the snapshot.
+          if (!combiner_->enabled()) {
+            ++dropped_combined_count;
+            return;
+          }
+          auto* records =
+              reinterpret_cast<const TaskLog::DoneTaskRecord*>(data);
+          const int n = size / sizeof(TaskLog::DoneTaskRecord);
+          for (int i = 0; i < n; ++i) {
+            const int64 index = task_table_.FindOrPull(records[i].task_id);
+            if (index >= 0) {
+              task_table_.MarkDone(index, 0, records[i].time_usage);
+            }
+          }
+          return;
+        }
+        if (type == TaskLog::RECORD_COMBINED_RESULT) {
+          if (size < static_cast<int>(
+                         sizeof(TaskLog::CombinedResultRecord))) {
+            return;
+          }
+          // The tasks are computed again without a combiner.
+          if (!combiner_->enabled()) {
+            ++dropped_combined_count;
+            return;
+          }
+          auto* header =
+              reinterpret_cast<const TaskLog::CombinedResultRecord*>(data);
+          auto* task_id = reinterpret_cast<const int64*>(header + 1);
+          const int64 n = std::min<int64>(
+              header->count, (size - sizeof(*header)) / sizeof(int64));
+          if (n < 0) {
+            return;
+          }
+          // Like a combined result of a worker, the value is merged only if
+          // none of its tasks is done, so a record replayed twice is merged
+          // once. A record without tasks is the value of tasks logged by
+          // another record.
+          std::vector<int64> index(static_cast<size_t>(n));
+          for (int64 i = 0; i < n; ++i) {
+            index[i] = task_table_.FindOrPull(task_id[i]);
+            if (index[i] < 0 ||
+                task_table_.status(index[i]) == TaskTable::TASK_DONE) {
+              return;
+            }
+          }
+          for (int64 i = 0; i < n; ++i) {
+            task_table_.MarkDone(index[i], 0, header->time_usage / n);
+          }
+          combiner_->Merge(combined_value_, header->value);
+          return;
+        }
+        if (type == TaskLog::RECORD_STAGE_TASKS) {
+          if (size < static_cast<int>(sizeof(TaskLog::StageTasksRecord)) ||
+              stage_count_ == 1) {
+            return;
+          }
+          auto* header =
+              reinterpret_cast<const TaskLog::StageTasksRecord*>(data);
+          const int64 n = std::min<int64>(
+              header->count, (size - sizeof(*header)) / sizeof(int64));
+          if (n > 0 && header->stage > 0 && header->stage < stage_count_) {
+            AddStageTasks(static_cast<int>(header->stage),
+                          static_cast<int>(n),
+                          reinterpret_cast<const int64*>(header + 1));
+          }
+          return;
+        }
+        if (type == TaskLog::RECORD_INJECTED_TASKS) {
+          if (size < static_cast<int>(sizeof(TaskLog::InjectedTasksRecord)) ||
+              !task_injection_) {
+            return;
+          }
+          auto* header =
+              reinterpret_cast<const TaskLog::InjectedTasksRecord*>(data);
+          const int64 n = std::min<int64>(
+              header->count, (size - sizeof(*header)) / sizeof(int64));
+          if (n > 0) {
+            AddInjectedTasks(static_cast<int>(header->priority),
+                             static_cast<int>(n),
+                             reinterpret_cast<const int64*>(header + 1));
+          }
+          return;
+        }
+        if (type != TaskLog::RECORD_TASK_RESULT) {
+          return;
+        }
+        auto* records =
+            reinterpret_cast<const TaskLog::TaskResultRecord*>(data);
+        const int n = size / sizeof(TaskLog::TaskResultRecord);
+        for (int i = 0; i < n; ++i) {
+          const int64 index = task_table_.FindOrPull(records[i].task_id);
+          if (index >= 0 &&
+              HasPayloadRecord(records[i].task_id, records[i].result) &&
+              task_table_.MarkDone(index, records[i].result,
+                                   records[i].time_usage) &&
+              combiner_->enabled()) {
+            combiner_->Add(combined_value_, records[i].result);
+          }
+        }
+      });
+  LOG(INFO) << "Replayed " << record_count << " log records.";
+  if (dropped_combined_count > 0) {
+    LOG(WARNING) << "Dropped " << dropped_combined_count
+                 << " combined result records, the solver has no combiner.";
   }
+  const int64 loaded_done_count = task_table_.done_count();
   LOG(INFO) << "Loaded cached result count =  " << loaded_done_count;
 
-  for (auto& iter : master_state.worker_status()) {
-    auto& item = worker_map_[iter.worker_id()];
-    item.CopyFrom(iter);
-    item.clear_running_task();
+  if (combiner_->enabled()) {
+    if (!task_log_->Open(false)) {
+      LOG(ERROR) << "Failed to open task log, results are not persisted.";
+    }
+    // The migrated results are kept as a combined value.
+    int64 value[2];
+    combiner_->Init(value);
+    int64 total_time_usage = 0;
+    std::vector<int64> task_id;
+    for (auto& record : migrated) {
+      combiner_->Add(value, record.result);
+      total_time_usage += record.time_usage;
+      task_id.push_back(record.task_id);
+    }
+    if (!task_id.empty()) {
+      combiner_->Merge(combined_value_, value);
+      task_log_->AppendCombinedResult(value, total_time_usage,
+                                      task_id.size(), task_id.data());
+    }
+    return;
   }
 
-  GetSolver()->SetResult(task_id.size(), &task_id[0], &result[0],
-                         &time_usage[0], 0LL);
+  // Reports the loaded results in the task queue order. Only the touched
+  // chunks are visited, so a large range with few results loads at once.
+  std::vector<int64> task_id;
+  std::vector<int64> result;
+  std::vector<int64> time_usage;
+  task_id.reserve(loaded_done_count);
+  result.reserve(loaded_done_count);
+  time_usage.reserve(loaded_done_count);
+  task_table_.ForEachDone([&](int64 index) {
+    task_id.push_back(task_table_.TaskId(index));
+    result.push_back(task_table_.result(index));
+    time_usage.push_back(task_table_.time_usage(index));
+  });
+
+  ReportResults(task_id.size(), task_id.data(), result.data(),
+                time_usage.data(), 0LL);
 
-  task_pending_queue_ = std::move(new_task_pending_queue);
+  if (!task_log_->Open(false)) {
+    LOG(ERROR) << "Failed to open task log, results are not persisted.";
+  }
+  task_log_->AppendTaskResults(migrated);
 }
 
 void DPEMasterNode::SkipLoadState() {
   base::FilePath file_path(
-      base::UTF8ToNative(executable_dir_ + "\\state.txtproto"));
+      base::UTF8ToNative(state_path_ + ".txtproto"));
   bool has_state = base::PathExists(file_path);
   LOG(INFO) << "Skip loading state.";
   LOG(INFO) << "State file exists: " << std::boolalpha << has_state;
-}
 
-WorkerStatus& DPEMasterNode::GetWorker(const std::string& worker_id) {
-  auto where = worker_map_.find(worker_id);
-  if (where != worker_map_.end()) {
-    return where->second;
+  if (!combiner_->enabled() && !HasDynamicTasks() &&
+      task_table_.IsComplete()) {
+    AttachStateFile(false, NULL);
+  }
+  OpenResultStore(false);
+
+  if (!task_log_->Open(true)) {
+    LOG(ERROR) << "Failed to open task log, results are not persisted.";
   }
+}
 
-  WorkerStatus worker;
-  worker.set_worker_id(worker_id);
-  worker.set_latency_sum(0LL);
-  worker.set_request_count(0LL);
-  worker.set_updated_time(base::Time::Now().ToInternalValue());
+int64 DPEMasterNode::LeaseDeadline(const WorkerStatus& worker, int64 index,
+                                   int64 current_time) {
+  const int64 expected_time =
+      worker.task_time() > 0 ? worker.task_time() : task_time_;
+  auto where = expired_count_.find(index);
+  return ComputeLeaseDeadline(
+      current_time, expected_time,
+      where != expired_count_.end() ? where->second : 0);
+}
 
-  worker_map_[worker_id].CopyFrom(worker);
+void DPEMasterNode::RenewLease(const WorkerStatus& worker, int64 index,
+                               int64 current_time) {
+  const int64 deadline = LeaseDeadline(worker, index, current_time);
+  if (lease_table_.Renew(index, worker.worker_id(), deadline)) {
+    return;
+  }
+  auto copy = speculative_task_.find(index);
+  if (copy != speculative_task_.end() &&
+      copy->second.worker_id == worker.worker_id()) {
+    copy->second.deadline = std::max(copy->second.deadline, deadline);
+  }
+}
 
-  return worker_map_[worker_id];
+void DPEMasterNode::UpdateTaskTime(WorkerStatus* worker, int64 time) {
+  if (time <= 0) {
+    return;
+  }
+  worker->set_task_time(UpdateAverageTime(worker->task_time(), time));
+  task_time_ = UpdateAverageTime(task_time_, time);
+}
+
+int DPEMasterNode::AutoBatchSize(const WorkerStatus& worker,
+                                 int64 current_time) {
+  const int64 pending_count =
+      task_table_.pending_count() + static_cast<int64>(reserved_.size());
+  return ComputeAutoBatchSize(worker, pending_count,
+                              ActiveThreadCount(worker_map_, current_time));
+}
+
+void DPEMasterNode::AddTimeSample(int64 time_usage) {
+  if (time_usage <= 0) {
+    return;
+  }
+  if (time_samples_.size() < kTimeSampleCount) {
+    time_samples_.push_back(time_usage);
+  } else {
+    time_samples_[time_sample_pos_] = time_usage;
+    time_sample_pos_ = (time_sample_pos_ + 1) % kTimeSampleCount;
+  }
+}
+
+int DPEMasterNode::AddSpeculativeTasks(WorkerStatus* worker, int max_count,
+                                       int64 current_time,
+                                       GetTaskResponse* task) {
+  const double factor = GetFlags().speculation_factor;
+  if (factor <= 0 || time_samples_.size() < kMinTimeSampleCount) {
+    return 0;
+  }
+  std::vector<int64> samples(time_samples_);
+  std::nth_element(samples.begin(), samples.begin() + samples.size() / 2,
+                   samples.end());
+  const int64 median = samples[samples.size() / 2];
+
+  // (start time, index) of the tasks running longer than the threshold, a
+  // task waiting in a batch of its worker is expected to take the average
+  // task time of the worker.
+  std::vector<std::pair<int64, int64>> candidates;
+  for (auto& iter : lease_table_.leases()) {
+    const auto& lease = iter.second;
+    if (lease.worker_id == worker->worker_id() ||
+        speculative_task_.count(lease.index)) {
+      continue;
+    }
+    const int64 expected_time =
+        std::max(median, GetWorker(lease.worker_id).task_time());
+    if (current_time - lease.start_time > factor * expected_time) {
+      candidates.push_back(std::make_pair(lease.start_time, lease.index));
+    }
+  }
+  if (candidates.empty()) {
+    return 0;
+  }
+
+  const size_t count =
+      std::min(candidates.size(), static_cast<size_t>(max_count));
+  std::partial_sort(candidates.begin(), candidates.begin() + count,
+                    candidates.end());
+  for (size_t i = 0; i < count; ++i) {
+    const int64 index = candidates[i].second;
+    const int64 task_id = task_table_.TaskId(index);
+    SpeculativeCopy& copy = speculative_task_[index];
+    copy.worker_id = worker->worker_id();
+    copy.deadline = LeaseDeadline(*worker, index, current_time);
+    worker->add_running_task(task_id);
+    task->add_task_id(task_id);
+    AttachCheckpoint(task_id, task);
+  }
+  LOG(INFO) << "Duplicate " << count << " slow tasks to " << worker->worker_id()
+            << ", median time usage = " << median;
+  return static_cast<int>(count);
+}
+
+// Fits log(time) = a + b * log(1 + task_id - base) by least squares.
+static bool FitCostModel(const std::vector<std::pair<int64, int64>>& samples,
+                         int64 base, double* a, double* b) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  double n = 0;
+  for (auto& sample : samples) {
+    if (sample.first < base || sample.second <= 0) {
+      continue;
+    }
+    const double x = std::log(1.0 + static_cast<double>(sample.first - base));
+    const double y = std::log(static_cast<double>(sample.second));
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+    n += 1;
+  }
+  const double d = n * sxx - sx * sx;
+  if (n < kMinCostSamples || d <= 1e-9) {
+    return false;
+  }
+  *b = (n * sxy - sx * sy) / d;
+  *a = (sy - *b * sx) / n;
+  return true;
+}
+
+bool DPEMasterNode::OrderTasksByCost() {
+  const int64 size = task_table_.size();
+  if (task_table_.pending_count() == 0) {
+    return true;
+  }
+
+  // The samples of the cost model: (task id, time usage).
+  std::vector<std::pair<int64, int64>> samples;
+  samples.swap(cost_samples_);
+  for (auto& item : previous_cost_) {
+    samples.push_back(
+        std::make_pair(task_table_.TaskId(item.first), item.second));
+  }
+  const int64 stride = task_table_.done_count() / kMaxCostSamples + 1;
+  int64 seen = 0;
+  for (int64 i = 0; i < size; ++i) {
+    if (task_table_.status(i) == TaskTable::TASK_DONE &&
+        task_table_.time_usage(i) > 0 && ++seen % stride == 0) {
+      samples.push_back(
+          std::make_pair(task_table_.TaskId(i), task_table_.time_usage(i)));
+    }
+  }
+  int64 base = std::numeric_limits<int64>::max();
+  for (auto& sample : samples) {
+    base = std::min(base, sample.first);
+  }
+  double a = 0;
+  double b = 0;
+  const bool has_model = FitCostModel(samples, base, &a, &b);
+  if (has_model) {
+    LOG(INFO) << "Cost model: log(time) = " << a << " + " << b
+              << " * log(1 + task_id - " << base << ")";
+  }
+
+  std::vector<int64> pending;
+  std::vector<double> cost;
+  bool has_estimate = false;
+  if (task_table_.pending_count() <= kMaxOrderedTaskCount) {
+    for (int64 i = 0; i < size; ++i) {
+      if (task_table_.status(i) == TaskTable::TASK_PENDING) {
+        pending.push_back(i);
+      }
+    }
+    cost.resize(pending.size(), 0);
+
+    // The estimation of the solver.
+    std::vector<int64> task_id;
+    for (size_t i = 0; i < pending.size(); i += kEstimateBatchSize) {
+      const size_t n = std::min(pending.size() - i, kEstimateBatchSize);
+      task_id.resize(n);
+      for (size_t j = 0; j < n; ++j) {
+        task_id[j] = task_table_.TaskId(pending[i + j]);
+      }
+      has_estimate = solver_->EstimateTaskCost(
+          static_cast<int>(n), &task_id[0], &cost[i]);
+      if (!has_estimate) {
+        break;
+      }
+    }
+  }
+
+  if (!has_estimate && (previous_cost_.empty() || pending.empty())) {
+    if (!has_model) {
+      return false;
+    }
+    if (pending.empty()) {
+      // Too many tasks, the model is monotonic in the task id.
+      if (b > 0 && task_table_.TaskId(0) < task_table_.TaskId(size - 1)) {
+        task_table_.SetReverseDispatch(true);
+        LOG(INFO) << "Tasks are dispatched in descending index order.";
+      }
+      return true;
+    }
+  }
+
+  if (!has_estimate) {
+    std::map<int64, int64> previous(previous_cost_.begin(),
+                                    previous_cost_.end());
+    for (size_t i = 0; i < pending.size(); ++i) {
+      auto where = previous.find(pending[i]);
+      if (where != previous.end()) {
+        cost[i] = static_cast<double>(where->second);
+      } else if (has_model) {
+        const int64 id = task_table_.TaskId(pending[i]);
+        const double x =
+            id < base ? 0 : std::log(1.0 + static_cast<double>(id - base));
+        cost[i] = std::exp(a + b * x);
+      }
+    }
+  }
+
+  std::vector<size_t> order(pending.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&cost](size_t x, size_t y) {
+    return cost[x] > cost[y];
+  });
+  std::vector<int64> dispatch_order(order.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    dispatch_order[i] = pending[order[i]];
+  }
+  task_table_.SetDispatchOrder(std::move(dispatch_order));
+  std::vector<std::pair<int64, int64>>().swap(previous_cost_);
+  LOG(INFO) << "Tasks are dispatched in "
+            << (has_estimate ? "estimated" : "predicted") << " cost order.";
+  return true;
+}
+
+void DPEMasterNode::OnTimer() {
+  CheckLeases();
+  CheckStandby(base::Time::Now().ToInternalValue());
+  // Solver::Combine may complete the job on a reducer thread.
+  if (IsCancelled() && !finishing_) {
+    SaveState(true);
+    FinishAllTasks();
+  }
+  // The workers subscribed late get the state.
+  BroadcastState(true);
+}
+
+void DPEMasterNode::CheckLeases() {
+  const int64 current_time = base::Time::Now().ToInternalValue();
+  std::vector<TaskLeaseTable::Lease> expired;
+  lease_table_.Expire(current_time, &expired);
+
+  std::map<std::string, std::set<int64>> expired_task_id;
+  int64 requeued = 0;
+  for (auto& lease : expired) {
+    if (task_table_.status(lease.index) != TaskTable::TASK_RUNNING) {
+      continue;
+    }
+    task_table_.Requeue(lease.index);
+    ++expired_count_[lease.index];
+    // A task reserved by the lost primary has no worker.
+    if (!lease.worker_id.empty()) {
+      expired_task_id[lease.worker_id].insert(
+          task_table_.TaskId(lease.index));
+    }
+    ++requeued;
+  }
+  // The task of an expired copy may be duplicated again.
+  int64 dropped = 0;
+  for (auto iter = speculative_task_.begin();
+       iter != speculative_task_.end();) {
+    if (iter->second.deadline > current_time) {
+      ++iter;
+      continue;
+    }
+    expired_task_id[iter->second.worker_id].insert(
+        task_table_.TaskId(iter->first));
+    iter = speculative_task_.erase(iter);
+    ++dropped;
+  }
+  for (auto& iter : expired_task_id) {
+    // The uploads of the expired tasks are abandoned.
+    if (result_store_) {
+      for (auto task_id : iter.second) {
+        DropPayload(iter.first, task_id);
+      }
+    }
+    RemoveRunningTask(&GetWorker(iter.first), iter.second);
+  }
+  if (requeued > 0) {
+    LOG(WARNING) << requeued << " task leases expired, the tasks are requeued.";
+  }
+  if (dropped > 0) {
+    LOG(WARNING) << dropped << " speculative copies expired.";
+  }
+}
+
+void DPEMasterNode::ReturnTask(const std::string& worker_id, int64 index) {
+  if (result_store_) {
+    DropPayload(worker_id, task_table_.TaskId(index));
+  }
+  auto copy = speculative_task_.find(index);
+  if (copy != speculative_task_.end() && copy->second.worker_id == worker_id) {
+    speculative_task_.erase(copy);
+    return;
+  }
+  const TaskLeaseTable::Lease* lease = lease_table_.Find(index);
+  if (lease && lease->worker_id == worker_id) {
+    lease_table_.Release(index, NULL);
+    task_table_.Requeue(index);
+  }
+}
+
+void DPEMasterNode::ReportResults(int size, int64* task_id, int64* result,
+                                  int64* time_usage, int64 total_time_usage) {
+  // The coordinator reports the results of the shards, and the payloads
+  // are reported before Finish.
+  if (IsShard() || result_store_) {
+    return;
+  }
+  if (reduction_pipeline_) {
+    reduction_pipeline_->Push(size, task_id, result, time_usage);
+  } else {
+    solver_->SetResult(size, task_id, result, time_usage,
+                       total_time_usage);
+  }
+  BroadcastState(false);
+}
+
+void DPEMasterNode::BroadcastState(bool resend) {
+  const bool cancelled = IsCancelled();
+  if (!broadcast_ || (!bound_ && !cancelled)) {
+    return;
+  }
+  const int64 value = bound_ ? bound_->value() : 0;
+  if (value != published_bound_) {
+    LOG(INFO) << "Global bound improved: " << value;
+  } else if (cancelled == published_cancelled_ && !resend) {
+    return;
+  }
+  published_bound_ = value;
+  published_cancelled_ = cancelled;
+  Broadcast message;
+  message.set_job(job_);
+  if (bound_) {
+    message.set_bound(value);
+  }
+  if (cancelled) {
+    message.set_cancelled(true);
+  }
+  broadcast_->Send(message);
+}
+
+void DPEMasterNode::StartBroadcast() {
+  if (!bound_ && !cancel_) {
+    return;
+  }
+  if (!broadcast_) {
+    broadcast_ = new BroadcastChannel();
+  }
+  if (!broadcast_->Publish(my_ip_)) {
+    LOG(WARNING) << "The global bound is not broadcast.";
+  }
+}
+
+bool DPEMasterNode::FindCachedResult(
+    int64 index, std::vector<TaskLog::TaskResultRecord>* cached) {
+  if (!result_cache_) {
+    return false;
+  }
+  TaskLog::TaskResultRecord record;
+  record.task_id = task_table_.TaskId(index);
+  if (!result_cache_->Find(record.task_id, &record.result,
+                           &record.time_usage)) {
+    return false;
+  }
+  if (task_table_.MarkDone(index, record.result, record.time_usage)) {
+    expired_count_.erase(index);
+    if (checkpoint_store_) {
+      checkpoint_store_->Erase(record.task_id);
+    }
+    cached->push_back(record);
+  }
+  return true;
+}
+
+void DPEMasterNode::ApplyCachedResults(
+    const std::vector<TaskLog::TaskResultRecord>& cached) {
+  std::vector<int64> task_id;
+  std::vector<int64> result;
+  std::vector<int64> time_usage;
+  for (auto& record : cached) {
+    task_id.push_back(record.task_id);
+    result.push_back(record.result);
+    time_usage.push_back(record.time_usage);
+  }
+  task_log_->AppendTaskResults(cached);
+  ReportResults(task_id.size(), task_id.data(), result.data(),
+                time_usage.data(), 0);
+  LOG(INFO) << cached.size() << " tasks are found in the result cache.";
+  if (IsAllDone()) {
+    SaveState(true);
+    FinishAllTasks();
+  } else {
+    SaveState(false);
+  }
+}
+
+bool DPEMasterNode::IsAllDone() {
+  if (IsCancelled()) {
+    return true;
+  }
+  PullStageTasks();
+  return stage_begin_.size() > static_cast<size_t>(stage_count_) &&
+         task_table_.IsAllDone();
+}
+
+void DPEMasterNode::PullStageTasks() {
+  std::vector<int64> task_id;
+  while (stage_begin_.size() <= static_cast<size_t>(stage_count_)) {
+    const int stage = static_cast<int>(stage_begin_.size()) - 1;
+    // The inputs of the open stage are the tasks of the previous stages.
+    const int64 begin = stage_begin_.back();
+    while (stage_done_cursor_ < begin &&
+           task_table_.status(stage_done_cursor_) == TaskTable::TASK_DONE) {
+      ++stage_done_cursor_;
+    }
+    const bool inputs_done = stage_done_cursor_ >= begin;
+
+    task_id.resize(kStageBatchSize);
+    int64 added = 0;
+    for (;;) {
+      const int n = std::min(
+          solver_->NextStageTasks(stage, task_id.data(), kStageBatchSize),
+          kStageBatchSize);
+      if (n <= 0) {
+        break;
+      }
+      task_log_->AppendStageTasks(stage, n, task_id.data());
+      added += task_table_.AddTasks(n, task_id.data());
+    }
+    if (added > 0) {
+      LOG(INFO) << "Added " << added << " tasks of stage " << stage << ".";
+    }
+    if (!inputs_done) {
+      return;
+    }
+    // No more task of the stage comes, the next stage is generated from it.
+    LOG(INFO) << "Stage " << stage << " has "
+              << task_table_.size() - begin << " tasks.";
+    stage_begin_.push_back(task_table_.size());
+  }
+}
+
+void DPEMasterNode::AddStageTasks(int stage, int size, const int64* task_id) {
+  while (stage_begin_.size() <= static_cast<size_t>(stage)) {
+    stage_begin_.push_back(task_table_.size());
+  }
+  task_table_.AddTasks(size, task_id);
+}
+
+void DPEMasterNode::AddTasks(int size, const int64* task_id, int priority) {
+  if (finishing_) {
+    LOG(WARNING) << "The tasks added after all the tasks are done are "
+                 << "dropped.";
+    return;
+  }
+  // The tasks added again by the results loaded on restart are skipped.
+  std::vector<int64> added;
+  for (int i = 0; i < size; ++i) {
+    if (task_table_.IndexOf(task_id[i]) < 0) {
+      added.push_back(task_id[i]);
+    }
+  }
+  if (added.empty()) {
+    return;
+  }
+  task_log_->AppendInjectedTasks(priority, added.size(), added.data());
+  AddInjectedTasks(priority, added.size(), added.data());
+  LOG(INFO) << "Added " << added.size() << " tasks, priority = " << priority;
+}
+
+void DPEMasterNode::AddInjectedTasks(int priority, int size,
+                                     const int64* task_id) {
+  int64 index = task_table_.size();
+  task_table_.AddTasks(size, task_id);
+  if (priority <= 0) {
+    return;
+  }
+  for (; index < task_table_.size(); ++index) {
+    task_table_.SetPriority(index, priority);
+  }
+}
+
+void DPEMasterNode::FinishAllTasks() {
+  // A late result of a done task may arrive before the master exits.
+  if (finishing_) {
+    return;
+  }
+  finishing_ = true;
+  if (IsCancelled()) {
+    LOG(INFO) << "The solver completed the job, "
+              << task_table_.size() - task_table_.done_count()
+              << " tasks are cancelled.";
+    BroadcastState(false);
+  }
+  if (IsShard()) {
+    LOG(INFO) << "All the tasks of the shard are done, waiting for the "
+              << "coordinator.";
+    return;
+  }
+  if (reduction_pipeline_) {
+    // The requests are still handled during the final reduction.
+    reduction_pipeline_->Finish(base::Bind(&DPEMasterNode::DidReduceResults,
+                                           weakptr_factory_.GetWeakPtr()));
+  } else {
+    DidReduceResults();
+  }
+}
+
+bool DPEMasterNode::IsShard() const {
+  return GetFlags().shard_servers.size() > 1;
+}
+
+void DPEMasterNode::GetShardResult(const GetShardResultRequest& req,
+                                   GetShardResultResponse* shard) {
+  const bool all_done = task_table_.IsAllDone();
+  const int64 task_count = task_table_.size();
+  shard->set_all_done(all_done);
+  shard->set_task_count(task_count);
+  shard->set_done_count(task_table_.done_count());
+  if (!all_done) {
+    return;
+  }
+
+  if (combiner_->enabled()) {
+    shard->set_combiner(combiner_->type());
+    shard->set_combined_low(combined_value_[0]);
+    shard->set_combined_high(combined_value_[1]);
+    shard->set_next_index(task_count);
+  } else {
+    const int64 begin = std::max<int64>(req.start_index(), 0);
+    const int64 end = std::min<int64>(
+        task_count, begin + std::max(req.max_count(), 1));
+    for (int64 i = begin; i < end; ++i) {
+      TaskItem* item = shard->add_task_item();
+      item->set_task_id(task_table_.TaskId(i));
+      item->set_status(TaskItem::DONE);
+      item->set_result(task_table_.result(i));
+      item->set_time_usage(task_table_.time_usage(i));
+    }
+    shard->set_next_index(std::max(begin, end));
+  }
+
+  if (req.release()) {
+    LOG(INFO) << "The coordinator has the results of the shard.";
+    Exit();
+  }
+}
+
+void DPEMasterNode::HandleReplicate(const ReplicateRequest& req,
+                                    ReplicateResponse* rep) {
+  const int64 current_time = base::Time::Now().ToInternalValue();
+  rep->set_term(term_);
+  if (req.snapshot_index() >= 0) {
+    // A new standby has nothing to wait for after the job is finished.
+    if (exit_pending_) {
+      rep->set_finished(true);
+      return;
+    }
+    if (req.snapshot_index() == 0) {
+      // The records after the start of the snapshot are replayed after it.
+      StopReplication();
+      replication_log_.Start();
+      LOG(INFO) << "A standby copies the task table.";
+    } else if (req.epoch() != replication_log_.epoch()) {
+      rep->set_need_snapshot(true);
+      return;
+    }
+    last_standby_time_ = current_time;
+    rep->set_epoch(replication_log_.epoch());
+    rep->set_snapshot_seq(replication_log_.acked_seq());
+    rep->set_fingerprint(task_table_.fingerprint());
+
+    const int64 task_count = task_table_.size();
+    const int64 begin = std::min(req.snapshot_index(), task_count);
+    const int64 end = std::min(task_count, begin + kSnapshotPageSize);
+    for (int64 i = begin; i < end; ++i) {
+      if (task_table_.status(i) != TaskTable::TASK_DONE) {
+        continue;
+      }
+      TaskItem* item = rep->add_task_item();
+      item->set_task_id(task_table_.TaskId(i));
+      item->set_status(TaskItem::DONE);
+      item->set_result(task_table_.result(i));
+      item->set_time_usage(task_table_.time_usage(i));
+    }
+    rep->set_next_index(end);
+    if (end >= task_count) {
+      rep->set_snapshot_done(true);
+      rep->set_snapshot_end_seq(replication_log_.next_seq());
+      rep->set_combined_low(combined_value_[0]);
+      rep->set_combined_high(combined_value_[1]);
+    }
+    return;
+  }
+
+  if (req.epoch() != replication_log_.epoch() ||
+      !replication_log_.Ack(req.next_seq())) {
+    rep->set_need_snapshot(true);
+    return;
+  }
+  last_standby_time_ = current_time;
+  rep->set_epoch(replication_log_.epoch());
+  if (!standby_in_sync_) {
+    // The running tasks are held by the standby if it takes over, the
+    // next tasks are reserved before they are handed out.
+    standby_in_sync_ = true;
+    std::vector<int64> task_id;
+    for (auto& iter : lease_table_.leases()) {
+      task_id.push_back(task_table_.TaskId(iter.first));
+    }
+    if (!task_id.empty()) {
+      replication_log_.Append(
+          ReplicationLog::RECORD_RESERVE,
+          reinterpret_cast<const char*>(task_id.data()),
+          static_cast<int>(task_id.size() * sizeof(int64)));
+    }
+    LOG(INFO) << "The standby is in sync.";
+  }
+  if (exit_pending_ && req.next_seq() == replication_log_.next_seq()) {
+    LOG(INFO) << "The standby has all the records.";
+    rep->set_finished(true);
+    Exit();
+    return;
+  }
+  if (!finishing_) {
+    ReplenishReserve();
+  }
+  replication_log_.Read(req.next_seq(), kMaxReplicationBytes, rep);
+}
+
+void DPEMasterNode::StopReplication() {
+  for (auto& item : reserved_) {
+    if (!lease_table_.Find(item.second)) {
+      task_table_.Requeue(item.second);
+    }
+  }
+  reserved_.clear();
+  dispatched_count_ = 0;
+  standby_in_sync_ = false;
+  replication_log_.Stop();
+}
+
+void DPEMasterNode::CheckStandby(int64 current_time) {
+  if (!replication_log_.active() ||
+      current_time - last_standby_time_ <= kStandbyTimeout) {
+    return;
+  }
+  LOG(WARNING) << "The standby is lost.";
+  StopReplication();
+  if (exit_pending_) {
+    Exit();
+  }
+}
+
+void DPEMasterNode::ReplenishReserve() {
+  const int64 target = std::max(kMinReservedTasks, 2 * dispatched_count_);
+  dispatched_count_ = 0;
+  std::vector<int64> task_id;
+  int64 index = 0;
+  while (static_cast<int64>(reserved_.size()) < target &&
+         task_table_.PopPending(&index)) {
+    reserved_.push_back(std::make_pair(replication_log_.next_seq(), index));
+    task_id.push_back(task_table_.TaskId(index));
+  }
+  if (!task_id.empty()) {
+    replication_log_.Append(
+        ReplicationLog::RECORD_RESERVE,
+        reinterpret_cast<const char*>(task_id.data()),
+        static_cast<int>(task_id.size() * sizeof(int64)));
+  }
+}
+
+bool DPEMasterNode::PopDispatchable(int64* index) {
+  if (!standby_in_sync_) {
+    return task_table_.PopPending(index);
+  }
+  while (!reserved_.empty() &&
+         reserved_.front().first < replication_log_.acked_seq()) {
+    const int64 reserved_index = reserved_.front().second;
+    reserved_.pop_front();
+    // A reserved task may be done by a late result.
+    if (task_table_.status(reserved_index) == TaskTable::TASK_RUNNING &&
+        !lease_table_.Find(reserved_index)) {
+      ++dispatched_count_;
+      *index = reserved_index;
+      return true;
+    }
+  }
+  return false;
+}
+
+void DPEMasterNode::RequestReplication() {
+  if (replicating_) {
+    return;
+  }
+  if (!standby_) {
+    FencePrimary();
+    return;
+  }
+  if (base::Time::Now().ToInternalValue() - last_primary_time_ >
+      kPromoteTimeout) {
+    Promote();
+    return;
+  }
+
+  ReplicateRequest* replicate = new ReplicateRequest();
+  replicate->set_epoch(primary_epoch_);
+  replicate->set_next_seq(replication_seq_);
+  replicate->set_snapshot_index(snapshot_index_);
+
+  Request request;
+  request.set_name("replicate");
+  request.set_allocated_replicate(replicate);
+  replicating_ = true;
+  SendRequest(request,
+              base::Bind(&DPEMasterNode::HandleReplication, this), 5000);
+}
+
+void DPEMasterNode::HandleReplication(
+    scoped_refptr<base::ZMQResponse> response) {
+  replicating_ = false;
+  if (!standby_) {
+    return;
+  }
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    LOG(WARNING) << "Handle replication, error: " << response->error_code_;
+    return;
+  }
+
+  Response body;
+  body.ParseFromString(response->data_);
+  if (body.error_code() == kErrorNotSupported) {
+    LOG(ERROR) << "The primary does not support a standby for this job.";
+    replication_timer_->Stop();
+    Exit();
+    return;
+  }
+  if (body.error_code() != 0) {
+    LOG(ERROR) << "The primary refuses the standby.";
+    Exit();
+    return;
+  }
+  last_primary_time_ = base::Time::Now().ToInternalValue();
+  const ReplicateResponse& rep = body.replicate();
+  primary_term_ = std::max(primary_term_, rep.term());
+  if (rep.finished()) {
+    LOG(INFO) << "The primary finished the job.";
+    standby_ = false;
+    replication_timer_->Stop();
+    Exit();
+    return;
+  }
+  if (rep.need_snapshot() ||
+      (snapshot_index_ < 0 && rep.epoch() != primary_epoch_)) {
+    BeginSnapshot();
+    RequestReplication();
+    return;
+  }
+
+  if (snapshot_index_ >= 0) {
+    if (snapshot_index_ == 0 &&
+        rep.fingerprint() != task_table_.fingerprint()) {
+      LOG(ERROR) << "The task set of the primary is different.";
+      Exit();
+      return;
+    }
+    ApplySnapshotPage(rep);
+    // The next page is fetched at once.
+    if (snapshot_index_ >= 0) {
+      RequestReplication();
+    }
+    return;
+  }
+
+  for (auto& record : rep.record()) {
+    ApplyReplicatedRecord(record);
+  }
+  if (!combiner_->enabled()) {
+    SaveState(false);
+  }
+}
+
+void DPEMasterNode::BeginSnapshot() {
+  LOG(INFO) << "Copy the task table of the primary.";
+  snapshot_index_ = 0;
+  primary_epoch_ = 0;
+  replication_seq_ = 0;
+  snapshot_end_seq_ = -1;
+  snapshot_value_logged_ = false;
+  primary_reserved_.clear();
+  if (!combiner_->enabled()) {
+    // The results are the same in any epoch.
+    return;
+  }
+  // The combined value is replaced by the one of the primary, so are the
+  // done tasks and the log.
+  const int64 task_count = task_table_.size();
+  for (int64 i = 0; i < task_count; ++i) {
+    task_table_.ResetDone(i);
+  }
+  combiner_->Init(combined_value_);
+  task_log_->Close();
+  if (!task_log_->Open(true)) {
+    LOG(ERROR) << "Failed to open task log, results are not persisted.";
+  }
+}
+
+void DPEMasterNode::ApplySnapshotPage(const ReplicateResponse& rep) {
+  if (snapshot_index_ == 0) {
+    primary_epoch_ = rep.epoch();
+    replication_seq_ = rep.snapshot_seq();
+  }
+
+  std::vector<int64> task_id;
+  std::vector<int64> result;
+  std::vector<int64> time_usage;
+  for (auto& item : rep.task_item()) {
+    const int64 index = task_table_.IndexOf(item.task_id());
+    if (index < 0 ||
+        !task_table_.MarkDone(index, item.result(), item.time_usage())) {
+      continue;
+    }
+    if (checkpoint_store_) {
+      checkpoint_store_->Erase(item.task_id());
+    }
+    task_id.push_back(item.task_id());
+    result.push_back(item.result());
+    time_usage.push_back(item.time_usage());
+  }
+  // The combined value is taken from the last page.
+  if (!task_id.empty() && !combiner_->enabled()) {
+    task_log_->AppendTaskResults(task_id.size(), task_id.data(),
+                                 result.data(), time_usage.data());
+    ReportResults(task_id.size(), task_id.data(), result.data(),
+                  time_usage.data(), 0LL);
+  }
+
+  snapshot_index_ = std::max(rep.next_index(), snapshot_index_ + 1);
+  if (rep.snapshot_done()) {
+    snapshot_index_ = -1;
+    snapshot_end_seq_ = rep.snapshot_end_seq();
+    if (combiner_->enabled()) {
+      combined_value_[0] = rep.combined_low();
+      combined_value_[1] = rep.combined_high();
+    }
+    LOG(INFO) << "Copied the task table of the primary, done count = "
+              << task_table_.done_count();
+    MaybeLogSnapshotValue();
+  }
+}
+
+void DPEMasterNode::ApplyReplicatedRecord(const ReplicationRecord& record) {
+  if (record.seq() < replication_seq_) {
+    return;
+  }
+  const std::string& data = record.data();
+  const int size = static_cast<int>(data.size());
+  if (record.type() == TaskLog::RECORD_TASK_RESULT) {
+    auto* records =
+        reinterpret_cast<const TaskLog::TaskResultRecord*>(data.data());
+    const int n = size / sizeof(TaskLog::TaskResultRecord);
+    std::vector<int64> task_id;
+    std::vector<int64> result;
+    std::vector<int64> time_usage;
+    for (int i = 0; i < n; ++i) {
+      const int64 index = task_table_.IndexOf(records[i].task_id);
+      if (index < 0 || !task_table_.MarkDone(index, records[i].result,
+                                             records[i].time_usage)) {
+        continue;
+      }
+      primary_reserved_.erase(records[i].task_id);
+      if (checkpoint_store_) {
+        checkpoint_store_->Erase(records[i].task_id);
+      }
+      task_id.push_back(records[i].task_id);
+      result.push_back(records[i].result);
+      time_usage.push_back(records[i].time_usage);
+    }
+    if (!task_id.empty()) {
+      task_log_->AppendTaskResults(task_id.size(), task_id.data(),
+                                   result.data(), time_usage.data());
+      ReportResults(task_id.size(), task_id.data(), result.data(),
+                    time_usage.data(), 0LL);
+    }
+  } else if (record.type() == TaskLog::RECORD_COMBINED_RESULT &&
+             size >= static_cast<int>(
+                         sizeof(TaskLog::CombinedResultRecord))) {
+    auto* header =
+        reinterpret_cast<const TaskLog::CombinedResultRecord*>(data.data());
+    auto* task_id = reinterpret_cast<const int64*>(header + 1);
+    const int64 n = std::min<int64>(
+        header->count, (size - sizeof(*header)) / sizeof(int64));
+    // The tasks copied by the snapshot pages are done already.
+    std::vector<int64> done_task_id;
+    for (int64 i = 0; i < n; ++i) {
+      const int64 index = task_table_.IndexOf(task_id[i]);
+      if (index >= 0 &&
+          task_table_.MarkDone(index, 0, header->time_usage / n)) {
+        done_task_id.push_back(task_id[i]);
+      }
+      primary_reserved_.erase(task_id[i]);
+      if (checkpoint_store_) {
+        checkpoint_store_->Erase(task_id[i]);
+      }
+    }
+    // The value of the snapshot includes the records before its end. The
+    // record is logged with the newly done tasks only, the others are in
+    // the record of the snapshot value, so the replay merges it once.
+    if (combiner_->enabled() && record.seq() >= snapshot_end_seq_) {
+      combiner_->Merge(combined_value_, header->value);
+      task_log_->AppendCombinedResult(
+          header->value,
+          n > 0 ? header->time_usage * done_task_id.size() / n : 0,
+          static_cast<int>(done_task_id.size()), done_task_id.data());
+    }
+  } else if (record.type() == ReplicationLog::RECORD_RESERVE) {
+    auto* task_id = reinterpret_cast<const int64*>(data.data());
+    const int n = size / sizeof(int64);
+    for (int i = 0; i < n; ++i) {
+      const int64 index = task_table_.IndexOf(task_id[i]);
+      if (index >= 0 && task_table_.status(index) != TaskTable::TASK_DONE) {
+        primary_reserved_.insert(task_id[i]);
+      }
+    }
+  } else if (record.type() == ReplicationLog::RECORD_CHECKPOINT &&
+             size >= static_cast<int>(sizeof(int64))) {
+    int64 task_id = 0;
+    memcpy(&task_id, data.data(), sizeof(task_id));
+    const int64 index = task_table_.IndexOf(task_id);
+    if (checkpoint_store_ && index >= 0 &&
+        task_table_.status(index) != TaskTable::TASK_DONE) {
+      checkpoint_store_->Put(task_id, data.substr(sizeof(task_id)));
+    }
+  }
+  replication_seq_ = record.seq() + 1;
+  MaybeLogSnapshotValue();
+}
+
+void DPEMasterNode::MaybeLogSnapshotValue() {
+  if (!combiner_->enabled() || snapshot_value_logged_ ||
+      snapshot_end_seq_ < 0 || replication_seq_ < snapshot_end_seq_) {
+    return;
+  }
+  // The done tasks are the ones in the combined value.
+  std::vector<int64> task_id;
+  int64 total_time_usage = 0;
+  const int64 task_count = task_table_.size();
+  for (int64 i = 0; i < task_count; ++i) {
+    if (task_table_.status(i) == TaskTable::TASK_DONE) {
+      task_id.push_back(task_table_.TaskId(i));
+      total_time_usage += task_table_.time_usage(i);
+    }
+  }
+  if (!task_id.empty()) {
+    task_log_->AppendCombinedResult(combined_value_, total_time_usage,
+                                    task_id.size(), task_id.data());
+  }
+  snapshot_value_logged_ = true;
+}
+
+void DPEMasterNode::Promote() {
+  standby_ = false;
+  if (snapshot_index_ >= 0 || primary_epoch_ == 0 ||
+      (combiner_->enabled() && !snapshot_value_logged_)) {
+    LOG(ERROR) << "The primary is lost before the standby is in sync.";
+    replication_timer_->Stop();
+    Exit();
+    return;
+  }
+  // The replies of the new term fence the primary: the workers ignore the
+  // replies of the lower term, and the primary stops when a request with
+  // the new term reaches it. The replication timer keeps sending the term
+  // to the primary until it replies.
+  term_ = std::max(term_, primary_term_) + 1;
+  LOG(WARNING) << "The primary is lost, the standby takes over with term "
+               << term_ << ".";
+
+  // The workers running the reserved tasks claim them, the others are
+  // handed out after the grace period.
+  const int64 current_time = base::Time::Now().ToInternalValue();
+  int64 held_count = 0;
+  for (auto task_id : primary_reserved_) {
+    const int64 index = task_table_.IndexOf(task_id);
+    if (index >= 0 && task_table_.MarkRunning(index)) {
+      lease_table_.Grant(index, std::string(), current_time,
+                         current_time + kFailoverGracePeriod);
+      ++held_count;
+    }
+  }
+  std::set<int64>().swap(primary_reserved_);
+  LOG(INFO) << held_count << " tasks reserved by the primary wait for their "
+            << "workers.";
+  StartBroadcast();
+
+  if (IsAllDone()) {
+    SaveState(true);
+    FinishAllTasks();
+  } else {
+    SaveState(true);
+  }
+}
+
+void DPEMasterNode::FencePrimary() {
+  Request request;
+  request.set_name("fence");
+  request.set_term(term_);
+  replicating_ = true;
+  SendRequest(request, base::Bind(&DPEMasterNode::HandleFence, this), 5000);
+}
+
+void DPEMasterNode::HandleFence(scoped_refptr<base::ZMQResponse> response) {
+  replicating_ = false;
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    return;
+  }
+  LOG(INFO) << "The old primary is fenced.";
+  replication_timer_->Stop();
+}
+
+void DPEMasterNode::HandleClaimTask(WorkerStatus* worker,
+                                    const ClaimTaskRequest& data,
+                                    int64 current_time) {
+  int64 claimed_count = 0;
+  for (auto task_id : data.task_id()) {
+    const int64 index = task_table_.IndexOf(task_id);
+    if (index < 0 || task_table_.status(index) == TaskTable::TASK_DONE) {
+      continue;
+    }
+    // The worker keeps a task held after the failover, its own task or a
+    // pending task.
+    const TaskLeaseTable::Lease* lease = lease_table_.Find(index);
+    if (lease ? !lease->worker_id.empty() &&
+                    lease->worker_id != worker->worker_id()
+              : !task_table_.MarkRunning(index)) {
+      continue;
+    }
+    const bool is_new = !lease || lease->worker_id.empty();
+    lease_table_.Grant(index, worker->worker_id(), current_time,
+                       LeaseDeadline(*worker, index, current_time));
+    if (is_new) {
+      worker->add_running_task(task_id);
+    }
+    ++claimed_count;
+  }
+  LOG(INFO) << worker->worker_id() << " claimed " << claimed_count
+            << " tasks.";
+}
+
+int DPEMasterNode::SendRequest(Request& req, base::ZMQCallBack callback,
+                               int timeout) {
+  req.set_worker_id(my_ip_ + ":standby");
+  req.set_request_timestamp(base::Time::Now().ToInternalValue());
+
+  std::string val;
+  req.SerializeToString(&val);
+  zmq_client_->SendRequest(primary_address_, val.c_str(),
+                           static_cast<int>(val.size()),
+                           base::Bind(&DPEMasterNode::HandleResponse,
+                                      weakptr_factory_.GetWeakPtr(), callback),
+                           timeout);
+  return 0;
+}
+
+void DPEMasterNode::HandleResponse(base::WeakPtr<DPEMasterNode> self,
+                                   base::ZMQCallBack callback,
+                                   scoped_refptr<base::ZMQResponse> rep) {
+  if (self.get()) {
+    callback.Run(rep);
+  }
+}
+
+void DPEMasterNode::HandlePutPayload(const std::string& worker_id,
+                                     const PutPayloadRequest& data) {
+  if (!result_store_) {
+    return;
+  }
+  for (auto& chunk : data.chunk()) {
+    const auto key = std::make_pair(worker_id, chunk.task_id());
+    if (chunk.offset() == 0) {
+      // The first chunk reserves the record, the payload of a done task is
+      // dropped.
+      DropPayload(worker_id, chunk.task_id());
+      const int64 index = task_table_.IndexOf(chunk.task_id());
+      if (index < 0 || task_table_.status(index) == TaskTable::TASK_DONE) {
+        continue;
+      }
+      PendingPayload payload;
+      payload.offset =
+          result_store_->Allocate(chunk.task_id(), chunk.total_size());
+      payload.size = chunk.total_size();
+      payload.received = 0;
+      if (payload.offset < 0) {
+        LOG(ERROR) << "Cannot allocate a payload of " << chunk.total_size()
+                   << " bytes.";
+        continue;
+      }
+      pending_payload_[key] = payload;
+    }
+
+    auto where = pending_payload_.find(key);
+    if (where == pending_payload_.end()) {
+      continue;
+    }
+    const std::string& bytes = chunk.data();
+    if (!result_store_->Write(where->second.offset, chunk.offset(),
+                              bytes.data(), bytes.size())) {
+      DropPayload(worker_id, chunk.task_id());
+      continue;
+    }
+    where->second.received += bytes.size();
+  }
+}
+
+void DPEMasterNode::HandleCheckpoint(WorkerStatus* worker,
+                                     const CheckpointItem& data,
+                                     int64 current_time) {
+  if (!checkpoint_store_) {
+    return;
+  }
+  // The late checkpoint of a done task is dropped.
+  const int64 index = task_table_.IndexOf(data.task_id());
+  if (index < 0 || task_table_.status(index) == TaskTable::TASK_DONE) {
+    return;
+  }
+  checkpoint_store_->Put(data.task_id(), data.data());
+  // A checkpoint is progress, the task keeps its lease. A task whose lease
+  // expired is taken back if no other worker got it yet.
+  if (lease_table_.Find(index)) {
+    RenewLease(*worker, index, current_time);
+  } else if (task_table_.MarkRunning(index)) {
+    lease_table_.Grant(index, worker->worker_id(), current_time,
+                       LeaseDeadline(*worker, index, current_time));
+    worker->add_running_task(data.task_id());
+  }
+  if (replication_log_.active()) {
+    const int64 task_id = data.task_id();
+    std::string record(reinterpret_cast<const char*>(&task_id),
+                       sizeof(task_id));
+    record.append(data.data());
+    replication_log_.Append(ReplicationLog::RECORD_CHECKPOINT, record.data(),
+                            static_cast<int>(record.size()));
+  }
+}
+
+void DPEMasterNode::AttachCheckpoint(int64 task_id, GetTaskResponse* task) {
+  if (!checkpoint_store_) {
+    return;
+  }
+  if (const std::string* data = checkpoint_store_->Find(task_id)) {
+    CheckpointItem* item = task->add_checkpoint();
+    item->set_task_id(task_id);
+    item->set_data(*data);
+  }
+}
+
+bool DPEMasterNode::TakePayload(const std::string& worker_id, int64 task_id,
+                                int64* result) {
+  auto where = pending_payload_.find(std::make_pair(worker_id, task_id));
+  if (where == pending_payload_.end()) {
+    return false;
+  }
+  const PendingPayload payload = where->second;
+  pending_payload_.erase(where);
+  if (payload.received != payload.size || payload.size != *result) {
+    result_store_->Free(payload.offset);
+    return false;
+  }
+  result_store_->Seal(payload.offset);
+  *result = payload.offset;
+  return true;
+}
+
+void DPEMasterNode::DropPayload(const std::string& worker_id, int64 task_id) {
+  auto where = pending_payload_.find(std::make_pair(worker_id, task_id));
+  if (where == pending_payload_.end()) {
+    return;
+  }
+  result_store_->Free(where->second.offset);
+  pending_payload_.erase(where);
+}
+
+void DPEMasterNode::DidReduceResults() {
+  if (combiner_->enabled()) {
+    solver_->SetCombinedResult(combined_value_);
+  }
+  if (result_store_) {
+    // The payloads are read from the mapped file without copying them.
+    result_store_->Sync();
+    ResultStoreView view(result_store_.get(), &task_table_);
+    solver_->SetPayloadResult(&view);
+  }
+  solver_->Finish();
+  if (standby_in_sync_) {
+    LOG(INFO) << "Waiting for the standby to apply all the records.";
+    exit_pending_ = true;
+    return;
+  }
+  if (IsCancelled() && broadcast_) {
+    // The workers get the cancel before the master exits.
+    BroadcastState(true);
+    base::ThreadPool::PostDelayedTask(
+        base::ThreadPool::UI, FROM_HERE,
+        base::Bind(&DPEMasterNode::Exit, weakptr_factory_.GetWeakPtr()),
+        base::TimeDelta::FromMicroseconds(kCancelExitDelay));
+    return;
+  }
+  Exit();
+}
+
+void DPEMasterNode::Exit() {
+  if (exit_callback_.is_null()) {
+    WillExitDpe();
+    return;
+  }
+  // The job host releases the job, so the callback is not run inside it.
+  base::ThreadPool::PostTask(base::ThreadPool::UI, FROM_HERE, exit_callback_);
+}
+
+WorkerStatus& DPEMasterNode::GetWorker(const std::string& worker_id) {
+  return GetWorkerStatus(&worker_map_, worker_id);
 }
 }  // namespace dpe
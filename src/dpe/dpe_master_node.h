@@ -1,6 +1,7 @@
 #ifndef DPE_MASTER_NODE_H_
 #define DPE_MASTER_NODE_H_
 
+#include <deque>
 #include <vector>
 #include <utility>
 #include <queue>
@@ -8,8 +9,22 @@
 #include <string>
 
 #include "dpe_base/dpe_base.h"
+#include "dpe/broadcast_channel.h"
+#include "dpe/cancel_flag.h"
+#include "dpe/checkpoint_store.h"
+#include "dpe/global_bound.h"
 #include "dpe/http_server.h"
+#include "dpe/memo_cache.h"
 #include "dpe/proto/dpe.pb.h"
+#include "dpe/reduction_pipeline.h"
+#include "dpe/replication_log.h"
+#include "dpe/result_cache.h"
+#include "dpe/result_combiner.h"
+#include "dpe/result_store.h"
+#include "dpe/task_lease.h"
+#include "dpe/task_log.h"
+#include "dpe/task_state_file.h"
+#include "dpe/task_table.h"
 #include "dpe/zserver.h"
 
 namespace dpe {
@@ -18,14 +33,27 @@ static const int kServerPort = 3310;
 
 class DPEMasterNode : public ZServerHandler,
                       public http::HttpReqestHandler,
+                      public TaskInjector,
                       public base::RefCounted<DPEMasterNode> {
  public:
   DPEMasterNode(const std::string& my_ip, int port);
+  // A job of a multi-job master, the requests come from the job host and
+  // |exit_callback| is posted instead of exiting. |broadcast| is the channel
+  // of the host.
+  DPEMasterNode(const std::string& my_ip, const std::string& job,
+                Solver* solver, BroadcastChannel* broadcast,
+                const base::Closure& exit_callback);
   ~DPEMasterNode();
 
   bool Start();
   void Stop();
 
+  const std::string& job() const { return job_; }
+  int64 pending_task_count() const { return task_table_.pending_count(); }
+  int64 running_task_count() const {
+    return static_cast<int64>(lease_table_.leases().size());
+  }
+
   int HandleRequest(const Request& req, Response& reply);
 
   bool HandleRequest(const http::HttpRequest& req, http::HttpResponse* rep);
@@ -36,20 +64,282 @@ class DPEMasterNode : public ZServerHandler,
 
   WorkerStatus& GetWorker(const std::string& worker_id);
 
+  // TaskInjector, called from Solver::SetResult.
+  void AddTasks(int size, const int64* task_id, int priority) override;
+
  private:
+  // Uses the task state file as the storage of task_table_. If |reuse| is
+  // false or the file is bound to another task set, the file is recreated
+  // and the results of the tasks still in the task set are moved to
+  // |migrated|. Returns false if the table stays in memory.
+  bool AttachStateFile(bool reuse,
+                       std::vector<TaskLog::TaskResultRecord>* migrated);
+  // Opens the result store of the payloads if the solver has payloads, it
+  // is recreated if |reuse| is false or the file is bound to another task
+  // set. Returns false if there is no result store.
+  bool OpenResultStore(bool reuse);
+  // Returns true if |result| is the offset of the sealed payload of
+  // |task_id|, it is always true without payloads.
+  bool HasPayloadRecord(int64 task_id, int64 result) const;
+  // Pends the DONE tasks whose payload is lost.
+  void DropLostPayloads();
+  // Replaces the log by a snapshot of the done tasks, see TaskLog::Compact.
+  void CompactTaskLog();
+  // Loads the checkpoints of the unfinished tasks if |reuse| is true,
+  // otherwise deletes all the checkpoints.
+  void LoadCheckpoints(bool reuse);
+
+  // Returns the lease deadline of a task handed out to |worker|.
+  int64 LeaseDeadline(const WorkerStatus& worker, int64 index,
+                      int64 current_time);
+  // Renews the lease of the task at |index| or of its speculative copy if
+  // |worker| holds it.
+  void RenewLease(const WorkerStatus& worker, int64 index,
+                  int64 current_time);
+  // Updates the expected time of a task of |worker| by the time between
+  // handing out a task and receiving its result.
+  void UpdateTaskTime(WorkerStatus* worker, int64 time);
+  // The batch size of a worker with auto_batch_size, it decreases when the
+  // remaining tasks become few.
+  int AutoBatchSize(const WorkerStatus& worker, int64 current_time);
+  void AddTimeSample(int64 time_usage);
+  // Duplicates the slowest running tasks to an idle worker when there is no
+  // pending task. Returns the number of added tasks.
+  int AddSpeculativeTasks(WorkerStatus* worker, int max_count,
+                          int64 current_time, GetTaskResponse* task);
+  // Orders the pending tasks by the cost estimated by the solver, the time
+  // usage of the previous run or a cost model fitted to the finished tasks.
+  // Returns false if there is no cost information.
+  bool OrderTasksByCost();
+  void OnTimer();
+  // Requeues the tasks whose lease expired and drops the expired
+  // speculative copies.
+  void CheckLeases();
+  // Hands out a task of |worker_id| again unless another worker owns it.
+  void ReturnTask(const std::string& worker_id, int64 index);
+  // Copies the payload chunks to the result store.
+  void HandlePutPayload(const std::string& worker_id,
+                        const PutPayloadRequest& data);
+  // Replaces |result| (the payload size) by the offset of the uploaded
+  // payload and seals it. Returns false if the payload is not complete.
+  bool TakePayload(const std::string& worker_id, int64 task_id,
+                   int64* result);
+  // Frees the record of an upload of |worker_id| which is abandoned.
+  void DropPayload(const std::string& worker_id, int64 task_id);
+  // Leases the tasks a worker claims after a failover, unless another worker
+  // owns them.
+  void HandleClaimTask(WorkerStatus* worker, const ClaimTaskRequest& data,
+                       int64 current_time);
+  // Keeps the latest checkpoint of a running task.
+  void HandleCheckpoint(WorkerStatus* worker, const CheckpointItem& data,
+                        int64 current_time);
+  // Adds the checkpoint of |task_id| to |task| if it has one.
+  void AttachCheckpoint(int64 task_id, GetTaskResponse* task);
+  // Passes the results to the reduction pipeline if there is one, otherwise
+  // to Solver::SetResult.
+  void ReportResults(int size, int64* task_id, int64* result,
+                     int64* time_usage, int64 total_time_usage);
+  // Marks a task about to be handed out done if its result is cached, the
+  // result is added to |cached|. Returns false if the task is not cached.
+  bool FindCachedResult(int64 index,
+                        std::vector<TaskLog::TaskResultRecord>* cached);
+  // Logs and reports the results found in the result cache.
+  void ApplyCachedResults(
+      const std::vector<TaskLog::TaskResultRecord>& cached);
+  // Broadcasts the global bound and the cancel flag if they are changed, or
+  // always if |resend| is true.
+  void BroadcastState(bool resend);
+  // Binds the broadcast channel if the job has a bound or a cancel flag.
+  void StartBroadcast();
+  // Returns true if the solver completed the job.
+  bool IsCancelled() const { return cancel_ && cancel_->IsCancelled(); }
+  // Returns true if all the tasks of all the stages are done, or the solver
+  // completed the job.
+  bool IsAllDone();
+  // Adds the ready tasks of the open stage, the stage is complete and the
+  // next stage is opened when the previous stages are done.
+  void PullStageTasks();
+  // Adds the tasks of |stage| without logging them, the stages before it
+  // are complete.
+  void AddStageTasks(int stage, int size, const int64* task_id);
+  // Adds the injected tasks without logging them.
+  void AddInjectedTasks(int priority, int size, const int64* task_id);
+  // Calls Solver::Finish after the reduction and exits.
+  void FinishAllTasks();
+  void DidReduceResults();
+  // The master owns a part of the tasks if it is a shard. A shard keeps its
+  // results for the coordinator instead of calling the solver.
+  bool IsShard() const;
+  void GetShardResult(const GetShardResultRequest& req,
+                      GetShardResultResponse* shard);
+
+  // The primary side of the replication.
+  // Sends a page of the snapshot or the records to the standby.
+  void HandleReplicate(const ReplicateRequest& req, ReplicateResponse* rep);
+  // Drops the standby, the reserved tasks are pending again.
+  void StopReplication();
+  void CheckStandby(int64 current_time);
+  // Reserves pending tasks for the next handouts. A task is handed out after
+  // the standby applies its reserve record, so the standby knows every task
+  // which may be running.
+  void ReplenishReserve();
+  // Takes the next task to hand out.
+  bool PopDispatchable(int64* index);
+
+  // The standby side of the replication.
+  bool IsStandby() const { return standby_; }
+  void RequestReplication();
+  void HandleReplication(scoped_refptr<base::ZMQResponse> response);
+  // Copies the task table of the primary from the first page.
+  void BeginSnapshot();
+  void ApplySnapshotPage(const ReplicateResponse& rep);
+  void ApplyReplicatedRecord(const ReplicationRecord& record);
+  // Logs the combined value of the snapshot when the records before
+  // snapshot_end_seq_ are applied.
+  void MaybeLogSnapshotValue();
+  // Serves the workers when the primary is lost. The tasks reserved by the
+  // primary are held for the workers which run them.
+  void Promote();
+  // Sends the new term to the lost primary until it replies, so it stops
+  // serving if it is still alive.
+  void FencePrimary();
+  void HandleFence(scoped_refptr<base::ZMQResponse> response);
+
+  int SendRequest(Request& req, base::ZMQCallBack callback, int timeout);
+  static void HandleResponse(base::WeakPtr<DPEMasterNode> self,
+                             base::ZMQCallBack callback,
+                             scoped_refptr<base::ZMQResponse> rep);
+
+  // Exits the process, or ends the job of a multi-job master.
+  void Exit();
+  // The task table grows while the job runs, by the stages or the injected
+  // tasks.
+  bool HasDynamicTasks() const { return stage_count_ > 1 || task_injection_; }
+
   scoped_refptr<ZServer> zserver_;
   std::string my_ip_;
   int port_;
+  // Empty unless the master runs a job of a multi-job master.
+  std::string job_;
+  Solver* solver_;
+  base::Closure exit_callback_;
   std::string executable_dir_;
   std::string dpe_module_dir_;
+  // The path of the state files without extension.
+  std::string state_path_;
   base::WeakPtrFactory<DPEMasterNode> weakptr_factory_;
 
-  std::vector<int64> task_queue_;
-  std::deque<int64> task_pending_queue_;
-  std::set<int64> task_running_queue_;
-  std::map<int64, TaskItem> task_map_;
+  TaskTable task_table_;
+  scoped_refptr<TaskStateFile> task_state_file_;
+  scoped_refptr<TaskLog> task_log_;
+  // NULL if the results are passed to Solver::SetResult.
+  scoped_refptr<ReductionPipeline> reduction_pipeline_;
+  bool finishing_;
+  // The combined value of the done tasks if the solver has a combiner.
+  scoped_ptr<ResultCombiner> combiner_;
+  int64 combined_value_[2];
+  // The variable-length results, NULL if the solver has no payload.
+  scoped_ptr<ResultStore> result_store_;
+  int64 payload_size_hint_;
+  struct PendingPayload {
+    int64 offset;
+    int64 size;
+    int64 received;
+  };
+  // (worker id, task id) -> the payload being uploaded.
+  std::map<std::pair<std::string, int64>, PendingPayload> pending_payload_;
+  // The checkpoints of the unfinished tasks, NULL if the solver has no
+  // checkpoint.
+  scoped_ptr<CheckpointStore> checkpoint_store_;
+  // The results shared by the runs, NULL if the solver has no cache key.
+  scoped_ptr<ResultCache> result_cache_;
+  // The memo store of the workers, created by the first memo request.
+  scoped_ptr<MemoCache> memo_;
+
+  // The tasks of stage s are the task indexes in
+  // [stage_begin_[s], stage_begin_[s + 1]), the open stage is the last one
+  // and it is stage_count_ if all the stages are complete.
+  int stage_count_;
+  std::vector<int64> stage_begin_;
+  // The tasks before it are done.
+  int64 stage_done_cursor_;
+  // Solver::SetResult adds tasks by AddTasks.
+  bool task_injection_;
+  // NULL if the job has no bound.
+  scoped_refptr<GlobalBoundValue> bound_;
+  int64 published_bound_;
+  // NULL if the job always runs all the tasks.
+  scoped_refptr<CancelFlagValue> cancel_;
+  bool published_cancelled_;
+  // The channel of the bound, it is owned by the host of a job.
+  scoped_refptr<BroadcastChannel> broadcast_;
+
+  // The leases of the running tasks, they never expire if lease_timeout is 0.
+  TaskLeaseTable lease_table_;
+  scoped_refptr<base::RepeatedAction> lease_timer_;
+  // Task index -> the number of expired leases.
+  std::map<int64, int> expired_count_;
+  // The expected task time of all the workers.
+  int64 task_time_;
+
+  // The speculative copy of a running task, it is leased like the task.
+  struct SpeculativeCopy {
+    std::string worker_id;
+    int64 deadline;
+  };
+  // Task index -> its speculative copy.
+  std::map<int64, SpeculativeCopy> speculative_task_;
+  // The time usage of the recently finished tasks.
+  std::vector<int64> time_samples_;
+  size_t time_sample_pos_;
+
+  // (task index, time usage) of the previous run, for --task_order=cost.
+  std::vector<std::pair<int64, int64>> previous_cost_;
+  // The tasks are ordered when kMinCostSamples (task id, time usage) are
+  // collected if cost_model_pending_ is true.
+  bool cost_model_pending_;
+  std::vector<std::pair<int64, int64>> cost_samples_;
   std::map<std::string, WorkerStatus> worker_map_;
   int64 last_save_time_;
+
+  // The records of the task log, the reserved tasks and the checkpoints,
+  // active while a standby follows the master.
+  ReplicationLog replication_log_;
+  // The standby has copied the snapshot and follows the records.
+  bool standby_in_sync_;
+  int64 last_standby_time_;
+  // (sequence number of the reserve record, task index) of the reserved
+  // tasks, they are RUNNING without a lease.
+  std::deque<std::pair<int64, int64>> reserved_;
+  // The tasks handed out since the last replenish.
+  int64 dispatched_count_;
+  // Solver::Finish is called, the master exits when the standby has all the
+  // records.
+  bool exit_pending_;
+
+  // The master follows the primary at primary_address_.
+  bool standby_;
+  std::string primary_address_;
+  base::ZMQClient* zmq_client_;
+  bool replicating_;
+  int64 last_primary_time_;
+  int64 primary_epoch_;
+  int64 primary_term_;
+  // The term of the master, it is 1 unless the master is a promoted
+  // standby. A master seeing a higher term is fenced: it was replaced and
+  // refuses the requests.
+  int64 term_;
+  bool fenced_;
+  // The next record to apply.
+  int64 replication_seq_;
+  // The next task index of the snapshot, -1 if the snapshot is copied.
+  int64 snapshot_index_;
+  // The combined value of the snapshot includes the records before it.
+  int64 snapshot_end_seq_;
+  bool snapshot_value_logged_;
+  // The tasks reserved by the primary and not done.
+  std::set<int64> primary_reserved_;
+  scoped_refptr<base::RepeatedAction> replication_timer_;
 };
 }  // namespace dpe
 #endif
\ No newline at end of file
@@ -56,6 +56,12 @@ struct RangeBasedTaskGenerator {
 
   int64 count() const { return last_task_ - first_task_ + 1; }
 
+  // The task ids as a range, see Solver::GenerateTaskRanges.
+  void taskRange(int64* first, int64* last) const {
+    *first = first_task_;
+    *last = last_task_;
+  }
+
   std::pair<int64, int64> toRange(int64 id) const {
     assert(id >= first_task_ && id <= last_task_);
 
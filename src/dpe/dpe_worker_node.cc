@@ -8,127 +8,675 @@
 #include "dpe/dpe_master_node.h"
 
 namespace dpe {
+// The payloads are uploaded in requests of at most kPayloadChunkSize bytes.
+static const int64 kPayloadChunkSize = 1024 * 1024;
+// A payload buffer reserves at most kMaxPayloadReservation bytes.
+static const int64 kMaxPayloadReservation = 64 * 1024 * 1024;
+// The heartbeat interval of a worker. The heartbeats renew the leases of the
+// running tasks and find a lost master if it has a standby.
+static const int64 kHeartbeatInterval = 5 * 1000 * 1000;
+// A get_task failed during a failover is sent again after kFailoverRetryDelay
+// milliseconds.
+static const int kFailoverRetryDelay = 1000;
+// A shard is given up after kMaxShardFailures failed requests in a row, a
+// failed get_task is sent again after kFailoverRetryDelay milliseconds until
+// then.
+static const int kMaxShardFailures = 12;
+// The worker gives up if no master works for kFailoverTimeout.
+static const int64 kFailoverTimeout = 60 * 1000 * 1000;
+// The worker switches to the other master after kFailoverFailures requests
+// in a row fail, a single timeout is not a lost master.
+static const int kFailoverFailures = 3;
+
+namespace {
+class StringPayloadWriter : public PayloadWriter {
+ public:
+  explicit StringPayloadWriter(std::string* payload) : payload_(payload) {}
+  ~StringPayloadWriter() override {}
+
+  void Write(const void* data, int64 size) override {
+    if (size > 0) {
+      payload_->append(static_cast<const char*>(data),
+                       static_cast<size_t>(size));
+    }
+  }
+
+ private:
+  std::string* payload_;
+};
+
+// Keeps the latest checkpoint of a task on the computing thread and passes
+// the saved ones to the UI thread.
+class WorkerCheckpoint : public TaskCheckpoint {
+ public:
+  WorkerCheckpoint(base::WeakPtr<DPEWorkerNode> worker,
+                   const TaskSource& source, int64 task_id, std::string* data)
+      : worker_(worker), source_(source), task_id_(task_id), data_(data) {}
+  ~WorkerCheckpoint() override {}
+
+  const char* data() const override { return data_->data(); }
+  int64 size() const override { return data_->size(); }
+  void Save(const void* data, int64 size) override {
+    data_->assign(static_cast<const char*>(data),
+                  static_cast<size_t>(std::max<int64>(size, 0)));
+    base::ThreadPool::PostTask(
+        base::ThreadPool::UI, FROM_HERE,
+        base::Bind(DPEWorkerNode::SaveCheckpoint, worker_, source_, task_id_,
+                   *data_));
+  }
+
+ private:
+  base::WeakPtr<DPEWorkerNode> worker_;
+  TaskSource source_;
+  int64 task_id_;
+  std::string* data_;
+};
+}  // namespace
+
 DPEWorkerNode::DPEWorkerNode(const std::string& my_ip,
-                             const std::string& server_ip, int server_port)
-    : weakptr_factory_(this),
-      my_ip_(my_ip),
-      server_address_(
-          base::AddressHelper::MakeZMQTCPAddress(server_ip, server_port)),
+                             const std::vector<ServerAddress>& servers,
+                             const std::vector<ServerAddress>& masters)
+    : my_ip_(my_ip),
       running_task_count_(0),
-      zmq_client_(base::zmq_client()) {}
+      idle_thread_count_(0),
+      fetching_count_(0),
+      finishing_count_(0),
+      returning_count_(0),
+      no_more_task_(false),
+      shutting_down_(false),
+      exiting_(false),
+      suggested_size_(1),
+      next_upload_id_(0),
+      shard_done_(servers.size(), false),
+      shard_failures_(servers.size(), 0),
+      next_shard_(0),
+      active_master_(0),
+      failover_time_(0),
+      failure_count_(0),
+      master_term_(0),
+      next_result_id_(0),
+      zmq_client_(base::zmq_client()),
+      weakptr_factory_(this) {
+  for (auto& server : servers) {
+    server_address_.push_back(
+        base::AddressHelper::MakeZMQTCPAddress(server.ip, server.port));
+  }
+  // The standby is only supported for a single master.
+  if (server_address_.size() == 1 && masters.size() > 1) {
+    for (auto& master : masters) {
+      master_address_.push_back(
+          base::AddressHelper::MakeZMQTCPAddress(master.ip, master.port));
+    }
+    server_address_[0] = master_address_[0];
+  }
+  no_more_task_ = server_address_.empty();
+}
 
 DPEWorkerNode::~DPEWorkerNode() {}
 
 bool DPEWorkerNode::Start() {
-  GetSolver()->InitWorker();
-  for (int i = 0; i < GetFlags().thread_number; ++i) {
-    GetNextTask(1);
+  // The solvers of the jobs are initialized by their first batches.
+  if (GetSolver()) {
+    GetJob(std::string());
   }
+  idle_thread_count_ = GetFlags().thread_number;
+  executor_ = new TaskExecutor(GetFlags().thread_number);
+  executor_->Start();
+  broadcast_ = new BroadcastChannel();
+  broadcast_->set_message_callback(base::Bind(
+      &DPEWorkerNode::HandleBroadcast, weakptr_factory_.GetWeakPtr()));
+  heartbeat_timer_ = new base::RepeatedAction(NULL);
+  heartbeat_timer_->Start(
+      base::Bind(&DPEWorkerNode::SendHeartbeat,
+                 weakptr_factory_.GetWeakPtr()),
+      base::TimeDelta::FromMicroseconds(kHeartbeatInterval),
+      base::TimeDelta::FromMicroseconds(kHeartbeatInterval), -1);
+  FillPipeline();
   return true;
 }
 
-void DPEWorkerNode::Stop() {}
+const DPEWorkerNode::WorkerJob* DPEWorkerNode::GetJob(
+    const std::string& name) {
+  auto where = jobs_.find(name);
+  if (where != jobs_.end()) {
+    return &where->second;
+  }
+  Solver* solver = GetJobSolver(name);
+  if (!solver) {
+    return NULL;
+  }
+  solver->InitWorker();
+  WorkerJob job = {solver, ResultCombiner(solver), false, 0, false, false};
+  job.has_payload =
+      !job.combiner.enabled() && solver->HasPayload(&job.payload_size_hint);
+  job.has_checkpoint = !job.has_payload && solver->HasCheckpoint();
+  job.split_batches = solver->SplitBatches();
+  int64 initial_bound = 0;
+  const int bound_type = solver->GetBoundType(&initial_bound);
+  if (bound_type != Solver::kNoBound) {
+    job.bound = new GlobalBoundValue(bound_type, initial_bound);
+    solver->SetGlobalBound(job.bound.get());
+  }
+  job.cancel = new CancelFlagValue(false);
+  if (!solver->AcceptCancelFlag(job.cancel.get())) {
+    job.cancel = NULL;
+  }
+  job.memo = new MemoClient(
+      base::Bind(&DPEWorkerNode::SendMemo, weakptr_factory_.GetWeakPtr(),
+                 name),
+      static_cast<int64>(GetFlags().memo_cache_size) * 1024 * 1024);
+  if (!solver->AcceptMemoStore(job.memo.get())) {
+    job.memo = NULL;
+  }
+  return &jobs_.insert(std::make_pair(name, job)).first->second;
+}
 
-void DPEWorkerNode::GetNextTask(int suggested_size) {
+void DPEWorkerNode::Stop() {
+  if (heartbeat_timer_) {
+    heartbeat_timer_->Stop();
+    heartbeat_timer_ = NULL;
+  }
+  if (broadcast_) {
+    broadcast_->Close();
+    broadcast_ = NULL;
+  }
+  if (executor_) {
+    executor_->Stop();
+    executor_ = NULL;
+  }
+}
+
+void DPEWorkerNode::HandleBroadcast(const Broadcast& message) {
+  // The bound of a job is taken after its first batch, the master sends it
+  // again periodically.
+  auto where = jobs_.find(message.job());
+  if (where != jobs_.end() && where->second.bound && message.has_bound()) {
+    where->second.bound->Improve(message.bound());
+  }
+  if (message.cancelled()) {
+    CancelJob(message.job());
+  }
+}
+
+void DPEWorkerNode::SendMemo(const std::string& job, const MemoRequest& memo,
+                             scoped_refptr<MemoFetch> fetch) {
+  Request request;
+  request.set_name("memo");
+  request.set_job(job);
+  *request.mutable_memo() = memo;
+  SendRequest(0, request,
+              base::Bind(&DPEWorkerNode::HandleMemo, this, fetch), 5000);
+}
+
+void DPEWorkerNode::HandleMemo(scoped_refptr<MemoFetch> fetch,
+                               scoped_refptr<base::ZMQResponse> response) {
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    LOG(WARNING) << "Handle memo, error: " << response->error_code_
+                 << std::endl;
+    if (fetch) {
+      fetch->Done(NULL);
+    }
+    return;
+  }
+  if (fetch) {
+    Response body;
+    body.ParseFromString(response->data_);
+    fetch->Done(&body.memo());
+  }
+}
+
+void DPEWorkerNode::CancelJob(const std::string& name) {
+  auto where = jobs_.find(name);
+  if (where == jobs_.end() || !where->second.cancel ||
+      where->second.cancel->IsCancelled()) {
+    return;
+  }
+  // The running tasks return early and their results are dropped.
+  where->second.cancel->Set();
+  int64 dropped = 0;
+  for (auto iter = prefetched_.begin(); iter != prefetched_.end();) {
+    if (iter->source.job != name) {
+      ++iter;
+      continue;
+    }
+    for (auto task_id : iter->tasks) {
+      running_task_.erase(task_id);
+    }
+    dropped += iter->tasks.size();
+    iter = prefetched_.erase(iter);
+  }
+  LOG(INFO) << "The master completed the job"
+            << (name.empty() ? std::string() : " " + name) << ", dropped "
+            << dropped << " prefetched tasks.";
+  DispatchTasks();
+}
+
+void DPEWorkerNode::Shutdown() {
+  if (shutting_down_) {
+    return;
+  }
+  shutting_down_ = true;
+  LOG(INFO) << "Shutting down worker node.";
+
+  // The prefetched tasks are not started, returns them to their shards.
+  std::map<std::pair<int, std::string>, std::vector<int64>> tasks;
+  for (auto& batch : prefetched_) {
+    std::vector<int64>& source_tasks =
+        tasks[std::make_pair(batch.source.shard, batch.source.job)];
+    source_tasks.insert(source_tasks.end(), batch.tasks.begin(),
+                        batch.tasks.end());
+  }
+  prefetched_.clear();
+  for (auto& iter : tasks) {
+    TaskSource source = {iter.first.first, iter.first.second};
+    ReturnTasks(source, iter.second);
+  }
+  MaybeExit();
+}
+
+void DPEWorkerNode::ReturnTasks(const TaskSource& source,
+                                const std::vector<int64>& tasks) {
+  LOG(INFO) << "Return " << tasks.size() << " unstarted tasks.";
+  ReturnTaskRequest* return_task = new ReturnTaskRequest();
+  for (auto task_id : tasks) {
+    return_task->add_task_id(task_id);
+    running_task_.erase(task_id);
+  }
+
+  Request request;
+  request.set_name("return_task");
+  request.set_job(source.job);
+  request.set_allocated_return_task(return_task);
+  ++returning_count_;
+  SendRequest(source.shard, request,
+              base::Bind(&dpe::DPEWorkerNode::HandleReturnTask, this), 5000);
+}
+
+void DPEWorkerNode::HandleReturnTask(
+    scoped_refptr<base::ZMQResponse> response) {
+  --returning_count_;
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    LOG(WARNING) << "Handle return task, error: " << response->error_code_
+                 << std::endl;
+  }
+  MaybeExit();
+}
+
+void DPEWorkerNode::FillPipeline() {
+  // Every idle thread waits for a batch, and GetFlags().prefetch batches are
+  // fetched in advance.
+  while (NeedMoreTasks()) {
+    GetNextTask(suggested_size_);
+  }
+}
+
+bool DPEWorkerNode::NeedMoreTasks() const {
+  const int wanted = idle_thread_count_ + std::max(GetFlags().prefetch, 0);
+  return !no_more_task_ && !shutting_down_ &&
+         static_cast<int>(prefetched_.size()) + fetching_count_ < wanted;
+}
+
+void DPEWorkerNode::DispatchTasks() {
+  StartPrefetchedTasks();
+  FillPipeline();
+  MaybeExit();
+}
+
+void DPEWorkerNode::StartPrefetchedTasks() {
+  while (idle_thread_count_ > 0 && !prefetched_.empty() && executor_) {
+    scoped_refptr<RunningBatch> batch = new RunningBatch();
+    batch->source = prefetched_.front().source;
+    batch->tasks.swap(prefetched_.front().tasks);
+    batch->checkpoints.swap(prefetched_.front().checkpoints);
+    prefetched_.pop_front();
+
+    --idle_thread_count_;
+    ++running_task_count_;
+    for (auto task_id : batch->tasks) {
+      executing_task_[std::make_pair(batch->source.job, task_id)] =
+          batch->source.shard;
+    }
+    const WorkerJob* job = GetJob(batch->source.job);
+    const int size = static_cast<int>(batch->tasks.size());
+    batch->solver = job->solver;
+    batch->cancel = job->cancel;
+    batch->result.resize(size, 0);
+    batch->time_usage.resize(size, 0);
+    if (job->has_checkpoint) {
+      batch->checkpoints.resize(size);
+    }
+    if (job->has_payload) {
+      batch->payloads = new PayloadBatch();
+      batch->payloads->payload.resize(size);
+      for (auto& payload : batch->payloads->payload) {
+        payload.reserve(static_cast<size_t>(
+            std::min(std::max<int64>(job->payload_size_hint, 0),
+                     kMaxPayloadReservation)));
+      }
+    }
+    // A batch which is not split keeps the Compute contract: the whole batch
+    // in one call on one thread.
+    executor_->Submit(
+        job->split_batches ? size : 1,
+        base::Bind(job->split_batches ? DPEWorkerNode::ExecuteTask
+                                      : DPEWorkerNode::ExecuteBatch,
+                   weakptr_factory_.GetWeakPtr(), batch),
+        base::Bind(DPEWorkerNode::FinishExecuteBatch,
+                   weakptr_factory_.GetWeakPtr(), batch));
+  }
+}
+
+void DPEWorkerNode::MaybeExit() {
+  if (exiting_ || (!no_more_task_ && !shutting_down_)) {
+    return;
+  }
+  if (running_task_count_ == 0 && fetching_count_ == 0 &&
+      finishing_count_ == 0 && returning_count_ == 0 && prefetched_.empty() &&
+      unconfirmed_.empty()) {
+    exiting_ = true;
+    Stop();
+    WillExitDpe();
+  }
+}
+
+int DPEWorkerNode::NextShard() {
+  const int shard_count = static_cast<int>(server_address_.size());
+  for (int i = 0; i < shard_count; ++i) {
+    const int shard = (next_shard_ + i) % shard_count;
+    if (!shard_done_[shard]) {
+      next_shard_ = (shard + 1) % shard_count;
+      return shard;
+    }
+  }
+  return -1;
+}
+
+void DPEWorkerNode::MarkShardDone(int shard) {
+  if (!shard_done_[shard] && server_address_.size() > 1) {
+    LOG(INFO) << "Shard " << shard << " has no more task.";
+  }
+  shard_done_[shard] = true;
+  no_more_task_ = NextShard() == -1;
+}
+
+bool DPEWorkerNode::ShardFailed(int shard) {
+  return ++shard_failures_[shard] >= kMaxShardFailures;
+}
+
+GetTaskRequest* DPEWorkerNode::NewGetTaskRequest(int suggested_size) {
   GetTaskRequest* get_task = new GetTaskRequest();
   const int batch_size = GetFlags().batch_size;
 
-  get_task->set_max_task_count(batch_size > 0 ? batch_size : suggested_size);
+  if (batch_size == 0) {
+    get_task->set_auto_batch_size(true);
+  } else {
+    get_task->set_max_task_count(batch_size > 0 ? batch_size
+                                                : suggested_size);
+  }
+  get_task->set_thread_number(GetFlags().thread_number);
+  // The prefetched batches and the fetches in flight go to the idle threads
+  // first.
+  get_task->set_idle_thread_number(std::max(
+      idle_thread_count_ - static_cast<int>(prefetched_.size()) -
+          fetching_count_,
+      0));
+  return get_task;
+}
 
+void DPEWorkerNode::GetNextTask(int suggested_size) {
+  const int shard = NextShard();
+  if (shard == -1) {
+    no_more_task_ = true;
+    return;
+  }
   Request request;
   request.set_name("get_task");
-  request.set_allocated_get_task(get_task);
-  SendRequest(request, base::Bind(&dpe::DPEWorkerNode::HandleGetTask, this),
+  request.set_allocated_get_task(NewGetTaskRequest(suggested_size));
+  ++fetching_count_;
+  SendRequest(shard, request,
+              base::Bind(&dpe::DPEWorkerNode::HandleGetTask, this, shard),
               5000);
 }
 
-void DPEWorkerNode::HandleGetTask(scoped_refptr<base::ZMQResponse> response) {
+void DPEWorkerNode::HandleGetTask(int shard,
+                                  scoped_refptr<base::ZMQResponse> response) {
+  --fetching_count_;
   if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
     LOG(WARNING) << "Handle get task, error: " << response->error_code_
                  << std::endl;
-    if (running_task_count_ == 0) {
-      WillExitDpe();
+    // Asks the other master or the same shard later, the shard may still
+    // have tasks leased to the other workers.
+    if (!shard_done_[shard] && !shutting_down_ &&
+        (CanFailover() || !ShardFailed(shard))) {
+      ++fetching_count_;
+      base::ThreadPool::PostDelayedTask(
+          base::ThreadPool::UI, FROM_HERE,
+          base::Bind(&DPEWorkerNode::RetryGetTask, this),
+          base::TimeDelta::FromMilliseconds(kFailoverRetryDelay));
+      return;
     }
+    MarkShardDone(shard);
+    DispatchTasks();
     return;
   }
 
+  shard_failures_[shard] = 0;
   Response body;
   body.ParseFromString(response->data_);
   auto& get_task = body.get_task();
   const int size = get_task.task_id_size();
+  if (size == 0 && get_task.retry_delay() > 0 && !shutting_down_) {
+    // The aggregator is waiting for its upstream node.
+    ++fetching_count_;
+    base::ThreadPool::PostDelayedTask(
+        base::ThreadPool::UI, FROM_HERE,
+        base::Bind(&DPEWorkerNode::RetryGetTask, this),
+        base::TimeDelta::FromMilliseconds(get_task.retry_delay()));
+    return;
+  }
+  // The master asks again while it has running tasks, so an empty batch
+  // without a retry delay means the shard is done.
   if (size == 0) {
     LOG(WARNING) << "Handle get task, no more task" << std::endl;
-    if (running_task_count_ == 0) {
-      WillExitDpe();
-    }
+    MarkShardDone(shard);
+    DispatchTasks();
     return;
   }
 
-  std::vector<int64> tasks;
+  TaskBatch batch;
+  batch.source.shard = shard;
+  batch.source.job = get_task.job();
+  const WorkerJob* job = GetJob(batch.source.job);
+  if (!job) {
+    // The tasks are handed out again when their leases expire.
+    LOG(ERROR) << "Unknown job: " << batch.source.job;
+    MarkShardDone(shard);
+    DispatchTasks();
+    return;
+  }
   for (int i = 0; i < size; ++i) {
-    tasks.push_back(get_task.task_id(i));
+    batch.tasks.push_back(get_task.task_id(i));
+    if (CanFailover()) {
+      running_task_.insert(get_task.task_id(i));
+    }
   }
+  if (job->has_checkpoint && get_task.checkpoint_size() > 0) {
+    std::map<int64, std::string> checkpoint;
+    for (auto& item : get_task.checkpoint()) {
+      checkpoint[item.task_id()] = item.data();
+    }
+    batch.checkpoints.resize(size);
+    for (int i = 0; i < size; ++i) {
+      auto where = checkpoint.find(batch.tasks[i]);
+      if (where != checkpoint.end()) {
+        batch.checkpoints[i].swap(where->second);
+      }
+    }
+    LOG(INFO) << "Resume " << checkpoint.size() << " tasks.";
+  }
+  if (shutting_down_) {
+    // The tasks arrived after the shutdown started.
+    ReturnTasks(batch.source, batch.tasks);
+    return;
+  }
+  prefetched_.push_back(batch);
+  DispatchTasks();
+}
 
-  ++running_task_count_;
-
-  base::ThreadPool::GetBlockingPool()->PostTask(
-      FROM_HERE, base::Bind(DPEWorkerNode::ExecuteTask,
-                            weakptr_factory_.GetWeakPtr(), tasks));
+void DPEWorkerNode::RetryGetTask() {
+  --fetching_count_;
+  DispatchTasks();
 }
 
 void DPEWorkerNode::HandleFinishCompute(
-    int suggested_size, scoped_refptr<base::ZMQResponse> response) {
+    int shard, bool has_get_task, int64 result_id,
+    scoped_refptr<base::ZMQResponse> response) {
+  --finishing_count_;
   if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
     LOG(WARNING) << "Handle finish compute, error: " << response->error_code_
                  << std::endl;
-    if (running_task_count_ == 0) {
-      WillExitDpe();
+    // The results are sent again after the failover, otherwise the tasks
+    // are handed out again when their leases expire. HandleGetTask counts
+    // the failure of a request carrying get_task.
+    if (!CanFailover() && !has_get_task && ShardFailed(shard)) {
+      MarkShardDone(shard);
     }
   } else {
-    GetNextTask(suggested_size);
+    shard_failures_[shard] = 0;
+    auto where = unconfirmed_.find(result_id);
+    if (where != unconfirmed_.end()) {
+      Response body;
+      body.ParseFromString(response->data_);
+      // Without a standby in sync there is nothing to wait for.
+      if (body.has_replication()) {
+        where->second.seq = body.replication().seq();
+      } else {
+        unconfirmed_.erase(where);
+      }
+    }
+  }
+  if (has_get_task) {
+    HandleGetTask(shard, response);
+  } else {
+    MaybeExit();
   }
 }
 
 void DPEWorkerNode::ExecuteTask(base::WeakPtr<DPEWorkerNode> self,
-                                std::vector<int64> tasks) {
-  const int size = tasks.size();
-  std::vector<int64> result(size, 0);
-  std::vector<int64> time_usage(size, 0);
+                                scoped_refptr<RunningBatch> batch,
+                                int index) {
+  if (batch->cancel && batch->cancel->IsCancelled()) {
+    return;
+  }
+  Solver* solver = batch->solver;
+  const int64 task_id = batch->tasks[index];
+  const int64 start_time = base::Time::Now().ToInternalValue();
+  if (batch->payloads) {
+    // The result of a task is the size of its payload.
+    std::string& payload = batch->payloads->payload[index];
+    StringPayloadWriter writer(&payload);
+    solver->ComputePayload(task_id, &writer, GetFlags().parallel_info);
+    batch->time_usage[index] =
+        base::Time::Now().ToInternalValue() - start_time;
+    batch->result[index] = payload.size();
+  } else if (solver->HasCheckpoint()) {
+    std::string& data = batch->checkpoints[index];
+    WorkerCheckpoint checkpoint(self, batch->source, task_id, &data);
+    batch->result[index] = solver->ComputeResumable(
+        task_id, &checkpoint, GetFlags().parallel_info);
+    batch->time_usage[index] =
+        base::Time::Now().ToInternalValue() - start_time;
+    std::string().swap(data);
+  } else {
+    solver->Compute(1, &batch->tasks[index], &batch->result[index],
+                    &batch->time_usage[index], GetFlags().parallel_info);
+  }
+  batch->total_time += base::Time::Now().ToInternalValue() - start_time;
+}
 
+void DPEWorkerNode::ExecuteBatch(base::WeakPtr<DPEWorkerNode> self,
+                                 scoped_refptr<RunningBatch> batch,
+                                 int index) {
+  const int size = static_cast<int>(batch->tasks.size());
+  // ComputePayload and ComputeResumable compute a task at a time anyway.
+  if (batch->payloads || batch->solver->HasCheckpoint()) {
+    for (int i = 0; i < size; ++i) {
+      ExecuteTask(self, batch, i);
+    }
+    return;
+  }
+  if (size == 0 || (batch->cancel && batch->cancel->IsCancelled())) {
+    return;
+  }
   const int64 start_time = base::Time::Now().ToInternalValue();
-  GetSolver()->Compute(size, &tasks[0], &result[0], &time_usage[0],
-                       GetFlags().parallel_info);
-  const int64 end_time = base::Time::Now().ToInternalValue();
+  batch->solver->Compute(size, &batch->tasks[0], &batch->result[0],
+                         &batch->time_usage[0], GetFlags().parallel_info);
+  batch->total_time += base::Time::Now().ToInternalValue() - start_time;
+}
 
+void DPEWorkerNode::FinishExecuteBatch(base::WeakPtr<DPEWorkerNode> self,
+                                       scoped_refptr<RunningBatch> batch) {
   base::ThreadPool::PostTask(
       base::ThreadPool::UI, FROM_HERE,
-      base::Bind(DPEWorkerNode::FinishExecuteTask, self, tasks, result,
-                 time_usage, end_time - start_time));
+      base::Bind(DPEWorkerNode::FinishExecuteTask, self, batch->source,
+                 batch->tasks, batch->result, batch->time_usage,
+                 batch->total_time.load(), batch->payloads));
 }
 
 void DPEWorkerNode::FinishExecuteTask(base::WeakPtr<DPEWorkerNode> self,
+                                      TaskSource source,
                                       std::vector<int64> tasks,
                                       std::vector<int64> result,
                                       std::vector<int64> time_usage,
-                                      int64 total_time) {
+                                      int64 total_time,
+                                      scoped_refptr<PayloadBatch> payloads) {
   if (DPEWorkerNode* p_this = self.get()) {
-    p_this->FinishExecuteTaskImpl(tasks, result, time_usage, total_time);
+    p_this->FinishExecuteTaskImpl(source, tasks, result, time_usage,
+                                  total_time, payloads);
   }
 }
 
-void DPEWorkerNode::FinishExecuteTaskImpl(std::vector<int64> tasks,
-                                          std::vector<int64> result,
-                                          std::vector<int64> time_usage,
-                                          int64 total_time) {
+void DPEWorkerNode::FinishExecuteTaskImpl(
+    const TaskSource& source, std::vector<int64> tasks,
+    std::vector<int64> result,
+    std::vector<int64> time_usage, int64 total_time,
+    scoped_refptr<PayloadBatch> payloads) {
   --running_task_count_;
+  ++idle_thread_count_;
 
   const int size = tasks.size();
+  // The master drops the checkpoints of the done tasks.
+  for (auto task_id : tasks) {
+    pending_checkpoint_.erase(std::make_pair(source.job, task_id));
+    executing_task_.erase(std::make_pair(source.job, task_id));
+    running_task_.erase(task_id);
+  }
+  const WorkerJob* job = GetJob(source.job);
+  if (job->cancel && job->cancel->IsCancelled()) {
+    // The master dropped the job.
+    DispatchTasks();
+    return;
+  }
+  const ResultCombiner& combiner = job->combiner;
   FinishComputeRequest* fr = new FinishComputeRequest();
-  for (int i = 0; i < size; ++i) {
-    TaskItem* item = fr->add_task_item();
-    item->set_task_id(tasks[i]);
-    item->set_result(result[i]);
-    item->set_time_usage(time_usage[i]);
+  if (combiner.enabled()) {
+    // Only the combined value of the batch is sent.
+    int64 value[2];
+    combiner.Init(value);
+    for (int i = 0; i < size; ++i) {
+      fr->add_task_id(tasks[i]);
+      combiner.Add(value, result[i]);
+    }
+    fr->set_combined_low(value[0]);
+    fr->set_combined_high(value[1]);
+    fr->set_combiner(combiner.type());
+  } else {
+    for (int i = 0; i < size; ++i) {
+      TaskItem* item = fr->add_task_item();
+      item->set_task_id(tasks[i]);
+      item->set_result(result[i]);
+      item->set_time_usage(time_usage[i]);
+    }
   }
   fr->set_total_time_usage(total_time);
 
@@ -155,41 +703,327 @@ void DPEWorkerNode::FinishExecuteTaskImpl(std::vector<int64> tasks,
       suggested_size = 1;
     }
   }
+  suggested_size_ = suggested_size;
+
+  // The next batch starts without waiting for the master.
+  StartPrefetchedTasks();
+
+  if (payloads) {
+    const int upload_id = next_upload_id_++;
+    PayloadUpload& upload = uploads_[upload_id];
+    upload.source = source;
+    upload.finish_compute.Swap(fr);
+    delete fr;
+    upload.task_id.swap(tasks);
+    upload.payloads = payloads;
+    upload.task_index = 0;
+    upload.offset = 0;
+    ++finishing_count_;
+    SendNextPayloadChunk(upload_id);
+    FillPipeline();
+    return;
+  }
+
+  SendFinishCompute(source, fr);
+  FillPipeline();
+}
+
+void DPEWorkerNode::SendNextPayloadChunk(int upload_id) {
+  PayloadUpload& upload = uploads_[upload_id];
+  std::vector<std::string>& payload = upload.payloads->payload;
+  if (upload.task_index >= upload.task_id.size()) {
+    --finishing_count_;
+    FinishComputeRequest* fr = new FinishComputeRequest();
+    fr->Swap(&upload.finish_compute);
+    const TaskSource source = upload.source;
+    uploads_.erase(upload_id);
+    SendFinishCompute(source, fr);
+    return;
+  }
+
+  // Every payload has a first chunk, even if it is empty.
+  PutPayloadRequest* put_payload = new PutPayloadRequest();
+  int64 budget = kPayloadChunkSize;
+  while (upload.task_index < upload.task_id.size() && budget > 0) {
+    std::string& data = payload[upload.task_index];
+    const int64 size = std::min<int64>(budget, data.size() - upload.offset);
+    PayloadChunk* chunk = put_payload->add_chunk();
+    chunk->set_task_id(upload.task_id[upload.task_index]);
+    chunk->set_offset(upload.offset);
+    if (upload.offset == 0) {
+      chunk->set_total_size(data.size());
+    }
+    chunk->set_data(data.data() + upload.offset, static_cast<size_t>(size));
+    upload.offset += size;
+    budget -= size;
+    if (upload.offset == static_cast<int64>(data.size())) {
+      std::string().swap(data);
+      ++upload.task_index;
+      upload.offset = 0;
+    }
+  }
+
+  Request request;
+  request.set_name("put_payload");
+  request.set_job(upload.source.job);
+  request.set_allocated_put_payload(put_payload);
+  SendRequest(upload.source.shard, request,
+              base::Bind(&dpe::DPEWorkerNode::HandlePutPayload, this,
+                         upload_id),
+              10000);
+}
+
+void DPEWorkerNode::HandlePutPayload(
+    int upload_id, scoped_refptr<base::ZMQResponse> response) {
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    LOG(WARNING) << "Handle put payload, error: " << response->error_code_
+                 << std::endl;
+    // The tasks of the batch are handed out again when their leases expire.
+    --finishing_count_;
+    const int shard = uploads_[upload_id].source.shard;
+    if (ShardFailed(shard)) {
+      MarkShardDone(shard);
+    }
+    uploads_.erase(upload_id);
+    MaybeExit();
+    return;
+  }
+  SendNextPayloadChunk(upload_id);
+}
+
+void DPEWorkerNode::SaveCheckpoint(base::WeakPtr<DPEWorkerNode> self,
+                                   TaskSource source, int64 task_id,
+                                   std::string data) {
+  if (DPEWorkerNode* p_this = self.get()) {
+    const JobTaskId task = std::make_pair(source.job, task_id);
+    PendingCheckpoint& checkpoint = p_this->pending_checkpoint_[task];
+    checkpoint.shard = source.shard;
+    checkpoint.data.swap(data);
+    if (!p_this->sending_checkpoint_.count(task)) {
+      p_this->SendCheckpoint(task);
+    }
+  }
+}
+
+void DPEWorkerNode::SendCheckpoint(const JobTaskId& task) {
+  auto where = pending_checkpoint_.find(task);
+  if (where == pending_checkpoint_.end()) {
+    return;
+  }
+  CheckpointItem* checkpoint = new CheckpointItem();
+  checkpoint->set_task_id(task.second);
+  checkpoint->mutable_data()->swap(where->second.data);
+  const int shard = where->second.shard;
+  pending_checkpoint_.erase(where);
+
+  Request request;
+  request.set_name("checkpoint");
+  request.set_job(task.first);
+  request.set_allocated_checkpoint(checkpoint);
+  sending_checkpoint_.insert(task);
+  SendRequest(shard, request,
+              base::Bind(&dpe::DPEWorkerNode::HandleCheckpoint, this, task),
+              10000);
+}
+
+void DPEWorkerNode::HandleCheckpoint(
+    JobTaskId task, scoped_refptr<base::ZMQResponse> response) {
+  sending_checkpoint_.erase(task);
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    // The next checkpoint of the task is sent anyway.
+    LOG(WARNING) << "Handle checkpoint, error: " << response->error_code_
+                 << std::endl;
+  }
+  SendCheckpoint(task);
+}
+
+void DPEWorkerNode::SendFinishCompute(const TaskSource& source,
+                                      FinishComputeRequest* fr) {
+  const int shard = source.shard;
   Request request;
   request.set_name("finish_compute");
+  request.set_job(source.job);
   request.set_allocated_finish_compute(fr);
-  SendRequest(request,
-              base::Bind(&dpe::DPEWorkerNode::HandleFinishCompute, this,
-                         suggested_size),
+  // Asks the same shard for the next batch in the same request.
+  const bool has_get_task = NeedMoreTasks() && !shard_done_[shard];
+  if (has_get_task) {
+    request.set_allocated_get_task(NewGetTaskRequest(suggested_size_));
+    ++fetching_count_;
+  }
+  int64 result_id = -1;
+  if (CanFailover()) {
+    result_id = next_result_id_++;
+    UnconfirmedResult& result = unconfirmed_[result_id];
+    result.job = source.job;
+    result.finish_compute = request.finish_compute();
+    result.seq = -1;
+  }
+  ++finishing_count_;
+  SendRequest(shard, request,
+              base::Bind(&dpe::DPEWorkerNode::HandleFinishCompute, this, shard,
+                         has_get_task, result_id),
               10000);
 }
 
-int DPEWorkerNode::SendRequest(Request& req, base::ZMQCallBack callback,
-                               int timeout) {
+void DPEWorkerNode::SendHeartbeat() {
+  if (exiting_) {
+    return;
+  }
+  // A heartbeat per shard and job carries the tasks in the executor, the
+  // first shard gets one anyway if the master has a standby.
+  std::map<std::pair<int, std::string>, HeartbeatRequest> heartbeats;
+  if (CanFailover()) {
+    heartbeats[std::make_pair(0, std::string())];
+  }
+  for (auto& iter : executing_task_) {
+    heartbeats[std::make_pair(iter.second, iter.first.first)].add_task_id(
+        iter.first.second);
+  }
+  for (auto& iter : heartbeats) {
+    Request request;
+    request.set_name("heartbeat");
+    request.set_job(iter.first.second);
+    *request.mutable_heartbeat() = iter.second;
+    SendRequest(iter.first.first, request,
+                base::Bind(&dpe::DPEWorkerNode::HandleHeartbeat, this), 5000);
+  }
+}
+
+void DPEWorkerNode::HandleHeartbeat(
+    scoped_refptr<base::ZMQResponse> response) {
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    LOG(WARNING) << "Handle heartbeat, error: " << response->error_code_
+                 << std::endl;
+  }
+  MaybeExit();
+}
+
+void DPEWorkerNode::HandleClaimTask(
+    scoped_refptr<base::ZMQResponse> response) {
+  if (response->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    // The tasks are handed out again when the grace period ends.
+    LOG(WARNING) << "Handle claim task, error: " << response->error_code_
+                 << std::endl;
+  }
+}
+
+void DPEWorkerNode::CheckMasterResponse(const std::string& address,
+                                        base::ZMQResponse* rep,
+                                        const Response& body) {
+  // A reply of the other master comes before the failover.
+  if (!CanFailover() || address != server_address_[0]) {
+    return;
+  }
+  if (rep->error_code_ != base::ZMQResponse::ZMQ_REP_OK) {
+    if (++failure_count_ >= kFailoverFailures) {
+      Failover();
+    }
+    return;
+  }
+  // The master was replaced by its standby, or is the standby.
+  if (body.error_code() == kErrorNotPrimary ||
+      (body.has_term() && body.term() < master_term_)) {
+    rep->error_code_ = base::ZMQResponse::ZMQ_REP_ERROR;
+    Failover();
+    return;
+  }
+  master_term_ = std::max(master_term_, body.term());
+  failure_count_ = 0;
+  failover_time_ = 0;
+  if (body.has_replication()) {
+    const int64 acked_seq = body.replication().acked_seq();
+    for (auto iter = unconfirmed_.begin(); iter != unconfirmed_.end();) {
+      if (iter->second.seq >= 0 && iter->second.seq <= acked_seq) {
+        iter = unconfirmed_.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+  }
+}
+
+void DPEWorkerNode::Failover() {
+  const int64 current_time = base::Time::Now().ToInternalValue();
+  if (failover_time_ == 0) {
+    failover_time_ = current_time;
+  } else if (current_time - failover_time_ > kFailoverTimeout) {
+    LOG(ERROR) << "No master is available.";
+    unconfirmed_.clear();
+    MarkShardDone(0);
+    MaybeExit();
+    return;
+  }
+  failure_count_ = 0;
+  active_master_ = (active_master_ + 1) % master_address_.size();
+  server_address_[0] = master_address_[active_master_];
+  LOG(WARNING) << "Switch to the master " << server_address_[0];
+
+  if (!running_task_.empty()) {
+    ClaimTaskRequest* claim_task = new ClaimTaskRequest();
+    for (auto task_id : running_task_) {
+      claim_task->add_task_id(task_id);
+    }
+    Request request;
+    request.set_name("claim_task");
+    request.set_allocated_claim_task(claim_task);
+    SendRequest(0, request,
+                base::Bind(&dpe::DPEWorkerNode::HandleClaimTask, this), 5000);
+  }
+  // The master ignores the results it already has.
+  for (auto& iter : unconfirmed_) {
+    iter.second.seq = -1;
+    Request request;
+    request.set_name("finish_compute");
+    request.set_job(iter.second.job);
+    *request.mutable_finish_compute() = iter.second.finish_compute;
+    ++finishing_count_;
+    SendRequest(0, request,
+                base::Bind(&dpe::DPEWorkerNode::HandleFinishCompute, this, 0,
+                           false, iter.first),
+                10000);
+  }
+}
+
+int DPEWorkerNode::SendRequest(int shard, Request& req,
+                               base::ZMQCallBack callback, int timeout) {
   req.set_worker_id(my_ip_);
   req.set_request_timestamp(base::Time::Now().ToInternalValue());
+  if (shard == 0 && master_term_ > 0) {
+    req.set_term(master_term_);
+  }
 
   std::string val;
   req.SerializeToString(&val);
 
   VLOG(1) << "Send request:\n" << req.DebugString();
 
-  zmq_client_->SendRequest(server_address_, val.c_str(),
+  zmq_client_->SendRequest(server_address_[shard], val.c_str(),
                            static_cast<int>(val.size()),
                            base::Bind(&DPEWorkerNode::HandleResponse,
-                                      weakptr_factory_.GetWeakPtr(), callback),
+                                      weakptr_factory_.GetWeakPtr(),
+                                      server_address_[shard], callback),
                            timeout);
 
   return 0;
 }
 
 void DPEWorkerNode::HandleResponse(base::WeakPtr<DPEWorkerNode> self,
+                                   std::string address,
                                    base::ZMQCallBack callback,
                                    scoped_refptr<base::ZMQResponse> rep) {
   if (auto* pThis = self.get()) {
     Response body;
     body.ParseFromString(rep->data_);
     VLOG(1) << "HandleResponse:\n" << body.DebugString();
+    pThis->CheckMasterResponse(address, rep.get(), body);
+    // The standby refuses the requests until it takes over.
+    if (rep->error_code_ == base::ZMQResponse::ZMQ_REP_OK &&
+        body.error_code() == kErrorNotPrimary) {
+      rep->error_code_ = base::ZMQResponse::ZMQ_REP_ERROR;
+    }
+    if (body.has_broadcast_address() && pThis->broadcast_) {
+      pThis->broadcast_->Subscribe(body.broadcast_address());
+    }
     callback.Run(rep);
   }
 }
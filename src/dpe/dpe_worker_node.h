@@ -1,48 +1,303 @@
 #ifndef DPE_WORKER_NODE_H_
 #define DPE_WORKER_NODE_H_
 
+#include <atomic>
+#include <deque>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 
+#include "dpe/broadcast_channel.h"
+#include "dpe/cancel_flag.h"
+#include "dpe/dpe_internal.h"
+#include "dpe/global_bound.h"
 #include "dpe/http_server.h"
+#include "dpe/memo_client.h"
 #include "dpe/proto/dpe.pb.h"
+#include "dpe/result_combiner.h"
+#include "dpe/task_executor.h"
 
 namespace dpe {
 
+// The payloads of a batch, they are passed from the computing thread to the
+// UI thread without copying.
+class PayloadBatch : public base::RefCountedThreadSafe<PayloadBatch> {
+ public:
+  PayloadBatch() {}
+
+  std::vector<std::string> payload;
+
+ private:
+  friend class base::RefCountedThreadSafe<PayloadBatch>;
+  ~PayloadBatch() {}
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadBatch);
+};
+
+// The shard and the job a batch comes from, the job is empty unless the
+// master runs several jobs.
+struct TaskSource {
+  int shard;
+  std::string job;
+};
+
+// A batch in the executor. If the solver splits the batches, its tasks may
+// run on different threads and every task writes its own entries.
+class RunningBatch : public base::RefCountedThreadSafe<RunningBatch> {
+ public:
+  RunningBatch() : solver(NULL), total_time(0) {}
+
+  TaskSource source;
+  Solver* solver;
+  std::vector<int64> tasks;
+  // An empty checkpoint starts the task from scratch.
+  std::vector<std::string> checkpoints;
+  std::vector<int64> result;
+  std::vector<int64> time_usage;
+  // NULL if the solver has no payload.
+  scoped_refptr<PayloadBatch> payloads;
+  // The remaining tasks are skipped when it is set.
+  scoped_refptr<CancelFlagValue> cancel;
+  // The sum of the time of the tasks, as if the batch ran on one thread.
+  std::atomic<int64> total_time;
+
+ private:
+  friend class base::RefCountedThreadSafe<RunningBatch>;
+  ~RunningBatch() {}
+
+  DISALLOW_COPY_AND_ASSIGN(RunningBatch);
+};
+
+// A task of a job, the jobs may have the same task ids.
+typedef std::pair<std::string, int64> JobTaskId;
+
+// A worker fetches tasks from the shard masters round-robin, the tasks of a
+// shard are reported and returned to the same shard. The tasks of a job are
+// computed by the solver of the job.
 class DPEWorkerNode : public base::RefCounted<DPEWorkerNode> {
  public:
-  DPEWorkerNode(const std::string& my_ip, const std::string& server_ip,
-                int serverPort);
+  // |masters| are the primary and the standby of a single master, the worker
+  // switches to the other one when the master is lost.
+  DPEWorkerNode(const std::string& my_ip,
+                const std::vector<ServerAddress>& servers,
+                const std::vector<ServerAddress>& masters);
   ~DPEWorkerNode();
 
   bool Start();
   void Stop();
+  // Returns the prefetched tasks to the master and exits when the running
+  // tasks are reported.
+  void Shutdown();
 
+  GetTaskRequest* NewGetTaskRequest(int suggested_size);
   void GetNextTask(int suggested_size);
-  void HandleGetTask(scoped_refptr<base::ZMQResponse> response);
-  void HandleFinishCompute(int suggested_size,
+  void HandleGetTask(int shard, scoped_refptr<base::ZMQResponse> response);
+  void RetryGetTask();
+  // |has_get_task| is true if the request carries a get_task. |result_id|
+  // is the key of the results in unconfirmed_, or -1.
+  void HandleFinishCompute(int shard, bool has_get_task, int64 result_id,
                            scoped_refptr<base::ZMQResponse> response);
+  void ReturnTasks(const TaskSource& source, const std::vector<int64>& tasks);
+  void HandleReturnTask(scoped_refptr<base::ZMQResponse> response);
 
+  // Computes the |index|-th task of |batch| on a computing thread.
   static void ExecuteTask(base::WeakPtr<DPEWorkerNode> self,
-                          std::vector<int64> tasks);
+                          scoped_refptr<RunningBatch> batch, int index);
+  // Computes all the tasks of |batch| on a computing thread, the batch is a
+  // single task of the executor and |index| is 0.
+  static void ExecuteBatch(base::WeakPtr<DPEWorkerNode> self,
+                           scoped_refptr<RunningBatch> batch, int index);
+  // Called on the computing thread which finishes the last task of |batch|.
+  static void FinishExecuteBatch(base::WeakPtr<DPEWorkerNode> self,
+                                 scoped_refptr<RunningBatch> batch);
   static void FinishExecuteTask(base::WeakPtr<DPEWorkerNode> self,
-                                std::vector<int64> tasks,
+                                TaskSource source, std::vector<int64> tasks,
                                 std::vector<int64> result,
                                 std::vector<int64> time_usage,
-                                int64 total_time);
-  void FinishExecuteTaskImpl(std::vector<int64> tasks,
+                                int64 total_time,
+                                scoped_refptr<PayloadBatch> payloads);
+  void FinishExecuteTaskImpl(const TaskSource& source,
+                             std::vector<int64> tasks,
                              std::vector<int64> result,
-                             std::vector<int64> time_usage, int64 total_time);
+                             std::vector<int64> time_usage, int64 total_time,
+                             scoped_refptr<PayloadBatch> payloads);
+  // Sends the results of a batch, with a get_task if more tasks are needed.
+  void SendFinishCompute(const TaskSource& source, FinishComputeRequest* fr);
+  // Uploads the payloads of a batch in chunks, one request at a time, and
+  // sends its finish_compute after the last chunk.
+  void SendNextPayloadChunk(int upload_id);
+  void HandlePutPayload(int upload_id,
+                        scoped_refptr<base::ZMQResponse> response);
+
+  // Called on the computing thread when a task saves a checkpoint.
+  static void SaveCheckpoint(base::WeakPtr<DPEWorkerNode> self,
+                             TaskSource source, int64 task_id,
+                             std::string data);
+  // Sends the latest checkpoint of a task, one request of a task is in
+  // flight at a time and the checkpoints saved meanwhile are coalesced.
+  void SendCheckpoint(const JobTaskId& task);
+  void HandleCheckpoint(JobTaskId task,
+                        scoped_refptr<base::ZMQResponse> response);
 
-  int SendRequest(Request& req, base::ZMQCallBack callback, int timeout);
+  // Sends a heartbeat to the masters of the running tasks, which renews
+  // their leases, and to a master with a standby, so a lost master is found
+  // while the tasks are running.
+  void SendHeartbeat();
+  void HandleHeartbeat(scoped_refptr<base::ZMQResponse> response);
+  void HandleClaimTask(scoped_refptr<base::ZMQResponse> response);
+  // Takes the global bound and the cancel broadcast by the master.
+  void HandleBroadcast(const Broadcast& message);
+  // Abandons the tasks of a job completed by the master.
+  void CancelJob(const std::string& name);
+  // Sends a memo request of a job to the first shard, |fetch| is NULL if
+  // the reply is not waited for.
+  void SendMemo(const std::string& job, const MemoRequest& memo,
+                scoped_refptr<MemoFetch> fetch);
+  void HandleMemo(scoped_refptr<MemoFetch> fetch,
+                  scoped_refptr<base::ZMQResponse> response);
 
+  int SendRequest(int shard, Request& req, base::ZMQCallBack callback,
+                  int timeout);
+
+  // |address| is the master the request is sent to.
   static void HandleResponse(base::WeakPtr<DPEWorkerNode> self,
-                             base::ZMQCallBack callback,
+                             std::string address, base::ZMQCallBack callback,
                              scoped_refptr<base::ZMQResponse> rep);
 
  private:
+  // Requests batches until the idle threads and the prefetch queue are
+  // covered.
+  void FillPipeline();
+  bool NeedMoreTasks() const;
+  // Starts the prefetched batches and fills the pipeline.
+  void DispatchTasks();
+  // Starts the prefetched batches on the idle threads.
+  void StartPrefetchedTasks();
+  void MaybeExit();
+  // Returns the next shard which has more tasks, or -1.
+  int NextShard();
+  void MarkShardDone(int shard);
+  // Counts a failed request to |shard|, returns true if the shard failed
+  // kMaxShardFailures times in a row and is given up.
+  bool ShardFailed(int shard);
+
+  bool CanFailover() const { return master_address_.size() > 1; }
+  // Drops the results the standby has, and switches to the other master if
+  // the active one fails kFailoverFailures times in a row or refuses the
+  // requests. A reply of a lower term than the one seen is refused.
+  void CheckMasterResponse(const std::string& address, base::ZMQResponse* rep,
+                           const Response& body);
+  // Claims the running and the prefetched tasks and sends the unconfirmed
+  // results again.
+  void Failover();
+
+  // The solver of a job and what it supports.
+  struct WorkerJob {
+    Solver* solver;
+    // Folds the results of a batch if the solver has a combiner.
+    ResultCombiner combiner;
+    // The solver produces variable-length results.
+    bool has_payload;
+    int64 payload_size_hint;
+    // The tasks save checkpoints.
+    bool has_checkpoint;
+    // The tasks of a batch are computed one by one, see
+    // Solver::SplitBatches.
+    bool split_batches;
+    // NULL if the job has no bound.
+    scoped_refptr<GlobalBoundValue> bound;
+    // NULL if the job always runs all the tasks.
+    scoped_refptr<CancelFlagValue> cancel;
+    // NULL if the job does not use the memo store.
+    scoped_refptr<MemoClient> memo;
+  };
+
+  // Returns the job of |name|, its solver is initialized the first time.
+  // Returns NULL if the job is not registered.
+  const WorkerJob* GetJob(const std::string& name);
+
+  struct TaskBatch {
+    TaskSource source;
+    std::vector<int64> tasks;
+    // Empty if no task of the batch has a checkpoint.
+    std::vector<std::string> checkpoints;
+  };
+
+  struct PendingCheckpoint {
+    int shard;
+    std::string data;
+  };
+
+  // The results sent to a master with a standby, they are sent again after a
+  // failover until the standby has them.
+  struct UnconfirmedResult {
+    std::string job;
+    FinishComputeRequest finish_compute;
+    // The sequence number of the replication stream after the results, or -1
+    // if the master has not replied.
+    int64 seq;
+  };
+
+  struct PayloadUpload {
+    TaskSource source;
+    FinishComputeRequest finish_compute;
+    std::vector<int64> task_id;
+    scoped_refptr<PayloadBatch> payloads;
+    // The next byte to send.
+    size_t task_index;
+    int64 offset;
+  };
+
   std::string my_ip_;
+  // The number of batches in the executor.
   int running_task_count_;
-  std::string server_address_;
+  // The number of batches the executor takes besides the running ones, a
+  // batch per thread.
+  int idle_thread_count_;
+  // The number of get_task, finish_compute and return_task requests in
+  // flight.
+  int fetching_count_;
+  int finishing_count_;
+  int returning_count_;
+  // All the shards have no more task.
+  bool no_more_task_;
+  bool shutting_down_;
+  bool exiting_;
+  int suggested_size_;
+  std::deque<TaskBatch> prefetched_;
+  std::map<std::string, WorkerJob> jobs_;
+  std::map<int, PayloadUpload> uploads_;
+  int next_upload_id_;
+  // The checkpoints not sent yet.
+  std::map<JobTaskId, PendingCheckpoint> pending_checkpoint_;
+  // The tasks whose checkpoint is being sent.
+  std::set<JobTaskId> sending_checkpoint_;
+  // The addresses of the shard masters, a single master is a shard.
+  std::vector<std::string> server_address_;
+  std::vector<bool> shard_done_;
+  // The failed requests in a row of the shards.
+  std::vector<int> shard_failures_;
+  int next_shard_;
+  // The primary and the standby of the master, empty if there is no standby.
+  std::vector<std::string> master_address_;
+  int active_master_;
+  // When the active master failed, 0 if it works.
+  int64 failover_time_;
+  // The requests to the active master failed in a row.
+  int failure_count_;
+  // The highest term of the masters, the requests carry it.
+  int64 master_term_;
+  // The tasks received and not reported.
+  std::set<int64> running_task_;
+  // The tasks in the executor -> their shards, the heartbeats renew their
+  // leases.
+  std::map<JobTaskId, int> executing_task_;
+  std::map<int64, UnconfirmedResult> unconfirmed_;
+  int64 next_result_id_;
+  scoped_refptr<base::RepeatedAction> heartbeat_timer_;
+  scoped_refptr<BroadcastChannel> broadcast_;
+  scoped_refptr<TaskExecutor> executor_;
   base::ZMQClient* zmq_client_;
   base::WeakPtrFactory<DPEWorkerNode> weakptr_factory_;
 };
@@ -0,0 +1,22 @@
+#include "dpe/global_bound.h"
+
+namespace dpe {
+GlobalBoundValue::GlobalBoundValue(int type, int64 initial)
+    : type_(type), value_(initial) {}
+
+int64 GlobalBoundValue::value() const {
+  return value_.load(std::memory_order_relaxed);
+}
+
+void GlobalBoundValue::Improve(int64 value) {
+  int64 current = value_.load(std::memory_order_relaxed);
+  while (IsBetter(value, current) &&
+         !value_.compare_exchange_weak(current, value,
+                                       std::memory_order_relaxed)) {
+  }
+}
+
+bool GlobalBoundValue::IsBetter(int64 value, int64 other) const {
+  return type_ == Solver::kMaxBound ? value > other : value < other;
+}
+}  // namespace dpe
@@ -0,0 +1,34 @@
+#ifndef DPE_GLOBAL_BOUND_H_
+#define DPE_GLOBAL_BOUND_H_
+
+#include <atomic>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe/dpe.h"
+
+namespace dpe {
+// The bound of a job on the master or a worker. The computing threads read
+// and improve it without a lock.
+class GlobalBoundValue : public GlobalBound,
+                         public base::RefCountedThreadSafe<GlobalBoundValue> {
+ public:
+  // |type| is Solver::kMinBound or Solver::kMaxBound.
+  GlobalBoundValue(int type, int64 initial);
+
+  int64 value() const override;
+  void Improve(int64 value) override;
+
+  // Returns true if |value| is better than |other|.
+  bool IsBetter(int64 value, int64 other) const;
+
+ private:
+  friend class base::RefCountedThreadSafe<GlobalBoundValue>;
+  ~GlobalBoundValue() override {}
+
+  const int type_;
+  std::atomic<int64> value_;
+
+  DISALLOW_COPY_AND_ASSIGN(GlobalBoundValue);
+};
+}  // namespace dpe
+#endif
@@ -0,0 +1,71 @@
+#include "dpe/memo_cache.h"
+
+namespace dpe {
+const int64 MemoCache::kEntryOverhead;
+
+MemoCache::MemoCache(int64 capacity) : capacity_(capacity), bytes_(0) {}
+
+MemoCache::~MemoCache() {}
+
+bool MemoCache::Find(int64 key, std::string* value) {
+  base::AutoLock lock(lock_);
+  auto where = index_.find(key);
+  if (where == index_.end()) {
+    return false;
+  }
+  entries_.splice(entries_.begin(), entries_, where->second);
+  *value = where->second->second;
+  return true;
+}
+
+void MemoCache::Put(int64 key, const std::string& value) {
+  base::AutoLock lock(lock_);
+  auto where = index_.find(key);
+  if (where != index_.end()) {
+    bytes_ -= static_cast<int64>(where->second->second.size());
+    bytes_ += static_cast<int64>(value.size());
+    where->second->second = value;
+    entries_.splice(entries_.begin(), entries_, where->second);
+  } else {
+    entries_.push_front(std::make_pair(key, value));
+    index_[key] = entries_.begin();
+    bytes_ += static_cast<int64>(value.size()) + kEntryOverhead;
+  }
+  EvictLocked();
+}
+
+int64 MemoCache::size() const {
+  base::AutoLock lock(lock_);
+  return static_cast<int64>(index_.size());
+}
+
+int64 MemoCache::bytes() const {
+  base::AutoLock lock(lock_);
+  return bytes_;
+}
+
+void MemoCache::EvictLocked() {
+  // The value just put is kept even if it is larger than the capacity.
+  while (bytes_ > capacity_ && entries_.size() > 1) {
+    const auto& last = entries_.back();
+    bytes_ -= static_cast<int64>(last.second.size()) + kEntryOverhead;
+    index_.erase(last.first);
+    entries_.pop_back();
+  }
+}
+
+void HandleMemoRequest(MemoCache* cache, const MemoRequest& request,
+                       MemoResponse* response) {
+  for (auto& item : request.put()) {
+    cache->Put(item.key(), item.value());
+  }
+  std::string value;
+  for (auto key : request.get_key()) {
+    if (cache->Find(key, &value)) {
+      MemoItem* item = response->add_item();
+      item->set_key(key);
+      item->set_value(value);
+    }
+  }
+}
+}  // namespace dpe
@@ -0,0 +1,51 @@
+#ifndef DPE_MEMO_CACHE_H_
+#define DPE_MEMO_CACHE_H_
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe/proto/dpe.pb.h"
+
+namespace dpe {
+// A least recently used cache of the memo values, the values are evicted
+// when their bytes (with kEntryOverhead per value) exceed the capacity. It
+// is used by the master, the aggregators and the workers, and may be called
+// on any thread.
+class MemoCache {
+ public:
+  // The memory used by a value besides its bytes.
+  static const int64 kEntryOverhead = 64;
+
+  explicit MemoCache(int64 capacity);
+  ~MemoCache();
+
+  // Returns false if |key| is not cached.
+  bool Find(int64 key, std::string* value);
+  void Put(int64 key, const std::string& value);
+
+  int64 size() const;
+  int64 bytes() const;
+
+ private:
+  typedef std::list<std::pair<int64, std::string>> EntryList;
+
+  void EvictLocked();
+
+  const int64 capacity_;
+  mutable base::Lock lock_;
+  // The most recently used entry comes first.
+  EntryList entries_;
+  std::unordered_map<int64, EntryList::iterator> index_;
+  int64 bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoCache);
+};
+
+// Serves a memo request of a worker from |cache|.
+void HandleMemoRequest(MemoCache* cache, const MemoRequest& request,
+                       MemoResponse* response);
+}  // namespace dpe
+#endif
@@ -0,0 +1,140 @@
+#include "dpe/memo_client.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+namespace dpe {
+// A computing thread waits at most kFetchTimeout for the master, the keys
+// are missed if it does not reply.
+static const int64 kFetchTimeout = 5 * 1000;
+// The puts within kFlushDelay milliseconds are sent in a single request.
+static const int64 kFlushDelay = 20;
+
+MemoFetch::MemoFetch() : done_(true, false) {}
+
+void MemoFetch::Done(const MemoResponse* response) {
+  if (response) {
+    response_ = *response;
+  }
+  done_.Signal();
+}
+
+bool MemoFetch::Wait(const base::TimeDelta& timeout, MemoResponse* response) {
+  if (!done_.TimedWait(timeout)) {
+    return false;
+  }
+  response->Swap(&response_);
+  return true;
+}
+
+MemoClient::MemoClient(const Sender& sender, int64 capacity)
+    : sender_(sender), cache_(capacity), flush_scheduled_(false) {}
+
+void MemoClient::Get(int size, const int64* keys, int64* values,
+                     bool* found) {
+  std::vector<int64> key_list(keys, keys + size);
+  std::vector<std::string> value_list;
+  std::vector<bool> found_list;
+  Lookup(key_list, &value_list, &found_list);
+  for (int i = 0; i < size; ++i) {
+    found[i] = found_list[i] && value_list[i].size() == sizeof(int64);
+    if (found[i]) {
+      memcpy(&values[i], value_list[i].data(), sizeof(int64));
+    }
+  }
+}
+
+void MemoClient::Put(int size, const int64* keys, const int64* values) {
+  for (int i = 0; i < size; ++i) {
+    const std::string value(reinterpret_cast<const char*>(&values[i]),
+                            sizeof(int64));
+    cache_.Put(keys[i], value);
+    AddPut(keys[i], value);
+  }
+}
+
+bool MemoClient::GetBytes(int64 key, PayloadWriter* value) {
+  std::vector<int64> key_list(1, key);
+  std::vector<std::string> value_list;
+  std::vector<bool> found_list;
+  Lookup(key_list, &value_list, &found_list);
+  if (!found_list[0]) {
+    return false;
+  }
+  value->Write(value_list[0].data(), value_list[0].size());
+  return true;
+}
+
+void MemoClient::PutBytes(int64 key, const void* data, int64 size) {
+  const std::string value(static_cast<const char*>(data),
+                          static_cast<size_t>(std::max<int64>(size, 0)));
+  cache_.Put(key, value);
+  AddPut(key, value);
+}
+
+void MemoClient::Lookup(const std::vector<int64>& keys,
+                        std::vector<std::string>* values,
+                        std::vector<bool>* found) {
+  values->assign(keys.size(), std::string());
+  found->assign(keys.size(), false);
+  MemoRequest request;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (cache_.Find(keys[i], &(*values)[i])) {
+      (*found)[i] = true;
+    } else {
+      request.add_get_key(keys[i]);
+    }
+  }
+  if (request.get_key_size() == 0) {
+    return;
+  }
+
+  scoped_refptr<MemoFetch> fetch = new MemoFetch();
+  base::ThreadPool::PostTask(base::ThreadPool::UI, FROM_HERE,
+                             base::Bind(sender_, request, fetch));
+  MemoResponse response;
+  if (!fetch->Wait(base::TimeDelta::FromMilliseconds(kFetchTimeout),
+                   &response)) {
+    LOG(WARNING) << "Memo request timed out, " << request.get_key_size()
+                 << " keys are missed.";
+    return;
+  }
+  std::map<int64, const std::string*> fetched;
+  for (auto& item : response.item()) {
+    cache_.Put(item.key(), item.value());
+    fetched[item.key()] = &item.value();
+  }
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto where = fetched.find(keys[i]);
+    if (!(*found)[i] && where != fetched.end()) {
+      (*values)[i] = *where->second;
+      (*found)[i] = true;
+    }
+  }
+}
+
+void MemoClient::AddPut(int64 key, const std::string& value) {
+  base::AutoLock lock(put_lock_);
+  MemoItem* item = pending_put_.add_put();
+  item->set_key(key);
+  item->set_value(value);
+  if (!flush_scheduled_) {
+    flush_scheduled_ = true;
+    base::ThreadPool::PostDelayedTask(
+        base::ThreadPool::UI, FROM_HERE,
+        base::Bind(&MemoClient::FlushPuts, this),
+        base::TimeDelta::FromMilliseconds(kFlushDelay));
+  }
+}
+
+void MemoClient::FlushPuts() {
+  MemoRequest request;
+  {
+    base::AutoLock lock(put_lock_);
+    request.Swap(&pending_put_);
+    flush_scheduled_ = false;
+  }
+  sender_.Run(request, NULL);
+}
+}  // namespace dpe
@@ -0,0 +1,76 @@
+#ifndef DPE_MEMO_CLIENT_H_
+#define DPE_MEMO_CLIENT_H_
+
+#include <string>
+#include <vector>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe/dpe.h"
+#include "dpe/memo_cache.h"
+#include "dpe/proto/dpe.pb.h"
+
+namespace dpe {
+// A memo request waited for by a computing thread.
+class MemoFetch : public base::RefCountedThreadSafe<MemoFetch> {
+ public:
+  MemoFetch();
+
+  // Called on the UI thread, |response| is NULL if the request failed.
+  void Done(const MemoResponse* response);
+  // Returns false if the reply does not come in |timeout|.
+  bool Wait(const base::TimeDelta& timeout, MemoResponse* response);
+
+ private:
+  friend class base::RefCountedThreadSafe<MemoFetch>;
+  ~MemoFetch() {}
+
+  base::WaitableEvent done_;
+  MemoResponse response_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoFetch);
+};
+
+// The memo store of a job on a worker.
+//
+// The values are looked up in the local cache first, the misses of a Get are
+// fetched from the master in a single request and cached. The puts are
+// cached and buffered, the puts within kFlushDelay share a request. The
+// requests are sent by the worker on the UI thread.
+class MemoClient : public MemoStore,
+                   public base::RefCountedThreadSafe<MemoClient> {
+ public:
+  // Sends |request| on the UI thread, |fetch| is NULL if the reply is not
+  // waited for.
+  typedef base::Callback<void(const MemoRequest& request,
+                              scoped_refptr<MemoFetch> fetch)> Sender;
+
+  // |capacity| is the memory of the local cache in bytes.
+  MemoClient(const Sender& sender, int64 capacity);
+
+  void Get(int size, const int64* keys, int64* values, bool* found) override;
+  void Put(int size, const int64* keys, const int64* values) override;
+  bool GetBytes(int64 key, PayloadWriter* value) override;
+  void PutBytes(int64 key, const void* data, int64 size) override;
+
+ private:
+  friend class base::RefCountedThreadSafe<MemoClient>;
+  ~MemoClient() override {}
+
+  // Looks up |keys| in the local cache and fetches the misses, values[i] is
+  // empty if keys[i] is not found.
+  void Lookup(const std::vector<int64>& keys,
+              std::vector<std::string>* values, std::vector<bool>* found);
+  void AddPut(int64 key, const std::string& value);
+  // Sends the buffered puts on the UI thread.
+  void FlushPuts();
+
+  Sender sender_;
+  MemoCache cache_;
+  base::Lock put_lock_;
+  MemoRequest pending_put_;
+  bool flush_scheduled_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoClient);
+};
+}  // namespace dpe
+#endif
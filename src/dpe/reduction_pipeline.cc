@@ -0,0 +1,151 @@
+#include "dpe/reduction_pipeline.h"
+
+#include <algorithm>
+
+namespace dpe {
+// The batches are split into kMaxBatchSize results.
+static const int kMaxBatchSize = 65536;
+
+ReductionPipeline::ReductionPipeline(Solver* solver, int thread_number,
+                                     int64 max_queued_results)
+    : solver_(solver),
+      thread_number_(thread_number),
+      max_queued_results_(max_queued_results),
+      not_empty_(&lock_),
+      queued_results_(0),
+      closed_(false),
+      reduced_(false) {}
+
+ReductionPipeline::~ReductionPipeline() {
+  // The master stopped before all the tasks were done, the partials are
+  // dropped.
+  {
+    base::AutoLock lock(lock_);
+    closed_ = true;
+    queue_.clear();
+    not_empty_.Broadcast();
+  }
+  JoinThreads();
+  if (!reduced_) {
+    DeletePartials();
+  }
+}
+
+bool ReductionPipeline::Start() {
+  for (int i = 0; i < thread_number_; ++i) {
+    void* partial = solver_->NewPartial();
+    if (!partial) {
+      DeletePartials();
+      return false;
+    }
+    reducers_.push_back(new Reducer(this, partial));
+  }
+  for (int i = 0; i < thread_number_; ++i) {
+    threads_.push_back(
+        new base::DelegateSimpleThread(reducers_[i], "DpeReducer"));
+    threads_.back()->Start();
+  }
+  return true;
+}
+
+void ReductionPipeline::Push(int size, const int64* task_id,
+                             const int64* result, const int64* time_usage) {
+  // A large batch, e.g. the loaded results, is shared by the reducers.
+  for (int first = 0; first < size; first += kMaxBatchSize) {
+    const int last = std::min(size, first + kMaxBatchSize);
+    Batch batch;
+    batch.task_id.assign(task_id + first, task_id + last);
+    batch.result.assign(result + first, result + last);
+    batch.time_usage.assign(time_usage + first, time_usage + last);
+
+    base::AutoLock lock(lock_);
+    if (closed_) {
+      return;
+    }
+    queued_results_ += last - first;
+    queue_.push_back(Batch());
+    queue_.back().task_id.swap(batch.task_id);
+    queue_.back().result.swap(batch.result);
+    queue_.back().time_usage.swap(batch.time_usage);
+    not_empty_.Signal();
+  }
+}
+
+int64 ReductionPipeline::queued_results() {
+  base::AutoLock lock(lock_);
+  return queued_results_;
+}
+
+bool ReductionPipeline::IsFull() {
+  base::AutoLock lock(lock_);
+  return queued_results_ >= max_queued_results_;
+}
+
+bool ReductionPipeline::PopBatch(Batch* batch) {
+  base::AutoLock lock(lock_);
+  while (queue_.empty() && !closed_) {
+    not_empty_.Wait();
+  }
+  if (queue_.empty()) {
+    return false;
+  }
+  batch->task_id.swap(queue_.front().task_id);
+  batch->result.swap(queue_.front().result);
+  batch->time_usage.swap(queue_.front().time_usage);
+  queue_.pop_front();
+  queued_results_ -= batch->task_id.size();
+  return true;
+}
+
+void ReductionPipeline::Reducer::Run() {
+  Batch batch;
+  while (pipeline_->PopBatch(&batch)) {
+    const int size = static_cast<int>(batch.task_id.size());
+    pipeline_->solver_->Combine(partial_, size, batch.task_id.data(),
+                                batch.result.data(), batch.time_usage.data());
+  }
+}
+
+void ReductionPipeline::Finish(const base::Closure& callback) {
+  {
+    base::AutoLock lock(lock_);
+    closed_ = true;
+    not_empty_.Broadcast();
+  }
+  base::ThreadPool::PostBlockingPoolTask(
+      FROM_HERE,
+      base::Bind(&ReductionPipeline::JoinAndMerge, this, callback));
+}
+
+void ReductionPipeline::JoinThreads() {
+  for (auto* thread : threads_) {
+    if (thread->HasBeenStarted() && !thread->HasBeenJoined()) {
+      thread->Join();
+    }
+  }
+}
+
+void ReductionPipeline::DeletePartials() {
+  for (auto* reducer : reducers_) {
+    solver_->DeletePartial(reducer->partial());
+  }
+  reducers_.clear();
+}
+
+void ReductionPipeline::JoinAndMerge(const base::Closure& callback) {
+  // The reducers exit after the queue is drained.
+  JoinThreads();
+
+  if (!reducers_.empty()) {
+    void* partial = reducers_[0]->partial();
+    for (size_t i = 1; i < reducers_.size(); ++i) {
+      solver_->Merge(partial, reducers_[i]->partial());
+    }
+    solver_->SetReducedResult(partial);
+  }
+  reduced_ = true;
+  LOG(INFO) << "Reduced the results on " << reducers_.size() << " threads.";
+
+  base::ThreadPool::PostTask(base::ThreadPool::UI, FROM_HERE, callback);
+}
+}  // namespace dpe
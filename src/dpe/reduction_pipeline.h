@@ -0,0 +1,91 @@
+#ifndef DPE_REDUCTION_PIPELINE_H_
+#define DPE_REDUCTION_PIPELINE_H_
+
+#include <deque>
+#include <vector>
+
+#include "dpe_base/dpe_base.h"
+#include "third_party/chromium/base/synchronization/condition_variable.h"
+#include "third_party/chromium/base/threading/simple_thread.h"
+#include "dpe/dpe.h"
+
+namespace dpe {
+// Reduces the task results off the UI thread of the master.
+//
+// The results are pushed into a queue and consumed by the reducer threads.
+// Every reducer thread folds its batches into its own partial by
+// Solver::Combine, so the reducers never share a partial. Finish waits for
+// the queue on the blocking pool, merges the partials by Solver::Merge and
+// hands the merged one to Solver::SetReducedResult.
+class ReductionPipeline : public base::RefCountedThreadSafe<ReductionPipeline> {
+ public:
+  ReductionPipeline(Solver* solver, int thread_number,
+                    int64 max_queued_results);
+
+  // Returns false if the solver does not support the reduction.
+  bool Start();
+
+  // Never blocks the caller, which runs on the UI thread. The caller stops
+  // producing results while the queue is full, e.g. the master hands out no
+  // task, so that a reduction much slower than the workers does not exhaust
+  // the memory.
+  void Push(int size, const int64* task_id, const int64* result,
+            const int64* time_usage);
+  // There are max_queued_results results in the queue.
+  bool IsFull();
+
+  // Reduces the queued results and runs |callback| on the UI thread after
+  // SetReducedResult. Nothing can be pushed after it.
+  void Finish(const base::Closure& callback);
+
+  int64 queued_results();
+
+ private:
+  friend class base::RefCountedThreadSafe<ReductionPipeline>;
+  ~ReductionPipeline();
+
+  struct Batch {
+    std::vector<int64> task_id;
+    std::vector<int64> result;
+    std::vector<int64> time_usage;
+  };
+
+  class Reducer : public base::DelegateSimpleThread::Delegate {
+   public:
+    Reducer(ReductionPipeline* pipeline, void* partial)
+        : pipeline_(pipeline), partial_(partial) {}
+    void Run() override;
+    void* partial() const { return partial_; }
+
+   private:
+    ReductionPipeline* pipeline_;
+    void* partial_;
+    DISALLOW_COPY_AND_ASSIGN(Reducer);
+  };
+
+  // Returns false if the queue is closed and empty.
+  bool PopBatch(Batch* batch);
+  // Runs on the blocking pool.
+  void JoinAndMerge(const base::Closure& callback);
+  void JoinThreads();
+  void DeletePartials();
+
+  Solver* solver_;
+  const int thread_number_;
+  const int64 max_queued_results_;
+
+  base::Lock lock_;
+  base::ConditionVariable not_empty_;
+  std::deque<Batch> queue_;
+  int64 queued_results_;
+  bool closed_;
+  // SetReducedResult owns the partials.
+  bool reduced_;
+
+  ScopedVector<Reducer> reducers_;
+  ScopedVector<base::DelegateSimpleThread> threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReductionPipeline);
+};
+}  // namespace dpe
+#endif
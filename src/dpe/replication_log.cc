@@ -0,0 +1,59 @@
+#include "dpe/replication_log.h"
+
+#include <algorithm>
+
+namespace dpe {
+ReplicationLog::ReplicationLog() : epoch_(0), base_seq_(0) {}
+
+ReplicationLog::~ReplicationLog() {}
+
+void ReplicationLog::Start() {
+  base_seq_ = next_seq();
+  records_.clear();
+  // The sequence numbers go on, so an old standby never matches by chance.
+  epoch_ = std::max(base::Time::Now().ToInternalValue(), epoch_ + 1);
+}
+
+void ReplicationLog::Stop() {
+  base_seq_ = next_seq();
+  records_.clear();
+  epoch_ = 0;
+}
+
+void ReplicationLog::Append(int type, const char* data, int size) {
+  if (!active()) {
+    return;
+  }
+  records_.push_back(Record());
+  records_.back().type = type;
+  records_.back().data.assign(data, static_cast<size_t>(std::max(size, 0)));
+}
+
+bool ReplicationLog::Ack(int64 seq) {
+  if (!active() || seq < base_seq_ || seq > next_seq()) {
+    return false;
+  }
+  while (base_seq_ < seq) {
+    records_.pop_front();
+    ++base_seq_;
+  }
+  return true;
+}
+
+void ReplicationLog::Read(int64 seq, int64 max_bytes,
+                          ReplicateResponse* response) const {
+  int64 bytes = 0;
+  for (int64 i = std::max(seq, base_seq_); i < next_seq(); ++i) {
+    const Record& record = records_[static_cast<size_t>(i - base_seq_)];
+    if (bytes > 0 && bytes + static_cast<int64>(record.data.size()) >
+                         max_bytes) {
+      break;
+    }
+    ReplicationRecord* item = response->add_record();
+    item->set_seq(i);
+    item->set_type(record.type);
+    item->set_data(record.data);
+    bytes += record.data.size();
+  }
+}
+}  // namespace dpe
@@ -0,0 +1,65 @@
+#ifndef DPE_REPLICATION_LOG_H_
+#define DPE_REPLICATION_LOG_H_
+
+#include <deque>
+#include <string>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe/dpe.h"
+#include "dpe/proto/dpe.pb.h"
+
+namespace dpe {
+// The replication stream of the primary master, pulled by its standby.
+//
+// A record has a sequence number, a type and a payload. The records of the
+// task log keep their TaskLog::RecordType, the other types only exist in the
+// stream. The records are kept in memory until the standby acknowledges
+// them by asking for a later one. Start begins a new stream with a new
+// epoch, a standby following another epoch copies the task table again.
+class ReplicationLog {
+ public:
+  enum RecordType {
+    // Payload: int64 task_id[n], the tasks which may be handed out.
+    RECORD_RESERVE = 101,
+    // Payload: int64 task_id, the checkpoint of the task.
+    RECORD_CHECKPOINT = 102,
+  };
+
+  ReplicationLog();
+  ~ReplicationLog();
+
+  // Drops the records and starts a new epoch.
+  void Start();
+  void Stop();
+
+  bool active() const { return epoch_ != 0; }
+  // 0 if the stream is not active.
+  int64 epoch() const { return epoch_; }
+  // The sequence number of the next record.
+  int64 next_seq() const { return base_seq_ + records_.size(); }
+  // The records before it are applied by the standby.
+  int64 acked_seq() const { return base_seq_; }
+
+  // It is ignored if the stream is not active.
+  void Append(int type, const char* data, int size);
+  // Drops the records before |seq|. Returns false if |seq| is not in the
+  // stream.
+  bool Ack(int64 seq);
+  // Adds the records from |seq| of at most |max_bytes| bytes (at least one
+  // record) to |response|.
+  void Read(int64 seq, int64 max_bytes, ReplicateResponse* response) const;
+
+ private:
+  struct Record {
+    int type;
+    std::string data;
+  };
+
+  int64 epoch_;
+  int64 base_seq_;
+  std::deque<Record> records_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReplicationLog);
+};
+}  // namespace dpe
+#endif
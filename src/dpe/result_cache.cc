@@ -0,0 +1,75 @@
+#include "dpe/result_cache.h"
+
+namespace dpe {
+// The log of a key is compacted when it exceeds kCompactCacheSize bytes.
+static const int64 kCompactCacheSize = 64 * 1024 * 1024;
+
+ResultCache::ResultCache(const std::string& dir, int64 version, int64 params)
+    : dir_(dir) {
+  log_ = new TaskLog(dir + "\\" +
+                     std::to_string(static_cast<uint64_t>(version)) + "-" +
+                     std::to_string(static_cast<uint64_t>(params)));
+}
+
+ResultCache::~ResultCache() { Close(); }
+
+bool ResultCache::Open() {
+  if (!base::CreateDirectory(base::FilePath(base::UTF8ToNative(dir_)))) {
+    LOG(ERROR) << "Cannot create result cache directory: " << dir_;
+    return false;
+  }
+  results_.clear();
+  log_->Replay([this](int type, const char* data, int size) {
+    if (type != TaskLog::RECORD_TASK_RESULT) {
+      return;
+    }
+    auto* records = reinterpret_cast<const TaskLog::TaskResultRecord*>(data);
+    const int n = size / sizeof(TaskLog::TaskResultRecord);
+    for (int i = 0; i < n; ++i) {
+      Entry& entry = results_[records[i].task_id];
+      entry.result = records[i].result;
+      entry.time_usage = records[i].time_usage;
+    }
+  });
+  if (!log_->Open(false)) {
+    LOG(ERROR) << "Cannot open result cache in " << dir_;
+    results_.clear();
+    return false;
+  }
+  return true;
+}
+
+void ResultCache::Close() {
+  log_->Close();
+}
+
+bool ResultCache::Find(int64 task_id, int64* result,
+                       int64* time_usage) const {
+  auto where = results_.find(task_id);
+  if (where == results_.end()) {
+    return false;
+  }
+  *result = where->second.result;
+  *time_usage = where->second.time_usage;
+  return true;
+}
+
+void ResultCache::Add(int size, const int64* task_id, const int64* result,
+                      const int64* time_usage) {
+  for (int i = 0; i < size; ++i) {
+    Entry& entry = results_[task_id[i]];
+    entry.result = result[i];
+    entry.time_usage = time_usage[i];
+  }
+  if (size > 0) {
+    log_->AppendTaskResults(size, task_id, result, time_usage);
+  }
+}
+
+void ResultCache::Sync() {
+  log_->Sync();
+  if (log_->log_size() > kCompactCacheSize) {
+    log_->Compact();
+  }
+}
+}  // namespace dpe
@@ -0,0 +1,52 @@
+#ifndef DPE_RESULT_CACHE_H_
+#define DPE_RESULT_CACHE_H_
+
+#include <string>
+#include <unordered_map>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe/dpe.h"
+#include "dpe/task_log.h"
+
+namespace dpe {
+// The task results shared by the runs of a solver.
+//
+// The results are keyed by the version of the compute function and the hash
+// of the parameters from Solver::GetResultCacheKey, the results of a key are
+// kept in the task log <dir>\<version>-<params> (.log and .snapshot). All the
+// results are loaded in memory when the cache is opened, the master looks up
+// a task before handing it out and adds the results computed in the run.
+class ResultCache {
+ public:
+  // |dir| is the full path of the cache directory.
+  ResultCache(const std::string& dir, int64 version, int64 params);
+  ~ResultCache();
+
+  // Loads the cached results and opens the log for the new results.
+  // Returns false if the cache is not available.
+  bool Open();
+  void Close();
+
+  // Returns false if |task_id| is not cached.
+  bool Find(int64 task_id, int64* result, int64* time_usage) const;
+  void Add(int size, const int64* task_id, const int64* result,
+           const int64* time_usage);
+  // Writes the added results, the log is compacted when it is large.
+  void Sync();
+
+  int64 size() const { return static_cast<int64>(results_.size()); }
+
+ private:
+  struct Entry {
+    int64 result;
+    int64 time_usage;
+  };
+
+  std::string dir_;
+  scoped_refptr<TaskLog> log_;
+  std::unordered_map<int64, Entry> results_;
+
+  DISALLOW_COPY_AND_ASSIGN(ResultCache);
+};
+}  // namespace dpe
+#endif
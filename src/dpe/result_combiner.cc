@@ -0,0 +1,96 @@
+#include "dpe/result_combiner.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "dpe_base/dpe_base.h"
+
+namespace dpe {
+// Adds the 128-bit value (lo, hi) to |value|.
+static void AddInt128(int64* value, uint64_t lo, uint64_t hi) {
+  const uint64_t sum = static_cast<uint64_t>(value[0]) + lo;
+  const uint64_t carry = sum < lo ? 1 : 0;
+  value[0] = static_cast<int64>(sum);
+  value[1] = static_cast<int64>(static_cast<uint64_t>(value[1]) + hi + carry);
+}
+
+ResultCombiner::ResultCombiner(Solver* solver)
+    : solver_(solver), type_(Solver::kNoCombiner), modulus_(0) {
+  type_ = solver->GetCombiner(&modulus_);
+  if (type_ < Solver::kNoCombiner || type_ > Solver::kCombineUser) {
+    LOG(ERROR) << "Unknown combiner: " << type_;
+    type_ = Solver::kNoCombiner;
+  } else if (type_ == Solver::kCombineSumMod && modulus_ <= 0) {
+    LOG(ERROR) << "Invalid modulus of kCombineSumMod: " << modulus_;
+    type_ = Solver::kNoCombiner;
+  }
+}
+
+void ResultCombiner::Init(int64* value) const {
+  value[1] = 0;
+  switch (type_) {
+    case Solver::kCombineMin:
+      value[0] = std::numeric_limits<int64>::max();
+      break;
+    case Solver::kCombineMax:
+      value[0] = std::numeric_limits<int64>::min();
+      break;
+    case Solver::kCombineUser:
+      value[0] = 0;
+      solver_->InitCombinedValue(value);
+      break;
+    default:
+      value[0] = 0;
+      break;
+  }
+}
+
+void ResultCombiner::Add(int64* value, int64 result) const {
+  switch (type_) {
+    case Solver::kCombineSumMod: {
+      int64 r = result % modulus_;
+      if (r < 0) {
+        r += modulus_;
+      }
+      // Both are less than 2^63.
+      uint64_t sum = static_cast<uint64_t>(value[0]) + r;
+      if (sum >= static_cast<uint64_t>(modulus_)) {
+        sum -= modulus_;
+      }
+      value[0] = static_cast<int64>(sum);
+      break;
+    }
+    case Solver::kCombineXor:
+      value[0] ^= result;
+      break;
+    case Solver::kCombineMin:
+      value[0] = std::min(value[0], result);
+      break;
+    case Solver::kCombineMax:
+      value[0] = std::max(value[0], result);
+      break;
+    case Solver::kCombineSum128:
+      AddInt128(value, static_cast<uint64_t>(result), result < 0 ? ~0ULL : 0);
+      break;
+    case Solver::kCombineUser:
+      solver_->CombineValue(value, result);
+      break;
+  }
+}
+
+void ResultCombiner::Merge(int64* value, const int64* other) const {
+  switch (type_) {
+    case Solver::kCombineSum128:
+      AddInt128(value, static_cast<uint64_t>(other[0]),
+                static_cast<uint64_t>(other[1]));
+      break;
+    case Solver::kCombineUser:
+      solver_->MergeCombinedValue(value, other);
+      break;
+    default:
+      // The other built-in combined values are results themselves.
+      Add(value, other[0]);
+      break;
+  }
+}
+}  // namespace dpe
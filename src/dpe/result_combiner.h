@@ -0,0 +1,28 @@
+#ifndef DPE_RESULT_COMBINER_H_
+#define DPE_RESULT_COMBINER_H_
+
+#include "dpe/dpe.h"
+
+namespace dpe {
+// Folds the task results by the combiner declared by Solver::GetCombiner.
+// A combined value is int64[2], see Solver::kCombineSum128.
+class ResultCombiner {
+ public:
+  // Reads the combiner of |solver|, an invalid combiner is disabled.
+  explicit ResultCombiner(Solver* solver);
+
+  bool enabled() const { return type_ != Solver::kNoCombiner; }
+  int type() const { return type_; }
+
+  // Sets |value| to the identity.
+  void Init(int64* value) const;
+  void Add(int64* value, int64 result) const;
+  void Merge(int64* value, const int64* other) const;
+
+ private:
+  Solver* solver_;
+  int type_;
+  int64 modulus_;
+};
+}  // namespace dpe
+#endif
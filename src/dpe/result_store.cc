@@ -0,0 +1,276 @@
+#include "dpe/result_store.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace dpe {
+static const char kResultMagic[8] = {'D', 'P', 'E', 'R', 'E', 'S', 'L', 'T'};
+
+// The file grows by at least kMinGrowth bytes and at most kMaxGrowth bytes
+// beyond the requested size.
+static const int64 kMinGrowth = 16 * 1024 * 1024;
+static const int64 kMaxGrowth = 1024 * 1024 * 1024;
+// A freed record is reused for a payload of at least half of its size.
+static const int64 kMaxReuseFactor = 2;
+
+#pragma pack(push, 8)
+struct ResultStore::FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t fingerprint;
+  // The end of the last record.
+  int64 data_size;
+};
+
+struct ResultStore::RecordHeader {
+  int64 task_id;
+  int64 size;
+  uint32_t checksum;
+  // 1 if the checksum is set.
+  uint32_t sealed;
+};
+#pragma pack(pop)
+
+static inline int64 RecordSize(int64 payload_size) {
+  return 24 + ((payload_size + 7) & ~7LL);
+}
+
+static inline uint32_t PayloadChecksum(const char* data, int64 size) {
+  return base::Hash(data, static_cast<size_t>(size));
+}
+
+ResultStore::ResultStore(const std::string& path)
+    : path_(base::UTF8ToNative(path)),
+      mapping_(NULL),
+      view_(NULL),
+      view_size_(0),
+      header_(NULL) {}
+
+ResultStore::~ResultStore() { Close(); }
+
+bool ResultStore::Open(uint64_t fingerprint) {
+  Close();
+  file_.Initialize(path_, base::File::FLAG_OPEN | base::File::FLAG_READ |
+                              base::File::FLAG_WRITE);
+  if (!file_.IsValid()) {
+    return false;
+  }
+
+  const int64 length = file_.GetLength();
+  if (length < kHeaderSize || !EnsureCapacity(length)) {
+    Close();
+    return false;
+  }
+
+  if (memcmp(header_->magic, kResultMagic, sizeof(kResultMagic)) != 0 ||
+      header_->version != kVersion || header_->fingerprint != fingerprint ||
+      header_->data_size < kHeaderSize || header_->data_size > length) {
+    LOG(WARNING) << "Invalid result store: " << path_.AsUTF8Unsafe();
+    Close();
+    return false;
+  }
+  return true;
+}
+
+bool ResultStore::Create(uint64_t fingerprint, int64 capacity) {
+  Close();
+  file_.Initialize(path_, base::File::FLAG_CREATE_ALWAYS |
+                              base::File::FLAG_READ |
+                              base::File::FLAG_WRITE);
+  if (!file_.IsValid() ||
+      !EnsureCapacity(kHeaderSize + std::max<int64>(capacity, 0))) {
+    LOG(ERROR) << "Cannot create result store: " << path_.AsUTF8Unsafe();
+    Close();
+    return false;
+  }
+
+  memcpy(header_->magic, kResultMagic, sizeof(kResultMagic));
+  header_->version = kVersion;
+  header_->reserved = 0;
+  header_->fingerprint = fingerprint;
+  header_->data_size = kHeaderSize;
+  return true;
+}
+
+void ResultStore::Close() {
+  if (view_) {
+    UnmapViewOfFile(view_);
+    view_ = NULL;
+  }
+  if (mapping_) {
+    CloseHandle(mapping_);
+    mapping_ = NULL;
+  }
+  view_size_ = 0;
+  header_ = NULL;
+  free_records_.clear();
+  file_.Close();
+}
+
+bool ResultStore::EnsureCapacity(int64 size) {
+  if (size <= view_size_) {
+    return true;
+  }
+  if (view_size_ > 0) {
+    size += std::min(std::max(view_size_, kMinGrowth), kMaxGrowth);
+  }
+  // The file grows to |size| if it is shorter.
+  HANDLE mapping = CreateFileMapping(
+      file_.GetPlatformFile(), NULL, PAGE_READWRITE,
+      static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), NULL);
+  if (!mapping) {
+    LOG(ERROR) << "CreateFileMapping failed, size = " << size
+               << ", error = " << GetLastError();
+    return false;
+  }
+  void* view = MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0,
+                             static_cast<SIZE_T>(size));
+  if (!view) {
+    LOG(ERROR) << "MapViewOfFile failed, size = " << size
+               << ", error = " << GetLastError();
+    CloseHandle(mapping);
+    return false;
+  }
+  if (view_) {
+    FlushViewOfFile(view_, 0);
+    UnmapViewOfFile(view_);
+  }
+  if (mapping_) {
+    CloseHandle(mapping_);
+  }
+  mapping_ = mapping;
+  view_ = static_cast<char*>(view);
+  view_size_ = size;
+  header_ = reinterpret_cast<FileHeader*>(view_);
+  return true;
+}
+
+int64 ResultStore::Allocate(int64 task_id, int64 size) {
+  if (!header_ || size < 0) {
+    return -1;
+  }
+  const int64 record_size = RecordSize(size);
+  auto free_record = free_records_.lower_bound(record_size);
+  if (free_record != free_records_.end() &&
+      free_record->first <= kMaxReuseFactor * record_size) {
+    const int64 offset = free_record->second;
+    free_records_.erase(free_record);
+    auto* record = reinterpret_cast<RecordHeader*>(view_ + offset);
+    record->task_id = task_id;
+    record->size = size;
+    record->checksum = 0;
+    record->sealed = 0;
+    return offset;
+  }
+  const int64 offset = header_->data_size;
+  if (!EnsureCapacity(offset + RecordSize(size))) {
+    return -1;
+  }
+  auto* record = reinterpret_cast<RecordHeader*>(view_ + offset);
+  record->task_id = task_id;
+  record->size = size;
+  record->checksum = 0;
+  record->sealed = 0;
+  header_->data_size = offset + record_size;
+  return offset;
+}
+
+bool ResultStore::Write(int64 offset, int64 position, const char* data,
+                        int64 size) {
+  const RecordHeader* record = FindRecord(offset);
+  if (!record || position < 0 || size < 0 || position + size > record->size) {
+    return false;
+  }
+  memcpy(view_ + offset + sizeof(RecordHeader) + position, data,
+         static_cast<size_t>(size));
+  return true;
+}
+
+bool ResultStore::Read(int64 offset, int64 task_id, const char** data,
+                       int64* size) const {
+  const RecordHeader* record = FindRecord(offset);
+  if (!record || record->task_id != task_id) {
+    return false;
+  }
+  if (data) {
+    *data = reinterpret_cast<const char*>(record + 1);
+  }
+  if (size) {
+    *size = record->size;
+  }
+  return true;
+}
+
+void ResultStore::Seal(int64 offset) {
+  RecordHeader* record = FindRecord(offset);
+  if (!record) {
+    return;
+  }
+  record->checksum = PayloadChecksum(
+      reinterpret_cast<const char*>(record + 1), record->size);
+  record->sealed = 1;
+}
+
+bool ResultStore::Verify(int64 offset, int64 task_id) const {
+  const RecordHeader* record = FindRecord(offset);
+  return record && record->task_id == task_id && record->sealed == 1 &&
+         record->checksum ==
+             PayloadChecksum(reinterpret_cast<const char*>(record + 1),
+                             record->size);
+}
+
+void ResultStore::Free(int64 offset) {
+  RecordHeader* record = FindRecord(offset);
+  if (!record) {
+    return;
+  }
+  const int64 record_size = RecordSize(record->size);
+  // A stale offset never reads the payload of the next owner.
+  record->task_id = -1;
+  record->sealed = 0;
+  if (offset + record_size == header_->data_size) {
+    header_->data_size = offset;
+    return;
+  }
+  free_records_.insert(std::make_pair(record_size, offset));
+}
+
+const ResultStore::RecordHeader* ResultStore::FindRecord(int64 offset) const {
+  if (!header_ || offset < kHeaderSize || (offset & 7) != 0 ||
+      offset + static_cast<int64>(sizeof(RecordHeader)) > header_->data_size) {
+    return NULL;
+  }
+  auto* record = reinterpret_cast<const RecordHeader*>(view_ + offset);
+  if (record->size < 0 ||
+      record->size > header_->data_size - offset - RecordSize(0)) {
+    return NULL;
+  }
+  return record;
+}
+
+bool ResultStore::Sync() {
+  if (!view_ || !FlushViewOfFile(view_, 0)) {
+    return false;
+  }
+  return file_.Flush();
+}
+
+int64 ResultStoreView::size() const { return table_->size(); }
+
+int64 ResultStoreView::task_id(int64 i) const { return table_->TaskId(i); }
+
+const char* ResultStoreView::data(int64 i) const {
+  const char* data = NULL;
+  return store_->Read(table_->result(i), table_->TaskId(i), &data, NULL)
+             ? data
+             : NULL;
+}
+
+int64 ResultStoreView::length(int64 i) const {
+  int64 size = 0;
+  return store_->Read(table_->result(i), table_->TaskId(i), NULL, &size)
+             ? size
+             : 0;
+}
+}  // namespace dpe
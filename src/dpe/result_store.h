@@ -0,0 +1,114 @@
+#ifndef DPE_RESULT_STORE_H_
+#define DPE_RESULT_STORE_H_
+
+#include <windows.h>
+
+#include <map>
+#include <string>
+
+#include "dpe_base/dpe_base.h"
+#include "third_party/chromium/base/files/file.h"
+#include "dpe/dpe.h"
+#include "dpe/task_table.h"
+
+namespace dpe {
+// A memory mapped file of the variable-length task results.
+//
+// The file starts with a kHeaderSize bytes header followed by the records, a
+// record is the task id, the payload size, the checksum of the payload and
+// the payload padded to 8 bytes. A record is reserved when the first chunk
+// of its payload arrives and the chunks are copied into it, the offset of
+// the record is kept as the result of the task in the task table, so the
+// task log and the task state file index the records. The file is mapped as
+// a single view which is replaced when the file grows.
+//
+// The file is flushed less often than the task log, so a complete payload
+// is sealed with its checksum and a record is only trusted on restart if
+// the checksum matches. The records of the abandoned uploads are reused
+// until the file is closed.
+//
+// The header binds the file to the fingerprint of the task set.
+class ResultStore {
+ public:
+  static const uint32_t kVersion = 2;
+
+  // |path| is the full path of the file.
+  explicit ResultStore(const std::string& path);
+  ~ResultStore();
+
+  // Opens an existing file bound to |fingerprint|.
+  bool Open(uint64_t fingerprint);
+  // Discards the content of the file, |capacity| bytes are reserved for the
+  // records.
+  bool Create(uint64_t fingerprint, int64 capacity);
+  void Close();
+
+  bool IsValid() const { return header_ != NULL; }
+
+  // Reserves the record of a |size| bytes payload of |task_id|. Returns the
+  // offset of the record or -1.
+  int64 Allocate(int64 task_id, int64 size);
+  // Copies |size| bytes to |position| of the payload of the record at
+  // |offset|.
+  bool Write(int64 offset, int64 position, const char* data, int64 size);
+  // Returns false if there is no record of |task_id| at |offset|.
+  bool Read(int64 offset, int64 task_id, const char** data,
+            int64* size) const;
+  // Stores the checksum of the complete payload of the record at |offset|.
+  void Seal(int64 offset);
+  // Returns true if the record of |task_id| at |offset| is sealed and its
+  // payload matches the checksum.
+  bool Verify(int64 offset, int64 task_id) const;
+  // Releases the record at |offset| of an abandoned upload, a later
+  // Allocate may reuse it.
+  void Free(int64 offset);
+
+  bool Sync();
+
+ private:
+  struct FileHeader;
+  struct RecordHeader;
+
+  static const int64 kHeaderSize = 4096;
+
+  // Makes the view cover at least |size| bytes of the file.
+  bool EnsureCapacity(int64 size);
+  const RecordHeader* FindRecord(int64 offset) const;
+  RecordHeader* FindRecord(int64 offset) {
+    return const_cast<RecordHeader*>(
+        static_cast<const ResultStore*>(this)->FindRecord(offset));
+  }
+
+  base::FilePath path_;
+  base::File file_;
+  HANDLE mapping_;
+  char* view_;
+  int64 view_size_;
+  FileHeader* header_;
+  // The size of a freed record -> its offset.
+  std::multimap<int64, int64> free_records_;
+
+  DISALLOW_COPY_AND_ASSIGN(ResultStore);
+};
+
+// The payloads of the tasks of |table| in |store|, all the tasks are
+// expected to be DONE.
+class ResultStoreView : public PayloadView {
+ public:
+  ResultStoreView(const ResultStore* store, const TaskTable* table)
+      : store_(store), table_(table) {}
+  ~ResultStoreView() override {}
+
+  int64 size() const override;
+  int64 task_id(int64 i) const override;
+  const char* data(int64 i) const override;
+  int64 length(int64 i) const override;
+
+ private:
+  const ResultStore* store_;
+  const TaskTable* table_;
+
+  DISALLOW_COPY_AND_ASSIGN(ResultStoreView);
+};
+}  // namespace dpe
+#endif
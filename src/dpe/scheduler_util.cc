@@ -0,0 +1,139 @@
+#include "dpe/scheduler_util.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe/dpe_internal.h"
+
+namespace dpe {
+// The lease of a task is kLeaseFactor times the expected time of the task
+// and it is at least kMinLeaseTime microseconds.
+static const int64 kLeaseFactor = 4;
+static const int64 kMinLeaseTime = 10 * 1000000LL;
+// The lease of a task expired n times is 2^min(n, kMaxLeaseShift) longer.
+static const int kMaxLeaseShift = 4;
+
+// The auto batch size: a batch takes at least kMinBatchTime microseconds and
+// kRoundTripRatio round trips, at most kMaxBatchSize tasks, and every thread
+// of the workers updated in kActiveWorkerTime gets kTailBatchCount batches.
+static const int64 kMinBatchTime = 1000000;
+static const int64 kRoundTripRatio = 20;
+static const int64 kMaxBatchSize = 10000;
+static const int64 kActiveWorkerTime = 300 * 1000000LL;
+static const int64 kTailBatchCount = 4;
+
+WorkerStatus& GetWorkerStatus(std::map<std::string, WorkerStatus>* workers,
+                              const std::string& worker_id) {
+  auto where = workers->find(worker_id);
+  if (where != workers->end()) {
+    return where->second;
+  }
+
+  WorkerStatus& worker = (*workers)[worker_id];
+  worker.set_worker_id(worker_id);
+  worker.set_latency_sum(0LL);
+  worker.set_request_count(0LL);
+  worker.set_updated_time(base::Time::Now().ToInternalValue());
+  return worker;
+}
+
+void UpdateRequestStats(WorkerStatus* worker, const Request& req,
+                        int64 current_time) {
+  worker->set_request_count(worker->request_count() + 1);
+  worker->set_latency_sum(worker->latency_sum() + current_time -
+                          req.request_timestamp());
+  worker->set_updated_time(current_time);
+}
+
+void UpdateComputeTime(WorkerStatus* worker, int size,
+                       int64 total_time_usage) {
+  if (size > 0 && total_time_usage > 0) {
+    worker->set_compute_time(
+        UpdateAverageTime(worker->compute_time(), total_time_usage / size));
+  }
+}
+
+int64 UpdateAverageTime(int64 average, int64 time) {
+  return average > 0 ? (average * 7 + time) / 8 : time;
+}
+
+int64 ComputeLeaseDeadline(int64 current_time, int64 expected_time,
+                           int expired_count) {
+  if (GetFlags().lease_timeout <= 0) {
+    return std::numeric_limits<int64>::max();
+  }
+  int64 lease = GetFlags().lease_timeout * 1000000LL;
+  if (expected_time > 0) {
+    lease = std::max(kMinLeaseTime, kLeaseFactor * expected_time);
+  }
+  lease <<= std::min(expired_count, kMaxLeaseShift);
+  return current_time + lease;
+}
+
+int64 ActiveThreadCount(const std::map<std::string, WorkerStatus>& workers,
+                        int64 current_time) {
+  int64 thread_count = 0;
+  for (auto& iter : workers) {
+    const auto& status = iter.second;
+    if (current_time - status.updated_time() < kActiveWorkerTime ||
+        status.running_task_size() > 0) {
+      thread_count += std::max(status.thread_number(), 1);
+    }
+  }
+  return thread_count;
+}
+
+int ComputeAutoBatchSize(const WorkerStatus& worker, int64 pending_count,
+                         int64 thread_count) {
+  // Probes the compute time with a single task.
+  if (worker.compute_time() <= 0) {
+    return 1;
+  }
+
+  // The round trip is at most 1 / kRoundTripRatio of the batch time.
+  const int64 latency =
+      worker.request_count() > 0
+          ? std::max<int64>(worker.latency_sum() / worker.request_count(), 0)
+          : 0;
+  int64 size = 2 * latency * kRoundTripRatio / worker.compute_time() + 1;
+  size = std::max(size, kMinBatchTime / worker.compute_time());
+
+  // Every active thread gets at least kTailBatchCount batches of the
+  // remaining tasks.
+  const int64 share =
+      pending_count / (std::max<int64>(thread_count, 1) * kTailBatchCount);
+  size = std::min<int64>(size, std::max<int64>(share, 1));
+  return static_cast<int>(std::max<int64>(std::min(size, kMaxBatchSize), 1));
+}
+
+void RemoveRunningTask(WorkerStatus* worker, const std::set<int64>& task_id) {
+  std::vector<int64> new_running_task;
+  for (auto& id : worker->running_task()) {
+    if (!task_id.count(id)) {
+      new_running_task.push_back(id);
+    }
+  }
+  worker->clear_running_task();
+  for (auto& id : new_running_task) {
+    worker->add_running_task(id);
+  }
+}
+
+std::vector<int> OrderJobs(const std::vector<JobShare>& jobs,
+                           bool fair_share) {
+  std::vector<int> order;
+  for (int i = 0; i < static_cast<int>(jobs.size()); ++i) {
+    order.push_back(i);
+  }
+  if (fair_share) {
+    // running_count[a] / weight[a] < running_count[b] / weight[b].
+    std::stable_sort(order.begin(), order.end(), [&jobs](int a, int b) {
+      return jobs[a].running_count * std::max(jobs[b].weight, 1) <
+             jobs[b].running_count * std::max(jobs[a].weight, 1);
+    });
+  }
+  return order;
+}
+}  // namespace dpe
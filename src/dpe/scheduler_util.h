@@ -0,0 +1,62 @@
+#ifndef DPE_SCHEDULER_UTIL_H_
+#define DPE_SCHEDULER_UTIL_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "dpe/dpe.h"
+#include "dpe/proto/dpe.pb.h"
+
+namespace dpe {
+// The scheduling helpers shared by the nodes handing out tasks, i.e. the
+// master and the aggregators.
+
+// Returns the worker of |worker_id|, it is created if it is not found.
+WorkerStatus& GetWorkerStatus(std::map<std::string, WorkerStatus>* workers,
+                              const std::string& worker_id);
+
+// Updates the request statistics of |worker| by a request.
+void UpdateRequestStats(WorkerStatus* worker, const Request& req,
+                        int64 current_time);
+
+// Updates the average compute time of a task of |worker| by a finished
+// batch.
+void UpdateComputeTime(WorkerStatus* worker, int size,
+                       int64 total_time_usage);
+
+// The exponential moving average of the task times.
+int64 UpdateAverageTime(int64 average, int64 time);
+
+// Returns the lease deadline of a task expected to take |expected_time|
+// microseconds (0 if unknown), whose lease expired |expired_count| times.
+int64 ComputeLeaseDeadline(int64 current_time, int64 expected_time,
+                           int expired_count);
+
+// Returns the number of threads of the workers updated recently or running
+// tasks.
+int64 ActiveThreadCount(const std::map<std::string, WorkerStatus>& workers,
+                        int64 current_time);
+
+// The batch size of a worker with auto_batch_size: a batch amortizes the
+// round trip, and every active thread gets a few batches of the
+// |pending_count| remaining tasks.
+int ComputeAutoBatchSize(const WorkerStatus& worker, int64 pending_count,
+                         int64 thread_count);
+
+void RemoveRunningTask(WorkerStatus* worker, const std::set<int64>& task_id);
+
+// The share of a job of a multi-job master.
+struct JobShare {
+  int weight;
+  int64 running_count;
+};
+
+// Returns the indexes of |jobs| in the order they are asked for tasks: the
+// job with the fewest running tasks per weight first if |fair_share| is
+// true, otherwise the order of |jobs|.
+std::vector<int> OrderJobs(const std::vector<JobShare>& jobs,
+                           bool fair_share);
+}  // namespace dpe
+#endif
@@ -0,0 +1,125 @@
+#include "dpe/task_executor.h"
+
+#include <algorithm>
+
+namespace dpe {
+// The tasks of a batch and the number of them not finished.
+class TaskExecutor::Batch : public base::RefCountedThreadSafe<Batch> {
+ public:
+  Batch(int size, const RunCallback& run, const base::Closure& done)
+      : run_(run), done_(done), remaining_(size) {}
+
+  void Run(int index) {
+    run_.Run(index);
+    // The last task sees the results written by the other threads.
+    if (remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      done_.Run();
+    }
+  }
+
+ private:
+  friend class base::RefCountedThreadSafe<Batch>;
+  ~Batch() {}
+
+  RunCallback run_;
+  base::Closure done_;
+  std::atomic<int> remaining_;
+
+  DISALLOW_COPY_AND_ASSIGN(Batch);
+};
+
+TaskExecutor::TaskExecutor(int thread_number)
+    : thread_number_(std::max(thread_number, 1)),
+      work_available_(&idle_lock_),
+      queued_(0),
+      stopping_(false) {
+  for (int i = 0; i < thread_number_; ++i) {
+    queues_.push_back(new TaskQueue());
+  }
+}
+
+TaskExecutor::~TaskExecutor() {}
+
+void TaskExecutor::Start() {
+  for (int i = 0; i < thread_number_; ++i) {
+    base::ThreadPool::GetBlockingPool()->PostTask(
+        FROM_HERE, base::Bind(&TaskExecutor::RunThread, this, i));
+  }
+}
+
+void TaskExecutor::Stop() {
+  base::AutoLock lock(idle_lock_);
+  stopping_ = true;
+  work_available_.Broadcast();
+}
+
+void TaskExecutor::Submit(int size, const RunCallback& run,
+                          const base::Closure& done) {
+  if (size <= 0) {
+    done.Run();
+    return;
+  }
+  // The batch goes to the thread with the fewest tasks, the other threads
+  // steal from it when they are idle.
+  int target = 0;
+  size_t fewest = 0;
+  for (int i = 0; i < thread_number_; ++i) {
+    base::AutoLock lock(queues_[i]->lock);
+    if (i == 0 || queues_[i]->items.size() < fewest) {
+      target = i;
+      fewest = queues_[i]->items.size();
+    }
+  }
+  scoped_refptr<Batch> batch = new Batch(size, run, done);
+  {
+    base::AutoLock lock(queues_[target]->lock);
+    for (int i = 0; i < size; ++i) {
+      Item item = {batch, i};
+      queues_[target]->items.push_back(item);
+    }
+  }
+  base::AutoLock lock(idle_lock_);
+  queued_ += size;
+  work_available_.Broadcast();
+}
+
+void TaskExecutor::RunThread(int index) {
+  while (!stopping_) {
+    Item item;
+    if (PopLocal(index, &item) || Steal(index, &item)) {
+      item.batch->Run(item.index);
+      continue;
+    }
+    base::AutoLock lock(idle_lock_);
+    while (queued_ == 0 && !stopping_) {
+      work_available_.Wait();
+    }
+  }
+}
+
+bool TaskExecutor::PopLocal(int index, Item* item) {
+  TaskQueue* queue = queues_[index];
+  base::AutoLock lock(queue->lock);
+  if (queue->items.empty()) {
+    return false;
+  }
+  *item = queue->items.front();
+  queue->items.pop_front();
+  --queued_;
+  return true;
+}
+
+bool TaskExecutor::Steal(int index, Item* item) {
+  for (int i = 1; i < thread_number_; ++i) {
+    TaskQueue* queue = queues_[(index + i) % thread_number_];
+    base::AutoLock lock(queue->lock);
+    if (!queue->items.empty()) {
+      *item = queue->items.back();
+      queue->items.pop_back();
+      --queued_;
+      return true;
+    }
+  }
+  return false;
+}
+}  // namespace dpe
@@ -0,0 +1,68 @@
+#ifndef DPE_TASK_EXECUTOR_H_
+#define DPE_TASK_EXECUTOR_H_
+
+#include <atomic>
+#include <deque>
+
+#include "dpe_base/dpe_base.h"
+#include "third_party/chromium/base/synchronization/condition_variable.h"
+
+namespace dpe {
+// Runs the tasks of the batches of a worker on a fixed set of computing
+// threads.
+//
+// Every thread has a deque of tasks. A batch is pushed to the deque with the
+// fewest tasks, the thread runs them from the front in order and an idle
+// thread steals a task from the back of another deque, so the tasks of a
+// batch with skewed costs are spread over the idle threads. A batch which
+// must run on one thread is submitted as a single task. The threads are
+// long-running tasks of the blocking pool.
+class TaskExecutor : public base::RefCountedThreadSafe<TaskExecutor> {
+ public:
+  // Runs the |index|-th task of a batch.
+  typedef base::Callback<void(int index)> RunCallback;
+
+  explicit TaskExecutor(int thread_number);
+
+  void Start();
+  // The threads exit after their running tasks, the queued tasks are
+  // dropped.
+  void Stop();
+
+  // Queues a batch of |size| tasks. |done| is called on the computing thread
+  // which finishes the last task, or at once if |size| is 0.
+  void Submit(int size, const RunCallback& run, const base::Closure& done);
+
+ private:
+  friend class base::RefCountedThreadSafe<TaskExecutor>;
+  ~TaskExecutor();
+
+  class Batch;
+  struct Item {
+    scoped_refptr<Batch> batch;
+    int index;
+  };
+  struct TaskQueue {
+    base::Lock lock;
+    std::deque<Item> items;
+  };
+
+  void RunThread(int index);
+  // Pops the front of the deque of thread |index|.
+  bool PopLocal(int index, Item* item);
+  // Pops the back of the first other deque which has tasks.
+  bool Steal(int index, Item* item);
+
+  const int thread_number_;
+  ScopedVector<TaskQueue> queues_;
+  // The idle threads wait for work_available_.
+  base::Lock idle_lock_;
+  base::ConditionVariable work_available_;
+  // The number of queued tasks, it is increased with idle_lock_ held.
+  std::atomic<int> queued_;
+  std::atomic<bool> stopping_;
+
+  DISALLOW_COPY_AND_ASSIGN(TaskExecutor);
+};
+}  // namespace dpe
+#endif
@@ -0,0 +1,95 @@
+#include "dpe/task_lease.h"
+
+#include <algorithm>
+
+namespace dpe {
+TaskLeaseTable::TaskLeaseTable(int64 tick)
+    : tick_(tick), current_tick_(-1), slots_(kSlotCount) {}
+
+void TaskLeaseTable::Clear() {
+  leases_.clear();
+  for (auto& slot : slots_) {
+    std::vector<std::pair<int64, int64>>().swap(slot);
+  }
+  current_tick_ = -1;
+}
+
+void TaskLeaseTable::AddToWheel(int64 index, int64 deadline) {
+  int64 tick = deadline / tick_;
+  if (current_tick_ >= 0 && tick <= current_tick_) {
+    tick = current_tick_ + 1;
+  }
+  slots_[tick % kSlotCount].push_back(std::make_pair(index, deadline));
+}
+
+void TaskLeaseTable::Grant(int64 index, const std::string& worker_id,
+                           int64 start_time, int64 deadline) {
+  if (current_tick_ < 0) {
+    current_tick_ = start_time / tick_ - 1;
+  }
+  Lease& lease = leases_[index];
+  lease.index = index;
+  lease.worker_id = worker_id;
+  lease.start_time = start_time;
+  lease.deadline = deadline;
+  AddToWheel(index, deadline);
+}
+
+const TaskLeaseTable::Lease* TaskLeaseTable::Find(int64 index) const {
+  auto where = leases_.find(index);
+  return where == leases_.end() ? NULL : &where->second;
+}
+
+bool TaskLeaseTable::Release(int64 index, Lease* lease) {
+  auto where = leases_.find(index);
+  if (where == leases_.end()) {
+    return false;
+  }
+  if (lease) {
+    *lease = where->second;
+  }
+  leases_.erase(where);
+  return true;
+}
+
+bool TaskLeaseTable::Renew(int64 index, const std::string& worker_id,
+                           int64 deadline) {
+  auto where = leases_.find(index);
+  if (where == leases_.end() || where->second.worker_id != worker_id) {
+    return false;
+  }
+  if (deadline > where->second.deadline) {
+    where->second.deadline = deadline;
+    AddToWheel(index, deadline);
+  }
+  return true;
+}
+
+void TaskLeaseTable::Expire(int64 now, std::vector<Lease>* expired) {
+  const int64 now_tick = now / tick_;
+  if (current_tick_ < 0) {
+    current_tick_ = now_tick - 1;
+  }
+  // Every slot is visited at most once.
+  int64 tick = std::max(current_tick_ + 1, now_tick - kSlotCount + 1);
+  for (; tick <= now_tick; ++tick) {
+    auto& slot = slots_[tick % kSlotCount];
+    size_t top = 0;
+    for (size_t i = 0; i < slot.size(); ++i) {
+      auto where = leases_.find(slot[i].first);
+      // Released or granted again.
+      if (where == leases_.end() || where->second.deadline != slot[i].second) {
+        continue;
+      }
+      if (slot[i].second <= now) {
+        expired->push_back(where->second);
+        leases_.erase(where);
+      } else {
+        slot[top++] = slot[i];
+      }
+    }
+    slot.resize(top);
+  }
+  current_tick_ = now_tick;
+}
+}  // namespace dpe
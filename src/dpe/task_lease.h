@@ -0,0 +1,61 @@
+#ifndef DPE_TASK_LEASE_H_
+#define DPE_TASK_LEASE_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dpe/dpe.h"
+
+namespace dpe {
+// The leases of the RUNNING tasks of the master.
+//
+// A lease is indexed by the task index of TaskTable and expires at its
+// deadline. The deadlines are kept in a hashed timer wheel of kSlotCount
+// slots of |tick| microseconds, a deadline further than a round stays in its
+// slot until its round comes. Released leases are removed from the wheel
+// lazily.
+class TaskLeaseTable {
+ public:
+  struct Lease {
+    int64 index;
+    std::string worker_id;
+    int64 start_time;
+    int64 deadline;
+  };
+
+  explicit TaskLeaseTable(int64 tick);
+
+  // Replaces the lease of |index| if there is one.
+  void Grant(int64 index, const std::string& worker_id, int64 start_time,
+             int64 deadline);
+  // Returns NULL if |index| has no lease.
+  const Lease* Find(int64 index) const;
+  // Returns false if |index| has no lease. |lease| may be NULL.
+  bool Release(int64 index, Lease* lease);
+  // Extends the lease of |index| held by |worker_id| to |deadline|, e.g. the
+  // worker reports the task is still running. Returns false if the worker
+  // has no lease of |index|.
+  bool Renew(int64 index, const std::string& worker_id, int64 deadline);
+  // Removes the leases expired at |now| and appends them to |expired|.
+  void Expire(int64 now, std::vector<Lease>* expired);
+
+  size_t size() const { return leases_.size(); }
+  const std::map<int64, Lease>& leases() const { return leases_; }
+  void Clear();
+
+ private:
+  static const int kSlotCount = 256;
+
+  void AddToWheel(int64 index, int64 deadline);
+
+  const int64 tick_;
+  // The last processed tick, -1 if the wheel is not started.
+  int64 current_tick_;
+  std::map<int64, Lease> leases_;
+  // (index, deadline) pairs.
+  std::vector<std::vector<std::pair<int64, int64>>> slots_;
+};
+}  // namespace dpe
+#endif
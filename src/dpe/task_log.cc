@@ -0,0 +1,572 @@
+#include "dpe/task_log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace dpe {
+static const char kLogMagic[] = "DPELOG02";
+static const int64 kMagicSize = 8;
+static const uint32_t kMaxRecordSize = 64 * 1024 * 1024;
+static const int64 kGroupCommitDelayMs = 20;
+static const int64 kSyncIntervalMs = 1000;
+// The number of TaskResultRecords in a snapshot record.
+static const int kSnapshotBlockSize = 65536;
+
+#pragma pack(push, 4)
+struct FileHeader {
+  char magic[kMagicSize];
+  int64 generation;
+};
+#pragma pack(pop)
+
+static const int64 kFileHeaderSize = sizeof(FileHeader);
+
+static inline std::string MakeFileHeader(int64 generation) {
+  FileHeader header;
+  memcpy(header.magic, kLogMagic, kMagicSize);
+  header.generation = generation;
+  return std::string(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+static inline uint32_t Checksum(int type, const char* data, size_t size) {
+  return base::Hash(data, size) ^ (static_cast<uint32_t>(type) * 0x9e3779b9U);
+}
+
+static inline std::string MakeRecord(int type, const void* data, int size) {
+  TaskLog::LogRecordHeader header;
+  header.type = static_cast<uint32_t>(type);
+  header.size = static_cast<uint32_t>(size);
+  header.checksum = Checksum(type, static_cast<const char*>(data), size);
+
+  std::string record;
+  record.reserve(sizeof(header) + size);
+  record.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  record.append(static_cast<const char*>(data), size);
+  return record;
+}
+
+namespace {
+// Reads a file sequentially through a buffer.
+class LogReader {
+ public:
+  explicit LogReader(base::File* file)
+      : file_(file), offset_(0), buffer_(1 << 20), begin_(0), end_(0) {}
+
+  bool Read(void* data, int size) {
+    char* dest = static_cast<char*>(data);
+    while (size > 0) {
+      if (begin_ == end_ && !Fill()) {
+        return false;
+      }
+      const int n = std::min(size, end_ - begin_);
+      memcpy(dest, &buffer_[begin_], n);
+      begin_ += n;
+      dest += n;
+      size -= n;
+    }
+    return true;
+  }
+
+ private:
+  bool Fill() {
+    const int n =
+        file_->Read(offset_, &buffer_[0], static_cast<int>(buffer_.size()));
+    if (n <= 0) {
+      return false;
+    }
+    offset_ += n;
+    begin_ = 0;
+    end_ = n;
+    return true;
+  }
+
+  base::File* file_;
+  int64 offset_;
+  std::vector<char> buffer_;
+  int begin_;
+  int end_;
+};
+}  // namespace
+
+TaskLog::TaskLog(const std::string& path)
+    : path_(path),
+      log_path_(base::UTF8ToNative(path + ".log")),
+      snapshot_path_(base::UTF8ToNative(path + ".snapshot")),
+      temp_snapshot_path_(base::UTF8ToNative(path + ".snapshot.tmp")),
+      write_scheduled_(false),
+      log_size_(0),
+      log_valid_size_(-1),
+      log_generation_(1),
+      snapshot_generation_(0),
+      snapshot_size_(0),
+      scanned_(false),
+      epoch_(0),
+      last_sync_time_(0),
+      sync_scheduled_(false),
+      compacting_(false) {}
+
+TaskLog::~TaskLog() {}
+
+base::FilePath TaskLog::SealedLogPath(int64 generation) const {
+  return base::FilePath(
+      base::UTF8ToNative(path_ + "." + std::to_string(generation) + ".log"));
+}
+
+int64 TaskLog::ReadGeneration(const base::FilePath& path) {
+  base::File file(path, base::File::FLAG_OPEN | base::File::FLAG_READ);
+  FileHeader header;
+  if (!file.IsValid() ||
+      file.Read(0, reinterpret_cast<char*>(&header), sizeof(header)) !=
+          static_cast<int>(sizeof(header)) ||
+      memcmp(header.magic, kLogMagic, kMagicSize) != 0) {
+    return -1;
+  }
+  return header.generation;
+}
+
+int64 TaskLog::ReplayFile(const base::FilePath& path, int64 min_generation,
+                          const ReplayCallback& callback, int64* generation,
+                          int64* count) {
+  base::File file(path, base::File::FLAG_OPEN | base::File::FLAG_READ);
+  if (!file.IsValid()) {
+    return 0;
+  }
+
+  LogReader reader(&file);
+  FileHeader file_header;
+  if (!reader.Read(&file_header, sizeof(file_header)) ||
+      memcmp(file_header.magic, kLogMagic, kMagicSize) != 0) {
+    LOG(ERROR) << "Invalid log file: " << path.AsUTF8Unsafe();
+    return 0;
+  }
+  if (generation) {
+    *generation = file_header.generation;
+  }
+  if (file_header.generation < min_generation) {
+    return 0;
+  }
+
+  int64 valid_size = kFileHeaderSize;
+  std::string payload;
+  for (;;) {
+    LogRecordHeader header;
+    if (!reader.Read(&header, sizeof(header))) {
+      break;
+    }
+    if (header.size > kMaxRecordSize) {
+      LOG(WARNING) << "Invalid record size in " << path.AsUTF8Unsafe();
+      break;
+    }
+    payload.resize(header.size);
+    if (header.size > 0 && !reader.Read(&payload[0], header.size)) {
+      LOG(WARNING) << "Truncated record in " << path.AsUTF8Unsafe();
+      break;
+    }
+    if (Checksum(header.type, payload.data(), header.size) !=
+        header.checksum) {
+      LOG(WARNING) << "Corrupted record in " << path.AsUTF8Unsafe();
+      break;
+    }
+    callback(header.type, payload.data(), header.size);
+    valid_size += sizeof(header) + header.size;
+    ++*count;
+  }
+  return valid_size;
+}
+
+int64 TaskLog::Replay(const ReplayCallback& callback) {
+  base::AutoLock lock(file_lock_);
+  int64 count = 0;
+  snapshot_generation_ = 0;
+  snapshot_size_ =
+      ReplayFile(snapshot_path_, 0, callback, &snapshot_generation_, &count);
+  if (snapshot_size_ == 0) {
+    snapshot_generation_ = 0;
+  }
+  // The sealed logs after the snapshot, the master stopped before their
+  // snapshot was written.
+  int64 generation = snapshot_generation_ + 1;
+  while (base::PathExists(SealedLogPath(generation))) {
+    ReplayFile(SealedLogPath(generation), 0, callback, NULL, &count);
+    ++generation;
+  }
+  // A log which is covered by the snapshot is recreated.
+  int64 log_generation = 0;
+  log_valid_size_ =
+      ReplayFile(log_path_, generation, callback, &log_generation, &count);
+  log_generation_ = log_valid_size_ > 0 ? log_generation : generation;
+  scanned_ = true;
+  return count;
+}
+
+void TaskLog::ScanFilesLocked() {
+  if (scanned_) {
+    return;
+  }
+  snapshot_generation_ = std::max<int64>(ReadGeneration(snapshot_path_), 0);
+  if (!base::GetFileSize(snapshot_path_, &snapshot_size_)) {
+    snapshot_size_ = 0;
+  }
+  int64 generation = snapshot_generation_ + 1;
+  while (base::PathExists(SealedLogPath(generation))) {
+    ++generation;
+  }
+  const int64 log_generation = ReadGeneration(log_path_);
+  if (log_generation >= generation) {
+    log_generation_ = log_generation;
+  } else {
+    log_generation_ = generation;
+    log_valid_size_ = 0;
+  }
+  scanned_ = true;
+}
+
+void TaskLog::DeleteSealedLogsLocked(int64 generation) {
+  // The sealed logs are deleted in ascending order, so the ones left by a
+  // crash end at |generation|.
+  int64 first = generation;
+  while (first > 0 && base::PathExists(SealedLogPath(first))) {
+    --first;
+  }
+  for (int64 i = first + 1; i <= generation; ++i) {
+    base::DeleteFile(SealedLogPath(i), false);
+  }
+}
+
+bool TaskLog::Open(bool truncate) {
+  base::AutoLock lock(file_lock_);
+  ScanFilesLocked();
+  if (truncate) {
+    // A snapshot being written is dropped, see WriteSnapshot.
+    ++epoch_;
+    DeleteSealedLogsLocked(log_generation_ - 1);
+    base::DeleteFile(snapshot_path_, false);
+    base::DeleteFile(temp_snapshot_path_, false);
+    // The generations go on, the next log covers no sealed log.
+    snapshot_generation_ = log_generation_ - 1;
+    snapshot_size_ = 0;
+  } else {
+    // The sealed logs covered by the snapshot, the master stopped before
+    // deleting them.
+    DeleteSealedLogsLocked(snapshot_generation_);
+  }
+  return OpenLogLocked(truncate);
+}
+
+bool TaskLog::OpenLogLocked(bool truncate) {
+  log_file_.Initialize(log_path_, base::File::FLAG_OPEN_ALWAYS |
+                                      base::File::FLAG_READ |
+                                      base::File::FLAG_WRITE);
+  if (!log_file_.IsValid()) {
+    LOG(ERROR) << "Cannot open log file: " << log_path_.AsUTF8Unsafe();
+    return false;
+  }
+
+  int64 size = truncate ? 0 : log_valid_size_;
+  if (size < 0) {
+    size = log_file_.GetLength();
+  }
+  if (size < kFileHeaderSize) {
+    const std::string header = MakeFileHeader(log_generation_);
+    log_file_.SetLength(0);
+    log_file_.Write(0, header.data(), static_cast<int>(header.size()));
+    size = kFileHeaderSize;
+  } else {
+    // Removes the truncated or corrupted tail.
+    log_file_.SetLength(size);
+  }
+  log_size_ = size;
+  log_valid_size_ = -1;
+  return true;
+}
+
+void TaskLog::Close() {
+  base::AutoLock lock(file_lock_);
+  WriteBufferedLocked(true);
+  log_file_.Close();
+}
+
+void TaskLog::Append(int type, const void* data, int size) {
+  if (!append_callback_.is_null()) {
+    append_callback_.Run(type, static_cast<const char*>(data), size);
+  }
+  const std::string record = MakeRecord(type, data, size);
+  bool schedule = false;
+  {
+    base::AutoLock lock(buffer_lock_);
+    buffer_.append(record);
+    if (!write_scheduled_) {
+      write_scheduled_ = true;
+      schedule = true;
+    }
+  }
+  if (schedule) {
+    base::ThreadPool::PostDelayedTask(
+        base::ThreadPool::FILE, FROM_HERE,
+        base::Bind(&TaskLog::WriteBuffered, make_scoped_refptr(this)),
+        base::TimeDelta::FromMilliseconds(kGroupCommitDelayMs));
+  }
+}
+
+void TaskLog::AppendTaskResults(int size, const int64* task_id,
+                                const int64* result, const int64* time_usage) {
+  if (size <= 0) {
+    return;
+  }
+  std::vector<TaskResultRecord> records(size);
+  for (int i = 0; i < size; ++i) {
+    records[i].task_id = task_id[i];
+    records[i].result = result[i];
+    records[i].time_usage = time_usage[i];
+  }
+  Append(RECORD_TASK_RESULT, &records[0], size * sizeof(TaskResultRecord));
+}
+
+void TaskLog::AppendTaskResults(const std::vector<TaskResultRecord>& records) {
+  const size_t block_size = kSnapshotBlockSize;
+  for (size_t i = 0; i < records.size(); i += block_size) {
+    const size_t n = std::min(records.size() - i, block_size);
+    Append(RECORD_TASK_RESULT, &records[i],
+           static_cast<int>(n * sizeof(TaskResultRecord)));
+  }
+}
+
+void TaskLog::AppendCombinedResult(const int64* value, int64 time_usage,
+                                   int size, const int64* task_id) {
+  if (size < 0) {
+    return;
+  }
+  CombinedResultRecord header = {{value[0], value[1]}, time_usage, size};
+  std::vector<char> payload(sizeof(header) + size * sizeof(int64));
+  memcpy(&payload[0], &header, sizeof(header));
+  if (size > 0) {
+    memcpy(&payload[sizeof(header)], task_id, size * sizeof(int64));
+  }
+  Append(RECORD_COMBINED_RESULT, &payload[0],
+         static_cast<int>(payload.size()));
+}
+
+void TaskLog::AppendStageTasks(int stage, int size, const int64* task_id) {
+  if (size <= 0) {
+    return;
+  }
+  StageTasksRecord header = {stage, size};
+  std::vector<char> payload(sizeof(header) + size * sizeof(int64));
+  memcpy(&payload[0], &header, sizeof(header));
+  memcpy(&payload[sizeof(header)], task_id, size * sizeof(int64));
+  Append(RECORD_STAGE_TASKS, &payload[0], static_cast<int>(payload.size()));
+}
+
+void TaskLog::AppendInjectedTasks(int priority, int size,
+                                  const int64* task_id) {
+  if (size <= 0) {
+    return;
+  }
+  InjectedTasksRecord header = {priority, size};
+  std::vector<char> payload(sizeof(header) + size * sizeof(int64));
+  memcpy(&payload[0], &header, sizeof(header));
+  memcpy(&payload[sizeof(header)], task_id, size * sizeof(int64));
+  Append(RECORD_INJECTED_TASKS, &payload[0],
+         static_cast<int>(payload.size()));
+}
+
+void TaskLog::AppendDoneTasks(const std::vector<DoneTaskRecord>& records) {
+  const size_t block_size = kSnapshotBlockSize;
+  for (size_t i = 0; i < records.size(); i += block_size) {
+    const size_t n = std::min(records.size() - i, block_size);
+    Append(RECORD_DONE_TASKS, &records[i],
+           static_cast<int>(n * sizeof(DoneTaskRecord)));
+  }
+}
+
+void TaskLog::Sync() {
+  base::AutoLock lock(file_lock_);
+  WriteBufferedLocked(true);
+}
+
+int64 TaskLog::log_size() {
+  base::AutoLock lock(file_lock_);
+  return log_size_;
+}
+
+int64 TaskLog::snapshot_size() {
+  base::AutoLock lock(file_lock_);
+  return snapshot_size_;
+}
+
+bool TaskLog::compacting() {
+  base::AutoLock lock(file_lock_);
+  return compacting_;
+}
+
+bool TaskLog::has_sealed_logs() {
+  base::AutoLock lock(file_lock_);
+  return log_generation_ - 1 > snapshot_generation_;
+}
+
+void TaskLog::WriteBuffered(scoped_refptr<TaskLog> self) {
+  base::AutoLock lock(self->file_lock_);
+  self->WriteBufferedLocked(false);
+}
+
+void TaskLog::WriteBufferedLocked(bool sync) {
+  std::string data;
+  {
+    base::AutoLock lock(buffer_lock_);
+    data.swap(buffer_);
+    write_scheduled_ = false;
+  }
+  if (!log_file_.IsValid()) {
+    return;
+  }
+
+  if (!data.empty()) {
+    const int written =
+        log_file_.Write(log_size_, data.data(), static_cast<int>(data.size()));
+    if (written != static_cast<int>(data.size())) {
+      LOG(ERROR) << "Failed to write log file: " << log_path_.AsUTF8Unsafe();
+    } else {
+      log_size_ += written;
+    }
+  }
+
+  const int64 now = base::Time::Now().ToInternalValue();
+  if (sync || now - last_sync_time_ >= kSyncIntervalMs * 1000) {
+    log_file_.Flush();
+    last_sync_time_ = now;
+    sync_scheduled_ = false;
+  } else if (!data.empty() && !sync_scheduled_) {
+    // Syncs the data later even if there is no more record.
+    sync_scheduled_ = true;
+    base::ThreadPool::PostDelayedTask(
+        base::ThreadPool::FILE, FROM_HERE,
+        base::Bind(&TaskLog::WriteBuffered, make_scoped_refptr(this)),
+        base::TimeDelta::FromMilliseconds(kSyncIntervalMs));
+  }
+}
+
+bool TaskLog::Compact(scoped_ptr<FoldedState> state) {
+  base::AutoLock lock(file_lock_);
+  if (compacting_ || !log_file_.IsValid()) {
+    return false;
+  }
+
+  // |state| includes the buffered records, they go to the sealed log.
+  WriteBufferedLocked(true);
+  log_file_.Close();
+  const int64 generation = log_generation_;
+  if (!base::Move(log_path_, SealedLogPath(generation))) {
+    LOG(ERROR) << "Cannot seal log file: " << log_path_.AsUTF8Unsafe();
+    log_valid_size_ = -1;
+    OpenLogLocked(false);
+    return false;
+  }
+  ++log_generation_;
+  OpenLogLocked(true);
+
+  compacting_ = true;
+  base::ThreadPool::PostBlockingPoolTask(
+      FROM_HERE, base::Bind(&TaskLog::WriteSnapshot, make_scoped_refptr(this),
+                            generation, base::Passed(&state)));
+  return true;
+}
+
+void TaskLog::WriteSnapshot(scoped_refptr<TaskLog> self, int64 generation,
+                            scoped_ptr<FoldedState> state) {
+  int64 first_generation = 0;
+  int64 epoch = 0;
+  {
+    base::AutoLock lock(self->file_lock_);
+    first_generation = self->snapshot_generation_ + 1;
+    epoch = self->epoch_;
+  }
+
+  // The results are kept by the task state file, they only need to be synced.
+  const bool external_results = self->has_external_results();
+  bool failed = external_results && !self->sync_results_.Run();
+  base::File snapshot(self->temp_snapshot_path_,
+                      base::File::FLAG_CREATE_ALWAYS | base::File::FLAG_WRITE);
+  if (!snapshot.IsValid()) {
+    failed = true;
+  }
+  int64 size = 0;
+  auto write_data = [&](const std::string& data) {
+    const int written =
+        failed ? -1 : snapshot.Write(size, data.data(),
+                                     static_cast<int>(data.size()));
+    if (written != static_cast<int>(data.size())) {
+      failed = true;
+    } else {
+      size += written;
+    }
+  };
+  auto write_record = [&](int type, const void* data, int data_size) {
+    write_data(MakeRecord(type, data, data_size));
+  };
+  write_data(MakeFileHeader(generation));
+
+  // The records declaring the tasks are kept in order, the results of the
+  // tasks they declare follow them.
+  int64 count = 0;
+  auto copy_task_records = [&](int type, const char* data, int data_size) {
+    if (type == RECORD_STAGE_TASKS || type == RECORD_INJECTED_TASKS) {
+      write_record(type, data, data_size);
+    }
+  };
+  ReplayFile(self->snapshot_path_, 0, copy_task_records, NULL, &count);
+  for (int64 i = first_generation; i <= generation; ++i) {
+    ReplayFile(self->SealedLogPath(i), 0, copy_task_records, NULL, &count);
+  }
+
+  const size_t block_size = kSnapshotBlockSize;
+  if (!external_results) {
+    auto& results = state->results;
+    for (size_t i = 0; i < results.size(); i += block_size) {
+      const size_t n = std::min(results.size() - i, block_size);
+      write_record(RECORD_TASK_RESULT, &results[i],
+                   static_cast<int>(n * sizeof(TaskResultRecord)));
+    }
+  }
+  auto& done_tasks = state->done_tasks;
+  for (size_t i = 0; i < done_tasks.size(); i += block_size) {
+    const size_t n = std::min(done_tasks.size() - i, block_size);
+    write_record(RECORD_DONE_TASKS, &done_tasks[i],
+                 static_cast<int>(n * sizeof(DoneTaskRecord)));
+  }
+  if (state->has_combined_value) {
+    // The value of the done tasks above, it has no task.
+    CombinedResultRecord header = {
+        {state->combined_value[0], state->combined_value[1]}, 0, 0};
+    write_record(RECORD_COMBINED_RESULT, &header, sizeof(header));
+  }
+  if (snapshot.IsValid() && !snapshot.Flush()) {
+    failed = true;
+  }
+  snapshot.Close();
+
+  base::AutoLock lock(self->file_lock_);
+  self->compacting_ = false;
+  if (epoch != self->epoch_) {
+    // The files are truncated, the ones Open could not delete while they
+    // were read are deleted here.
+    base::DeleteFile(self->temp_snapshot_path_, false);
+    base::DeleteFile(self->snapshot_path_, false);
+    self->DeleteSealedLogsLocked(self->log_generation_ - 1);
+    return;
+  }
+  if (failed || !base::ReplaceFile(self->temp_snapshot_path_,
+                                   self->snapshot_path_, NULL)) {
+    // The sealed logs are kept, the next compaction covers them.
+    LOG(ERROR) << "Failed to write snapshot file: "
+               << self->snapshot_path_.AsUTF8Unsafe();
+    base::DeleteFile(self->temp_snapshot_path_, false);
+    return;
+  }
+  self->DeleteSealedLogsLocked(generation);
+  self->snapshot_generation_ = generation;
+  self->snapshot_size_ = size;
+  LOG(INFO) << "Wrote snapshot of log generation " << generation
+            << ", size = " << size;
+}
+}  // namespace dpe
@@ -0,0 +1,226 @@
+#ifndef DPE_TASK_LOG_H_
+#define DPE_TASK_LOG_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "dpe_base/dpe_base.h"
+#include "third_party/chromium/base/files/file.h"
+#include "dpe/dpe.h"
+
+namespace dpe {
+// An append-only binary write-ahead log of the master state.
+//
+// A log file starts with a FileHeader (kLogMagic and the generation of the
+// file) and is followed by records. A record is a LogRecordHeader followed by
+// |size| bytes of payload. Records are buffered by Append and written by the
+// FILE thread, so the batches arrived within kGroupCommitDelay share a single
+// write. The log is synced at most every kSyncInterval and when Sync is
+// called.
+//
+// Compact seals the current log as <path>.<generation>.log, the next log has
+// the next generation. The snapshot replacing the sealed logs is written on
+// the blocking pool from the state of the master when the log is sealed: the
+// done tasks and their results or the combined value, and the records
+// declaring the tasks. The generation of the snapshot is the last sealed log
+// it covers, so a sealed log which is left by a crash is replayed only if the
+// snapshot doesn't cover it. Replay reads the snapshot, the sealed logs and
+// the log in order, a truncated or corrupted tail is ignored and removed when
+// the log is opened again.
+class TaskLog : public base::RefCountedThreadSafe<TaskLog> {
+ public:
+  enum RecordType {
+    // Payload: TaskResultRecord[n].
+    RECORD_TASK_RESULT = 1,
+    // Payload: CombinedResultRecord, int64 task_id[count].
+    RECORD_COMBINED_RESULT = 2,
+    // Payload: StageTasksRecord, int64 task_id[count].
+    RECORD_STAGE_TASKS = 3,
+    // Payload: InjectedTasksRecord, int64 task_id[count].
+    RECORD_INJECTED_TASKS = 4,
+    // Payload: DoneTaskRecord[n], the tasks whose results are in a combined
+    // value.
+    RECORD_DONE_TASKS = 5,
+  };
+
+#pragma pack(push, 4)
+  struct LogRecordHeader {
+    uint32_t type;
+    uint32_t size;
+    uint32_t checksum;
+  };
+
+  struct TaskResultRecord {
+    int64 task_id;
+    int64 result;
+    int64 time_usage;
+  };
+
+  struct DoneTaskRecord {
+    int64 task_id;
+    int64 time_usage;
+  };
+
+  // The combined value of the results of |count| tasks, |time_usage| is the
+  // sum of their time usage. The value is replayed only if none of the tasks
+  // is done, a record without tasks carries the value of tasks logged by an
+  // earlier record.
+  struct CombinedResultRecord {
+    int64 value[2];
+    int64 time_usage;
+    int64 count;
+  };
+
+  // The tasks of a stage generated by the solver.
+  struct StageTasksRecord {
+    int64 stage;
+    int64 count;
+  };
+
+  // The tasks added by the solver while the job runs.
+  struct InjectedTasksRecord {
+    int64 priority;
+    int64 count;
+  };
+#pragma pack(pop)
+
+  // The state of the master after the records of the sealed logs, it
+  // replaces their task result and combined result records in the snapshot.
+  struct FoldedState {
+    FoldedState() : has_combined_value(false) {
+      combined_value[0] = combined_value[1] = 0;
+    }
+
+    // The done tasks, empty if the results are kept in the task state file.
+    std::vector<TaskResultRecord> results;
+    // The done tasks of a combiner and the combined value of their results.
+    std::vector<DoneTaskRecord> done_tasks;
+    bool has_combined_value;
+    int64 combined_value[2];
+  };
+
+  typedef std::function<void(int type, const char* data, int size)>
+      ReplayCallback;
+  typedef base::Callback<void(int type, const char* data, int size)>
+      AppendCallback;
+
+  // |path| is the log path without extension.
+  explicit TaskLog(const std::string& path);
+
+  // Replays the records of the snapshot, the sealed logs and the log.
+  // Returns the number of replayed records.
+  int64 Replay(const ReplayCallback& callback);
+
+  // The results are kept elsewhere and the snapshot has no
+  // RECORD_TASK_RESULT. |sync| is called on the blocking pool before a sealed
+  // log is dropped and returns true if the results in it are durable. It
+  // must be set before Open.
+  void set_sync_results(const base::Callback<bool(void)>& sync) {
+    sync_results_ = sync;
+  }
+  bool has_external_results() const { return !sync_results_.is_null(); }
+
+  // |callback| is called by Append on the calling thread with every record,
+  // e.g. to replicate the records.
+  void set_append_callback(const AppendCallback& callback) {
+    append_callback_ = callback;
+  }
+
+  // Opens the log for appending. If |truncate| is true, the snapshot and the
+  // logs are discarded. The sealed logs covered by the snapshot are deleted.
+  bool Open(bool truncate);
+  void Close();
+
+  void Append(int type, const void* data, int size);
+  void AppendTaskResults(int size, const int64* task_id, const int64* result,
+                         const int64* time_usage);
+  // Large batches are split into several records.
+  void AppendTaskResults(const std::vector<TaskResultRecord>& records);
+  // |size| may be 0, see CombinedResultRecord.
+  void AppendCombinedResult(const int64* value, int64 time_usage, int size,
+                            const int64* task_id);
+  void AppendStageTasks(int stage, int size, const int64* task_id);
+  void AppendInjectedTasks(int priority, int size, const int64* task_id);
+  // Large batches are split into several records.
+  void AppendDoneTasks(const std::vector<DoneTaskRecord>& records);
+
+  // Writes the buffered records and syncs the log on the calling thread.
+  void Sync();
+
+  // Seals the log on the calling thread and writes the snapshot of |state|
+  // in background. |state| must be the state after all the appended
+  // records. Returns false if the log is not sealed, e.g. a compaction is
+  // running.
+  bool Compact(scoped_ptr<FoldedState> state);
+  bool compacting();
+  // Returns true if there are sealed logs the snapshot doesn't cover, e.g.
+  // the master stopped during a compaction.
+  bool has_sealed_logs();
+
+  int64 log_size();
+  int64 snapshot_size();
+
+ private:
+  friend class base::RefCountedThreadSafe<TaskLog>;
+  ~TaskLog();
+
+  static void WriteBuffered(scoped_refptr<TaskLog> self);
+  static void WriteSnapshot(scoped_refptr<TaskLog> self, int64 generation,
+                            scoped_ptr<FoldedState> state);
+
+  // Requires file_lock_.
+  void WriteBufferedLocked(bool sync);
+  bool OpenLogLocked(bool truncate);
+  // Reads the generations of the files if they are not replayed.
+  void ScanFilesLocked();
+  // Deletes the sealed logs up to |generation|.
+  void DeleteSealedLogsLocked(int64 generation);
+
+  base::FilePath SealedLogPath(int64 generation) const;
+
+  // Replays the records of the file if its generation is at least
+  // |min_generation|. Returns the valid size of the file, 0 if it is invalid
+  // or skipped. |generation| may be NULL.
+  static int64 ReplayFile(const base::FilePath& path, int64 min_generation,
+                          const ReplayCallback& callback, int64* generation,
+                          int64* count);
+  // Returns the generation of the file, -1 if it is invalid.
+  static int64 ReadGeneration(const base::FilePath& path);
+
+  std::string path_;
+  base::FilePath log_path_;
+  base::FilePath snapshot_path_;
+  base::FilePath temp_snapshot_path_;
+  base::Callback<bool(void)> sync_results_;
+  AppendCallback append_callback_;
+
+  // Protects buffer_ and write_scheduled_.
+  base::Lock buffer_lock_;
+  std::string buffer_;
+  bool write_scheduled_;
+
+  // Protects the fields below.
+  base::Lock file_lock_;
+  base::File log_file_;
+  int64 log_size_;
+  int64 log_valid_size_;
+  // The generation of the log, the sealed logs are the ones between the
+  // generation of the snapshot and it.
+  int64 log_generation_;
+  // The last generation covered by the snapshot, 0 if there is none.
+  int64 snapshot_generation_;
+  int64 snapshot_size_;
+  // The generations are known.
+  bool scanned_;
+  // Incremented when the files are truncated, a snapshot written for an
+  // older epoch is dropped.
+  int64 epoch_;
+  int64 last_sync_time_;
+  bool sync_scheduled_;
+  bool compacting_;
+
+  DISALLOW_COPY_AND_ASSIGN(TaskLog);
+};
+}  // namespace dpe
+#endif
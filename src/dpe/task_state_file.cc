@@ -0,0 +1,232 @@
+#include "dpe/task_state_file.h"
+
+#include <cstring>
+
+namespace dpe {
+static const char kStateMagic[8] = {'D', 'P', 'E', 'T', 'A', 'S', 'K', 'S'};
+
+#pragma pack(push, 8)
+struct TaskStateFile::FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t chunk_bits;
+  uint64_t fingerprint;
+  int64 task_count;
+  // The number of chunks allocated in the file.
+  int64 chunk_count;
+};
+#pragma pack(pop)
+
+// The column offsets in a chunk.
+static const int64 kTaskIdOffset = 0;
+static const int64 kResultOffset = TaskStorage::kChunkSize * 8;
+static const int64 kTimeUsageOffset = TaskStorage::kChunkSize * 16;
+static const int64 kStatusOffset = TaskStorage::kChunkSize * 24;
+
+TaskStateFile::TaskStateFile(const std::string& path)
+    : path_(base::UTF8ToNative(path)),
+      mapping_(NULL),
+      mapping_size_(0),
+      header_(NULL) {}
+
+TaskStateFile::~TaskStateFile() { Close(); }
+
+bool TaskStateFile::Open() {
+  Close();
+  file_.Initialize(path_, base::File::FLAG_OPEN | base::File::FLAG_READ |
+                              base::File::FLAG_WRITE);
+  if (!file_.IsValid()) {
+    return false;
+  }
+
+  const int64 length = file_.GetLength();
+  if (length < kHeaderSize || !EnsureMapping(length) || !MapHeader()) {
+    Close();
+    return false;
+  }
+
+  if (memcmp(header_->magic, kStateMagic, sizeof(kStateMagic)) != 0 ||
+      header_->version != kVersion ||
+      header_->chunk_bits != TaskStorage::kChunkBits ||
+      header_->chunk_count < 0 ||
+      header_->chunk_count > (length - kHeaderSize) / kChunkBytes) {
+    LOG(WARNING) << "Invalid task state file: " << path_.AsUTF8Unsafe();
+    Close();
+    return false;
+  }
+  return true;
+}
+
+bool TaskStateFile::Create(uint64_t fingerprint, int64 task_count) {
+  Close();
+  file_.Initialize(path_, base::File::FLAG_CREATE_ALWAYS |
+                              base::File::FLAG_READ |
+                              base::File::FLAG_WRITE);
+  if (!file_.IsValid() || !file_.SetLength(kHeaderSize) ||
+      !EnsureMapping(kHeaderSize) || !MapHeader()) {
+    LOG(ERROR) << "Cannot create task state file: " << path_.AsUTF8Unsafe();
+    Close();
+    return false;
+  }
+
+  memcpy(header_->magic, kStateMagic, sizeof(kStateMagic));
+  header_->version = kVersion;
+  header_->chunk_bits = TaskStorage::kChunkBits;
+  header_->fingerprint = fingerprint;
+  header_->task_count = task_count;
+  header_->chunk_count = 0;
+  return true;
+}
+
+void TaskStateFile::Close() {
+  base::AutoLock lock(views_lock_);
+  UnmapAllLocked();
+  if (mapping_) {
+    CloseHandle(mapping_);
+    mapping_ = NULL;
+  }
+  mapping_size_ = 0;
+  file_.Close();
+}
+
+void TaskStateFile::UnmapAllLocked() {
+  for (char* view : views_) {
+    if (view) {
+      UnmapViewOfFile(view);
+    }
+  }
+  std::vector<char*>().swap(views_);
+  if (header_) {
+    UnmapViewOfFile(header_);
+    header_ = NULL;
+  }
+}
+
+uint32_t TaskStateFile::version() const {
+  return header_ ? header_->version : 0;
+}
+
+uint64_t TaskStateFile::fingerprint() const {
+  return header_ ? header_->fingerprint : 0;
+}
+
+int64 TaskStateFile::task_count() const {
+  return header_ ? header_->task_count : 0;
+}
+
+int64 TaskStateFile::chunk_count() const {
+  return header_ ? header_->chunk_count : 0;
+}
+
+bool TaskStateFile::EnsureMapping(int64 size) {
+  if (size <= mapping_size_) {
+    return true;
+  }
+  // The file grows to |size| if it is shorter.
+  HANDLE mapping = CreateFileMapping(
+      file_.GetPlatformFile(), NULL, PAGE_READWRITE,
+      static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), NULL);
+  if (!mapping) {
+    LOG(ERROR) << "CreateFileMapping failed, size = " << size
+               << ", error = " << GetLastError();
+    return false;
+  }
+  if (mapping_) {
+    CloseHandle(mapping_);
+  }
+  mapping_ = mapping;
+  mapping_size_ = size;
+  return true;
+}
+
+char* TaskStateFile::MapView(int64 offset, int64 size) {
+  void* view = MapViewOfFile(mapping_, FILE_MAP_READ | FILE_MAP_WRITE,
+                             static_cast<DWORD>(offset >> 32),
+                             static_cast<DWORD>(offset),
+                             static_cast<SIZE_T>(size));
+  if (!view) {
+    LOG(ERROR) << "MapViewOfFile failed, offset = " << offset
+               << ", error = " << GetLastError();
+  }
+  return static_cast<char*>(view);
+}
+
+bool TaskStateFile::MapHeader() {
+  char* view = MapView(0, kHeaderSize);
+  if (!view) {
+    return false;
+  }
+  base::AutoLock lock(views_lock_);
+  header_ = reinterpret_cast<FileHeader*>(view);
+  return true;
+}
+
+bool TaskStateFile::GetChunk(int64 chunk_id, bool create, Columns* columns) {
+  if (!header_) {
+    return false;
+  }
+  const size_t id = static_cast<size_t>(chunk_id);
+  char* view = id < views_.size() ? views_[id] : NULL;
+  if (!view) {
+    if (chunk_id >= header_->chunk_count) {
+      if (!create) {
+        return false;
+      }
+      if (!EnsureMapping(kHeaderSize + (chunk_id + 1) * kChunkBytes)) {
+        return false;
+      }
+      header_->chunk_count = chunk_id + 1;
+    }
+    view = MapView(kHeaderSize + chunk_id * kChunkBytes, kChunkBytes);
+    if (!view) {
+      return false;
+    }
+    base::AutoLock lock(views_lock_);
+    if (id >= views_.size()) {
+      views_.resize(id + 1, NULL);
+    }
+    views_[id] = view;
+  }
+
+  columns->task_id = reinterpret_cast<int64*>(view + kTaskIdOffset);
+  columns->status = reinterpret_cast<uint8_t*>(view + kStatusOffset);
+  columns->result = reinterpret_cast<int64*>(view + kResultOffset);
+  columns->time_usage = reinterpret_cast<int64*>(view + kTimeUsageOffset);
+  return true;
+}
+
+void TaskStateFile::ReadDoneRecords(
+    const std::function<void(int64 task_id, int64 result, int64 time_usage)>&
+        callback) {
+  const int64 count = chunk_count();
+  for (int64 id = 0; id < count; ++id) {
+    Columns columns;
+    if (!GetChunk(id, false, &columns)) {
+      continue;
+    }
+    for (int64 i = 0; i < TaskStorage::kChunkSize; ++i) {
+      if (columns.status[i] == TaskTable::TASK_DONE) {
+        callback(columns.task_id[i], columns.result[i], columns.time_usage[i]);
+      }
+    }
+  }
+}
+
+bool TaskStateFile::Sync() {
+  {
+    base::AutoLock lock(views_lock_);
+    if (!header_) {
+      return false;
+    }
+    for (char* view : views_) {
+      if (view && !FlushViewOfFile(view, 0)) {
+        return false;
+      }
+    }
+    if (!FlushViewOfFile(header_, 0)) {
+      return false;
+    }
+  }
+  return file_.Flush();
+}
+}  // namespace dpe
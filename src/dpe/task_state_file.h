@@ -0,0 +1,91 @@
+#ifndef DPE_TASK_STATE_FILE_H_
+#define DPE_TASK_STATE_FILE_H_
+
+#include <windows.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "dpe_base/dpe_base.h"
+#include "third_party/chromium/base/files/file.h"
+#include "dpe/task_table.h"
+
+namespace dpe {
+// A memory mapped file of fixed size task records, it is used as the live
+// TaskStorage of the master so a restart only touches the pages it reads.
+//
+// The file starts with a kHeaderSize bytes header followed by the chunks. A
+// chunk stores the task_id, status, result and time_usage columns of
+// TaskStorage::kChunkSize tasks, i.e. 25 bytes per task. The chunks are
+// mapped when they are touched and the file grows by chunks.
+//
+// The header binds the file to the fingerprint of the task set, a file with
+// another version or fingerprint is not reused by the master.
+class TaskStateFile : public TaskStorage,
+                      public base::RefCountedThreadSafe<TaskStateFile> {
+ public:
+  static const uint32_t kVersion = 1;
+
+  // |path| is the full path of the file.
+  explicit TaskStateFile(const std::string& path);
+
+  // Opens an existing file. Returns false if the file doesn't exist or its
+  // header is invalid.
+  bool Open();
+  // Discards the content of the file and writes a new header.
+  bool Create(uint64_t fingerprint, int64 task_count);
+  void Close();
+
+  bool IsValid() const { return header_ != NULL; }
+  uint32_t version() const;
+  uint64_t fingerprint() const;
+  int64 task_count() const;
+
+  // Visits the DONE records of the file.
+  void ReadDoneRecords(
+      const std::function<void(int64 task_id, int64 result,
+                               int64 time_usage)>& callback);
+
+  // Flushes the mapped views and the file. It is called on the blocking
+  // pool by TaskLog.
+  bool Sync();
+
+  // TaskStorage:
+  bool GetChunk(int64 chunk_id, bool create, Columns* columns) override;
+  int64 chunk_count() const override;
+
+ private:
+  friend class base::RefCountedThreadSafe<TaskStateFile>;
+  ~TaskStateFile();
+
+  struct FileHeader;
+
+  static const int64 kHeaderSize = 64 * 1024;
+  static const int64 kChunkBytes = TaskStorage::kChunkSize * 25;
+
+  bool MapHeader();
+  // Makes mapping_ cover at least |size| bytes of the file.
+  bool EnsureMapping(int64 size);
+  char* MapView(int64 offset, int64 size);
+  // Requires views_lock_.
+  void UnmapAllLocked();
+
+  base::FilePath path_;
+  base::File file_;
+  // A mapping covers the first mapping_size_ bytes of the file, the views of
+  // a replaced mapping stay valid after its handle is closed.
+  HANDLE mapping_;
+  int64 mapping_size_;
+
+  FileHeader* header_;
+
+  // Protects views_ and header_ against Sync.
+  base::Lock views_lock_;
+  // The mapped chunks, NULL if the chunk is not mapped.
+  std::vector<char*> views_;
+
+  DISALLOW_COPY_AND_ASSIGN(TaskStateFile);
+};
+}  // namespace dpe
+#endif
@@ -0,0 +1,624 @@
+#include "dpe/task_table.h"
+
+#include <algorithm>
+
+#include "dpe_base/dpe_base.h"
+
+namespace dpe {
+static inline uint64_t HashTaskId(int64 task_id) {
+  uint64_t x = static_cast<uint64_t>(task_id);
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// The slots of the hash table per task: a table is built with
+// kSlotsPerTask and rebuilt with kGrownSlotsPerTask when it is fuller than
+// kMaxSlotLoad, so a task costs 5 to 6 bytes of slots.
+static const double kSlotsPerTask = 1.25;
+static const double kGrownSlotsPerTask = 1.5;
+static const double kMaxSlotLoad = 0.8;
+
+static inline uint64_t SlotCapacity(int64 size, double slots_per_task) {
+  return static_cast<uint64_t>(static_cast<double>(size) * slots_per_task) +
+         1;
+}
+
+static inline uint64_t MixFingerprint(uint64_t fingerprint, int64 value) {
+  return HashTaskId(static_cast<int64>(fingerprint * 0x9e3779b97f4a7c15ULL) ^
+                    value);
+}
+
+namespace {
+// Keeps the columns in memory, the task ids are not stored.
+class MemoryTaskStorage : public TaskStorage {
+ public:
+  MemoryTaskStorage() {}
+
+  bool GetChunk(int64 chunk_id, bool create, Columns* columns) override {
+    const size_t id = static_cast<size_t>(chunk_id);
+    if (id >= chunks_.size() || chunks_[id].status.empty()) {
+      if (!create) {
+        return false;
+      }
+      if (id >= chunks_.size()) {
+        chunks_.resize(id + 1);
+      }
+      chunks_[id].status.resize(kChunkSize, 0);
+      chunks_[id].result.resize(kChunkSize, 0);
+      chunks_[id].time_usage.resize(kChunkSize, 0);
+    }
+    Chunk& chunk = chunks_[id];
+    columns->task_id = NULL;
+    columns->status = &chunk.status[0];
+    columns->result = &chunk.result[0];
+    columns->time_usage = &chunk.time_usage[0];
+    return true;
+  }
+
+  int64 chunk_count() const override {
+    return static_cast<int64>(chunks_.size());
+  }
+
+ private:
+  struct Chunk {
+    std::vector<uint8_t> status;
+    std::vector<int64> result;
+    std::vector<int64> time_usage;
+  };
+  std::vector<Chunk> chunks_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryTaskStorage);
+};
+}  // namespace
+
+TaskTable::TaskTable()
+    : size_(0),
+      fingerprint_(0),
+      use_ranges_(true),
+      sorted_(true),
+      memory_storage_(new MemoryTaskStorage()),
+      storage_(memory_storage_.get()),
+      cursor_(0),
+      order_pos_(0),
+      reverse_cursor_(-1),
+      running_count_(0),
+      done_count_(0) {}
+
+TaskTable::~TaskTable() {}
+
+void TaskTable::Clear() {
+  size_ = 0;
+  fingerprint_ = 0;
+  use_ranges_ = true;
+  std::vector<TaskRange>().swap(ranges_);
+  range_index_.clear();
+  generator_ = nullptr;
+  std::vector<int64>().swap(task_id_);
+  sorted_ = true;
+  std::vector<uint32_t>().swap(slots_);
+  memory_storage_.reset(new MemoryTaskStorage());
+  storage_ = memory_storage_.get();
+  std::vector<Chunk>().swap(chunks_);
+  cursor_ = 0;
+  std::vector<int64>().swap(order_);
+  order_pos_ = 0;
+  reverse_cursor_ = -1;
+  requeued_.clear();
+  prioritized_.clear();
+  priority_.clear();
+  running_count_ = 0;
+  done_count_ = 0;
+}
+
+void TaskTable::SetDispatchOrder(std::vector<int64> order) {
+  order_ = std::move(order);
+  order_pos_ = 0;
+}
+
+void TaskTable::SetReverseDispatch(bool reverse) {
+  reverse_cursor_ = reverse ? size_ - 1 : -1;
+}
+
+void TaskTable::SetPriority(int64 index, int priority) {
+  if (index >= 0 && index < size_ && priority > 0) {
+    prioritized_.insert(std::make_pair(priority, index));
+    priority_[index] = priority;
+  }
+}
+
+void TaskTable::AttachStorage(TaskStorage* storage, bool recover) {
+  storage_ = storage;
+  memory_storage_.reset();
+  std::vector<Chunk>().swap(chunks_);
+  cursor_ = 0;
+  requeued_.clear();
+  running_count_ = 0;
+  done_count_ = 0;
+  if (!recover) {
+    return;
+  }
+
+  const int64 chunk_size = kChunkSize;
+  const int64 chunk_count =
+      std::min(storage_->chunk_count(), (size_ + chunk_size - 1) >> kChunkBits);
+  for (int64 id = 0; id < chunk_count; ++id) {
+    const Chunk* chunk = FindChunk(id << kChunkBits);
+    if (!chunk) {
+      continue;
+    }
+    const int64 end = std::min(chunk_size, size_ - (id << kChunkBits));
+    for (int64 i = 0; i < end; ++i) {
+      if (chunk->status[i] == TASK_RUNNING) {
+        chunk->status[i] = TASK_PENDING;
+      } else if (chunk->status[i] == TASK_DONE) {
+        ++done_count_;
+      }
+    }
+  }
+}
+
+void TaskTable::Reset(std::vector<int64> task_id) {
+  Clear();
+  task_id_ = std::move(task_id);
+  size_ = BuildIndex();
+}
+
+void TaskTable::ResetRanges(int size, const int64* first, const int64* last) {
+  Clear();
+  for (int i = 0; i < size; ++i) {
+    AddRange(first[i], last[i]);
+  }
+}
+
+void TaskTable::ResetGenerator(RangeGenerator generator) {
+  Clear();
+  generator_ = generator;
+}
+
+void TaskTable::PullAllRanges() {
+  while (PullRange()) {
+  }
+}
+
+int64 TaskTable::FindOrPull(int64 task_id) {
+  int64 index = IndexOf(task_id);
+  while (index < 0 && PullRange()) {
+    index = IndexOf(task_id);
+  }
+  return index;
+}
+
+bool TaskTable::PullRange() {
+  if (!generator_) {
+    return false;
+  }
+  int64 first = 0;
+  int64 last = 0;
+  if (!generator_(&first, &last)) {
+    generator_ = nullptr;
+    return false;
+  }
+  AddRange(first, last);
+  return true;
+}
+
+bool TaskTable::AddRange(int64 first, int64 last) {
+  if (first > last) {
+    return true;
+  }
+
+  auto next = range_index_.upper_bound(last);
+  if (next != range_index_.begin()) {
+    auto prev = next;
+    --prev;
+    if (ranges_[prev->second].last >= first) {
+      LOG(WARNING) << "Drop task range [" << first << ", " << last
+                   << "], it overlaps with a previous range.";
+      return false;
+    }
+  }
+
+  fingerprint_ = MixFingerprint(MixFingerprint(fingerprint_, first), last);
+  TaskRange range = {first, last, size_};
+  range_index_[first] = ranges_.size();
+  ranges_.push_back(range);
+  size_ += last - first + 1;
+  return true;
+}
+
+int64 TaskTable::BuildIndex() {
+  const int64 size = static_cast<int64>(task_id_.size());
+
+  // Uses ranges if the ids are made of a few contiguous runs.
+  int64 runs = size > 0 ? 1 : 0;
+  sorted_ = true;
+  for (int64 i = 1; i < size; ++i) {
+    if (task_id_[i] != task_id_[i - 1] + 1) ++runs;
+    if (task_id_[i] <= task_id_[i - 1]) sorted_ = false;
+  }
+
+  if (runs * 3 <= size || size == 0) {
+    bool overlapped = false;
+    int64 first = 0;
+    for (int64 i = 1; i <= size && !overlapped; ++i) {
+      if (i == size || task_id_[i] != task_id_[i - 1] + 1) {
+        overlapped = !AddRange(task_id_[first], task_id_[i - 1]);
+        first = i;
+      }
+    }
+    if (!overlapped) {
+      std::vector<int64>().swap(task_id_);
+      return size_;
+    }
+    // Duplicated ids, falls back to the explicit id list.
+    std::vector<TaskRange>().swap(ranges_);
+    range_index_.clear();
+    size_ = 0;
+  }
+
+  use_ranges_ = false;
+  fingerprint_ = MixFingerprint(0, size);
+  if (sorted_) {
+    for (int64 i = 0; i < size; ++i) {
+      fingerprint_ = MixFingerprint(fingerprint_, task_id_[i]);
+    }
+    return size;
+  }
+
+  CHECK(size < 0xffffffffLL) << "Too many tasks: " << size;
+  slots_.assign(static_cast<size_t>(SlotCapacity(size, kSlotsPerTask)), 0);
+
+  // Inserts the ids and removes the duplicated ones.
+  int64 top = 0;
+  for (int64 i = 0; i < size; ++i) {
+    const int64 id = task_id_[i];
+    uint64_t pos = FirstSlot(id);
+    bool duplicated = false;
+    while (slots_[pos] != 0) {
+      if (task_id_[slots_[pos] - 1] == id) {
+        duplicated = true;
+        break;
+      }
+      pos = NextSlot(pos);
+    }
+    if (duplicated) {
+      LOG(WARNING) << "Duplicated task id: " << id;
+      continue;
+    }
+    task_id_[top] = id;
+    slots_[pos] = static_cast<uint32_t>(++top);
+    fingerprint_ = MixFingerprint(fingerprint_, id);
+  }
+  task_id_.resize(static_cast<size_t>(top));
+  task_id_.shrink_to_fit();
+  return top;
+}
+
+int64 TaskTable::AddTasks(int size, const int64* task_id) {
+  const int64 old_size = size_;
+  if (use_ranges_) {
+    // The contiguous runs of new ids are added as ranges.
+    int64 first = 0;
+    int64 last = -1;
+    bool has_run = false;
+    for (int i = 0; i < size; ++i) {
+      const int64 id = task_id[i];
+      if (has_run && id == last + 1 && IndexOf(id) < 0) {
+        last = id;
+        continue;
+      }
+      if (has_run) {
+        AddRange(first, last);
+        has_run = false;
+      }
+      if (IndexOf(id) >= 0) {
+        LOG(WARNING) << "Duplicated task id: " << id;
+        continue;
+      }
+      first = last = id;
+      has_run = true;
+    }
+    if (has_run) {
+      AddRange(first, last);
+    }
+    return size_ - old_size;
+  }
+
+  for (int i = 0; i < size; ++i) {
+    if (IndexOf(task_id[i]) >= 0) {
+      LOG(WARNING) << "Duplicated task id: " << task_id[i];
+      continue;
+    }
+    AddExplicitTask(task_id[i]);
+  }
+  return size_ - old_size;
+}
+
+void TaskTable::AddExplicitTask(int64 task_id) {
+  CHECK(size_ + 1 < 0xffffffffLL) << "Too many tasks: " << size_ + 1;
+  fingerprint_ = MixFingerprint(fingerprint_, task_id);
+  if (sorted_ && (task_id_.empty() || task_id > task_id_.back())) {
+    task_id_.push_back(task_id);
+    ++size_;
+    return;
+  }
+
+  // An unordered id moves the lookup to the hash table.
+  if (sorted_ || static_cast<double>(size_ + 1) >
+                     static_cast<double>(slots_.size()) * kMaxSlotLoad) {
+    BuildSlots(SlotCapacity(size_ + 1, kGrownSlotsPerTask));
+  }
+  sorted_ = false;
+  task_id_.push_back(task_id);
+  ++size_;
+  uint64_t pos = FirstSlot(task_id);
+  while (slots_[pos] != 0) {
+    pos = NextSlot(pos);
+  }
+  slots_[pos] = static_cast<uint32_t>(size_);
+}
+
+void TaskTable::BuildSlots(uint64_t capacity) {
+  slots_.assign(static_cast<size_t>(capacity), 0);
+  for (int64 i = 0; i < size_; ++i) {
+    uint64_t pos = FirstSlot(task_id_[i]);
+    while (slots_[pos] != 0) {
+      pos = NextSlot(pos);
+    }
+    slots_[pos] = static_cast<uint32_t>(i + 1);
+  }
+}
+
+uint64_t TaskTable::FirstSlot(int64 task_id) const {
+  return HashTaskId(task_id) % slots_.size();
+}
+
+uint64_t TaskTable::NextSlot(uint64_t pos) const {
+  return pos + 1 == slots_.size() ? 0 : pos + 1;
+}
+
+int64 TaskTable::IndexOf(int64 task_id) const {
+  if (use_ranges_) {
+    auto where = range_index_.upper_bound(task_id);
+    if (where == range_index_.begin()) {
+      return -1;
+    }
+    --where;
+    const TaskRange& range = ranges_[where->second];
+    return task_id <= range.last ? range.offset + task_id - range.first : -1;
+  }
+
+  if (sorted_) {
+    auto where = std::lower_bound(task_id_.begin(), task_id_.end(), task_id);
+    if (where == task_id_.end() || *where != task_id) {
+      return -1;
+    }
+    return where - task_id_.begin();
+  }
+
+  uint64_t pos = FirstSlot(task_id);
+  while (slots_[pos] != 0) {
+    const int64 index = slots_[pos] - 1;
+    if (task_id_[index] == task_id) {
+      return index;
+    }
+    pos = NextSlot(pos);
+  }
+  return -1;
+}
+
+int64 TaskTable::TaskId(int64 index) const {
+  if (!use_ranges_) {
+    return task_id_[index];
+  }
+  auto where = std::upper_bound(
+      ranges_.begin(), ranges_.end(), index,
+      [](int64 idx, const TaskRange& range) { return idx < range.offset; });
+  --where;
+  return where->first + index - where->offset;
+}
+
+const TaskTable::Chunk* TaskTable::FindChunk(int64 index) const {
+  const size_t id = static_cast<size_t>(index >> kChunkBits);
+  if (id < chunks_.size() && chunks_[id].status) {
+    return &chunks_[id];
+  }
+  Chunk chunk = {NULL, NULL, NULL, NULL};
+  if (!storage_->GetChunk(id, false, &chunk)) {
+    return NULL;
+  }
+  if (id >= chunks_.size()) {
+    Chunk empty = {NULL, NULL, NULL, NULL};
+    chunks_.resize(id + 1, empty);
+  }
+  chunks_[id] = chunk;
+  return &chunks_[id];
+}
+
+TaskTable::Chunk* TaskTable::GetChunk(int64 index) {
+  const Chunk* chunk = FindChunk(index);
+  if (chunk) {
+    return const_cast<Chunk*>(chunk);
+  }
+  const size_t id = static_cast<size_t>(index >> kChunkBits);
+  Chunk new_chunk = {NULL, NULL, NULL, NULL};
+  CHECK(storage_->GetChunk(id, true, &new_chunk))
+      << "Failed to allocate task chunk " << id;
+  if (id >= chunks_.size()) {
+    Chunk empty = {NULL, NULL, NULL, NULL};
+    chunks_.resize(id + 1, empty);
+  }
+  chunks_[id] = new_chunk;
+  return &chunks_[id];
+}
+
+TaskTable::TaskStatus TaskTable::status(int64 index) const {
+  const Chunk* chunk = FindChunk(index);
+  return chunk ? static_cast<TaskStatus>(
+                     chunk->status[index & (kChunkSize - 1)])
+               : TASK_PENDING;
+}
+
+int64 TaskTable::result(int64 index) const {
+  const Chunk* chunk = FindChunk(index);
+  return chunk ? chunk->result[index & (kChunkSize - 1)] : 0;
+}
+
+int64 TaskTable::time_usage(int64 index) const {
+  const Chunk* chunk = FindChunk(index);
+  return chunk ? chunk->time_usage[index & (kChunkSize - 1)] : 0;
+}
+
+bool TaskTable::PopPending(int64* index) {
+  while (!requeued_.empty()) {
+    const int64 idx = requeued_.front();
+    requeued_.pop_front();
+    uint8_t& task_status = GetChunk(idx)->status[idx & (kChunkSize - 1)];
+    if (task_status == TASK_PENDING) {
+      task_status = TASK_RUNNING;
+      ++running_count_;
+      *index = idx;
+      return true;
+    }
+  }
+
+  while (!prioritized_.empty()) {
+    const int64 idx = prioritized_.begin()->second;
+    prioritized_.erase(prioritized_.begin());
+    if (status(idx) == TASK_PENDING) {
+      GetChunk(idx)->status[idx & (kChunkSize - 1)] = TASK_RUNNING;
+      ++running_count_;
+      *index = idx;
+      return true;
+    }
+  }
+
+  while (order_pos_ < order_.size()) {
+    const int64 idx = order_[order_pos_++];
+    if (idx >= 0 && idx < size_ && status(idx) == TASK_PENDING) {
+      GetChunk(idx)->status[idx & (kChunkSize - 1)] = TASK_RUNNING;
+      ++running_count_;
+      *index = idx;
+      return true;
+    }
+  }
+  if (order_pos_ > 0) {
+    std::vector<int64>().swap(order_);
+    order_pos_ = 0;
+  }
+
+  while (reverse_cursor_ >= 0) {
+    const int64 idx = reverse_cursor_--;
+    if (status(idx) == TASK_PENDING) {
+      GetChunk(idx)->status[idx & (kChunkSize - 1)] = TASK_RUNNING;
+      ++running_count_;
+      *index = idx;
+      return true;
+    }
+  }
+
+  for (;;) {
+    while (cursor_ < size_ && status(cursor_) != TASK_PENDING) {
+      ++cursor_;
+    }
+    if (cursor_ < size_) {
+      break;
+    }
+    if (!PullRange()) {
+      return false;
+    }
+  }
+
+  GetChunk(cursor_)->status[cursor_ & (kChunkSize - 1)] = TASK_RUNNING;
+  ++running_count_;
+  *index = cursor_++;
+  return true;
+}
+
+bool TaskTable::MarkRunning(int64 index) {
+  if (status(index) != TASK_PENDING) {
+    return false;
+  }
+  // PopPending skips the task.
+  GetChunk(index)->status[index & (kChunkSize - 1)] = TASK_RUNNING;
+  ++running_count_;
+  return true;
+}
+
+bool TaskTable::MarkDone(int64 index, int64 result, int64 time_usage) {
+  Chunk* chunk = GetChunk(index);
+  const int64 offset = index & (kChunkSize - 1);
+  const uint8_t task_status = chunk->status[offset];
+  if (task_status == TASK_DONE) {
+    return false;
+  }
+  if (task_status == TASK_RUNNING) {
+    --running_count_;
+  }
+  if (chunk->task_id) {
+    chunk->task_id[offset] = TaskId(index);
+  }
+  chunk->status[offset] = TASK_DONE;
+  chunk->result[offset] = result;
+  chunk->time_usage[offset] = time_usage;
+  ++done_count_;
+  return true;
+}
+
+void TaskTable::ForEachDone(
+    const std::function<void(int64 index)>& callback) const {
+  const int64 chunk_size = kChunkSize;
+  const int64 chunk_count =
+      std::min(storage_->chunk_count(), (size_ + chunk_size - 1) >> kChunkBits);
+  for (int64 id = 0; id < chunk_count; ++id) {
+    const Chunk* chunk = FindChunk(id << kChunkBits);
+    if (!chunk) {
+      continue;
+    }
+    const int64 begin = id << kChunkBits;
+    const int64 end = std::min(chunk_size, size_ - begin);
+    for (int64 i = 0; i < end; ++i) {
+      if (chunk->status[i] == TASK_DONE) {
+        callback(begin + i);
+      }
+    }
+  }
+}
+
+bool TaskTable::IsAllDone() {
+  while (done_count_ == size_ && PullRange()) {
+  }
+  return IsComplete() && done_count_ == size_;
+}
+
+void TaskTable::Requeue(int64 index) {
+  if (status(index) != TASK_RUNNING) {
+    return;
+  }
+  GetChunk(index)->status[index & (kChunkSize - 1)] = TASK_PENDING;
+  --running_count_;
+  PushPending(index);
+}
+
+void TaskTable::ResetDone(int64 index) {
+  if (status(index) != TASK_DONE) {
+    return;
+  }
+  GetChunk(index)->status[index & (kChunkSize - 1)] = TASK_PENDING;
+  --done_count_;
+  PushPending(index);
+}
+
+void TaskTable::PushPending(int64 index) {
+  auto where = priority_.find(index);
+  if (where != priority_.end()) {
+    prioritized_.insert(std::make_pair(where->second, index));
+  } else {
+    requeued_.push_front(index);
+  }
+}
+}  // namespace dpe
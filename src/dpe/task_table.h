@@ -0,0 +1,220 @@
+#ifndef DPE_TASK_TABLE_H_
+#define DPE_TASK_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include "dpe_base/dpe_base.h"
+#include "dpe/dpe.h"
+
+namespace dpe {
+// The storage of the task columns used by TaskTable. The columns of the tasks
+// [chunk_id << kChunkBits, (chunk_id + 1) << kChunkBits) form a chunk, a new
+// chunk is zero filled, i.e. all the tasks are PENDING.
+class TaskStorage {
+ public:
+  static const int kChunkBits = 16;
+  static const int64 kChunkSize = 1LL << kChunkBits;
+
+  struct Columns {
+    // It may be NULL if the storage doesn't keep the ids.
+    int64* task_id;
+    uint8_t* status;
+    int64* result;
+    int64* time_usage;
+  };
+
+  virtual ~TaskStorage() {}
+
+  // Returns false if the chunk doesn't exist and |create| is false.
+  virtual bool GetChunk(int64 chunk_id, bool create, Columns* columns) = 0;
+  // The number of chunks which may contain data.
+  virtual int64 chunk_count() const = 0;
+};
+
+// A dense task store used by DPEMasterNode.
+//
+// A task is addressed by its index, i.e. its position in the task queue
+// declared by the Solver. The ids are stored either as [first, last] ranges
+// or as an explicit id list. The id -> index lookup of a range is a search in
+// the ordered ranges, an explicit id list uses a binary search if it is
+// sorted and an open addressing hash table otherwise.
+//
+// The status, result and time usage of the tasks are stored in separate
+// columns which are allocated in chunks when a task of the chunk is touched,
+// so a range based table costs O(#ranges) memory until tasks are handed out.
+//
+// Memory per touched task: 17 bytes for range based ids, 25 bytes for sorted
+// ids and up to 31 bytes otherwise, since the hash table has 1.25 to 1.5
+// 4-byte slots per task.
+//
+// The columns are kept in memory unless a TaskStorage is attached, e.g. a
+// memory mapped TaskStateFile.
+class TaskTable {
+ public:
+  // The values are the same as TaskItem::TaskStatus.
+  enum TaskStatus {
+    TASK_PENDING = 0,
+    TASK_RUNNING = 1,
+    TASK_DONE = 2,
+  };
+
+  // Returns false if there is no more range.
+  typedef std::function<bool(int64* first, int64* last)> RangeGenerator;
+
+  TaskTable();
+  ~TaskTable();
+
+  // Replaces the content of the table, all the tasks are PENDING.
+  // Duplicated ids are removed.
+  void Reset(std::vector<int64> task_id);
+  // Replaces the content of the table by the [first[i], last[i]] ranges.
+  // A range overlapping with a previous range is dropped.
+  void ResetRanges(int size, const int64* first, const int64* last);
+  // Replaces the content of the table by the ranges returned by |generator|.
+  // The ranges are pulled when the pending tasks are exhausted.
+  void ResetGenerator(RangeGenerator generator);
+  // Pulls all the remaining ranges from the generator.
+  void PullAllRanges();
+  // Appends the tasks after the known tasks, the known ids are skipped.
+  // Returns the number of added tasks.
+  int64 AddTasks(int size, const int64* task_id);
+
+  // Stores the columns in |storage| instead of the memory, |storage| is not
+  // owned and must outlive the table. If |recover| is true, the columns in
+  // |storage| are used as the task status and the RUNNING tasks become
+  // PENDING, it scans the status of every chunk in |storage|, i.e. O(tasks)
+  // once the tasks are handed out. Otherwise |storage| is expected to be
+  // empty.
+  // Reset* detaches the storage.
+  void AttachStorage(TaskStorage* storage, bool recover);
+
+  // A hash of the task ids declared so far.
+  uint64_t fingerprint() const { return fingerprint_; }
+
+  // The number of known tasks. It may grow if the table has a generator.
+  int64 size() const { return size_; }
+  bool IsComplete() const { return generator_ == nullptr; }
+
+  // Returns -1 if |task_id| is unknown.
+  int64 IndexOf(int64 task_id) const;
+  // The same as IndexOf, but pulls more ranges from the generator until
+  // |task_id| is found, e.g. a result of the previous run is replayed.
+  int64 FindOrPull(int64 task_id);
+  int64 TaskId(int64 index) const;
+
+  TaskStatus status(int64 index) const;
+  int64 result(int64 index) const;
+  int64 time_usage(int64 index) const;
+
+  // Takes the next pending task and marks it as RUNNING.
+  bool PopPending(int64* index);
+  // Marks a PENDING task as RUNNING. Returns false if it is not PENDING.
+  bool MarkRunning(int64 index);
+  // Marks a task as DONE. Returns false if it was DONE.
+  bool MarkDone(int64 index, int64 result, int64 time_usage);
+  // Moves a RUNNING task back to the pending queue, it will be the next
+  // task returned by PopPending. A task with priority goes back to the
+  // tasks of its priority instead.
+  void Requeue(int64 index);
+  // Moves a DONE task back to the pending queue, e.g. its result is lost.
+  void ResetDone(int64 index);
+
+  // PopPending returns the pending tasks in |order| (task indexes) before
+  // the other pending tasks.
+  void SetDispatchOrder(std::vector<int64> order);
+  // PopPending returns the pending tasks in descending index order, except
+  // the ones in the dispatch order and the tasks pulled afterwards.
+  void SetReverseDispatch(bool reverse);
+  // PopPending returns the pending task at |index| before the tasks of lower
+  // priority and the tasks without priority, the tasks of the same priority
+  // in the order they are set. |priority| is positive.
+  void SetPriority(int64 index, int priority);
+
+  int64 pending_count() const {
+    return size() - running_count_ - done_count_;
+  }
+  int64 running_count() const { return running_count_; }
+  int64 done_count() const { return done_count_; }
+  // Calls |callback| with the index of every DONE task in index order. Only
+  // the touched chunks are visited, so it doesn't scan a large range of
+  // untouched tasks.
+  void ForEachDone(const std::function<void(int64 index)>& callback) const;
+  // Pulls more ranges from the generator if all the known tasks are done.
+  bool IsAllDone();
+
+ private:
+  struct TaskRange {
+    int64 first;
+    int64 last;
+    // The index of |first|.
+    int64 offset;
+  };
+
+  typedef TaskStorage::Columns Chunk;
+
+  static const int kChunkBits = TaskStorage::kChunkBits;
+  static const int64 kChunkSize = TaskStorage::kChunkSize;
+
+  void Clear();
+  // Returns false if the range overlaps with a previous range.
+  bool AddRange(int64 first, int64 last);
+  bool PullRange();
+  // Puts a pending task back to requeued_ or prioritized_.
+  void PushPending(int64 index);
+  // Returns the number of tasks.
+  int64 BuildIndex();
+  // Builds the hash table of the explicit ids.
+  void BuildSlots(uint64_t capacity);
+  // The probe sequence of |task_id| in slots_, it wraps around.
+  uint64_t FirstSlot(int64 task_id) const;
+  uint64_t NextSlot(uint64_t pos) const;
+  void AddExplicitTask(int64 task_id);
+  const Chunk* FindChunk(int64 index) const;
+  Chunk* GetChunk(int64 index);
+
+  int64 size_;
+  uint64_t fingerprint_;
+
+  // Range based ids.
+  bool use_ranges_;
+  std::vector<TaskRange> ranges_;
+  // first -> position in ranges_.
+  std::map<int64, size_t> range_index_;
+  RangeGenerator generator_;
+
+  // Explicit ids, only used if !use_ranges_.
+  std::vector<int64> task_id_;
+  bool sorted_;
+
+  // Open addressing hash table with linear probing, it stores index + 1 and
+  // 0 means empty. The capacity is not a power of two, so the table is no
+  // larger than the load factor needs. Only used if !use_ranges_ && !sorted_.
+  std::vector<uint32_t> slots_;
+
+  scoped_ptr<TaskStorage> memory_storage_;
+  TaskStorage* storage_;
+  // The chunks loaded from storage_, status is NULL if it is not loaded.
+  mutable std::vector<Chunk> chunks_;
+
+  // Tasks before cursor_ are not pending unless they are in requeued_.
+  int64 cursor_;
+  std::vector<int64> order_;
+  size_t order_pos_;
+  // Tasks after reverse_cursor_ are not pending unless they are in requeued_
+  // or they are pulled later. It is -1 if the dispatch is not reversed.
+  int64 reverse_cursor_;
+  std::deque<int64> requeued_;
+  // Priority -> the tasks with the priority, the highest priority first.
+  std::multimap<int, int64, std::greater<int>> prioritized_;
+  // Task index -> priority, kept to requeue the task with its priority.
+  std::map<int64, int> priority_;
+  int64 running_count_;
+  int64 done_count_;
+};
+}  // namespace dpe
+#endif